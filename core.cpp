@@ -7,7 +7,14 @@ void llog(int level, const char *file, const char *func, int pos, const char *fm
     auto now = time(nullptr);
     auto ms = (int) std::chrono::duration_cast<std::chrono::milliseconds>(
             std::chrono::system_clock::now().time_since_epoch()).count() % 1000;
-    auto tm = localtime(&now);
+    // SaveJob threads log too, localtime is not reentrant
+    struct tm tm_buf;
+#ifdef _WIN32
+    localtime_s(&tm_buf, &now);
+#else
+    localtime_r(&now, &tm_buf);
+#endif
+    auto tm = &tm_buf;
 
     // print log to stdout or stderr, and use color to distinguish different log level
     // 2020-01-01 00:00:00.000 [DEBUG] core.cpp:main:123: hello world
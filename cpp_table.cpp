@@ -47,8 +47,111 @@ String::~String() {
     }
 }
 
+LayoutPlanner::LayoutPlanner(LayoutPtr old_layout) {
+    m_old_layout = old_layout;
+    if (!old_layout) {
+        return;
+    }
+    // members are never removed from layout, so bytes not used by any of them are still zero in every container
+    std::set<int> used_flag;
+    std::set<int> flag_byte;
+    for (auto &it: old_layout->GetMember()) {
+        auto mem = it.second;
+        Occupy(mem->pos, mem->size - 1);
+        Occupy(mem->flag >> 3, 1);
+        used_flag.insert(mem->flag);
+        flag_byte.insert(mem->flag >> 3);
+    }
+    for (auto it = flag_byte.rbegin(); it != flag_byte.rend(); ++it) {
+        for (int bit = 7; bit >= 0; --bit) {
+            int flag = *it * 8 + bit;
+            if (used_flag.find(flag) == used_flag.end()) {
+                m_free_flag.push_back(flag);
+            }
+        }
+    }
+    m_total_size = old_layout->GetTotalSize();
+}
+
+void LayoutPlanner::Occupy(int pos, int size) {
+    if (pos + size > (int) m_used.size()) {
+        m_used.resize(pos + size, 0);
+    }
+    for (int i = pos; i < pos + size; ++i) {
+        m_used[i] = 1;
+    }
+}
+
+int LayoutPlanner::Alloc(int size, int align) {
+    for (int pos = 0;; pos += align) {
+        bool ok = true;
+        for (int i = pos; i < pos + size && i < (int) m_used.size(); ++i) {
+            if (m_used[i]) {
+                ok = false;
+                break;
+            }
+        }
+        if (ok) {
+            Occupy(pos, size);
+            return pos;
+        }
+    }
+}
+
+int LayoutPlanner::Plan(std::vector<Field> &fields) {
+    std::vector<Field *> new_fields;
+    for (auto &field: fields) {
+        Layout::MemberPtr old;
+        if (m_old_layout) {
+            old = m_old_layout->GetMember(field.tag);
+        }
+        if (old) {
+            if (old->size - 1 != field.size) {
+                return -1;
+            }
+            field.pos = old->pos;
+            field.flag = old->flag;
+        } else {
+            new_fields.push_back(&field);
+        }
+    }
+
+    std::sort(new_fields.begin(), new_fields.end(), [](const Field *a, const Field *b) {
+        if (a->hot != b->hot) {
+            return a->hot < b->hot;
+        }
+        if (Align(a->size) != Align(b->size)) {
+            return Align(a->size) > Align(b->size);
+        }
+        if (a->size != b->size) {
+            return a->size > b->size;
+        }
+        return a->tag < b->tag;
+    });
+
+    // presence bits first, every access touches them
+    for (auto field: new_fields) {
+        if (m_free_flag.empty()) {
+            int byte = Alloc(1, 1);
+            for (int bit = 7; bit >= 0; --bit) {
+                m_free_flag.push_back(byte * 8 + bit);
+            }
+        }
+        field->flag = m_free_flag.back();
+        m_free_flag.pop_back();
+    }
+
+    for (auto field: new_fields) {
+        field->pos = Alloc(field->size, Align(field->size));
+    }
+
+    return std::max(m_total_size, (int) m_used.size());
+}
+
 Container::Container(LayoutPtr layout) : RefCntObj(rot_container) {
     m_layout = layout;
+    m_layout->GetContainerStat().count++;
+    m_layout->GetContainerStat().bytes += sizeof(Container);
     LLOG("Container::Container: %s %p", GetName().data(), this);
 }
 
@@ -58,6 +161,8 @@ Container::~Container() {
     if (m_buffer) {
         delete[] m_buffer;
     }
+    m_layout->GetContainerStat().count--;
+    m_layout->GetContainerStat().bytes -= sizeof(Container) + m_buffer_size;
 }
 
 LuaContainerHolder::~LuaContainerHolder() {
@@ -72,11 +177,13 @@ void Container::ReleaseAllSharedObj() {
             continue;
         }
         int pos = mem->pos;
-        SharedPtr<RefCntObj> out;
+        int flag = mem->flag;
+        RefCntObj *out = 0;
         bool is_nil = false;
-        auto ret = GetSharedObj<RefCntObj>(pos, out, is_nil);
+        auto ret = Load<RefCntObj *>(pos, flag, out, is_nil);
         if (!ret) {
-            LERR("Container::ReleaseAllSharedObj: %s invalid pos %d", m_layout->GetName()->data(), pos);
+            LERR("Container::ReleaseAllSharedObj: %s invalid pos %d flag %d", m_layout->GetName()->data(), pos,
+                 flag);
             return;
         }
         if (!is_nil) {
@@ -87,14 +194,25 @@ void Container::ReleaseAllSharedObj() {
 
 Array::Array(Layout::MemberPtr layout_member) : RefCntObj(rot_array) {
     m_layout_member = layout_member;
+    m_layout_member->mem_stat.count++;
+    m_layout_member->mem_stat.bytes += sizeof(Array);
 }
 
 Array::~Array() {
     LLOG("Array::~Array: %s %p", GetName().data(), this);
     ReleaseAllSharedObj();
+    auto &stat = m_layout_member->mem_stat;
+    for (int i = 0; i < m_buffer_size; i += m_layout_member->key_size) {
+        if (m_buffer[i] & 0x01) {
+            stat.size--;
+        }
+    }
     if (m_buffer) {
         delete[] m_buffer;
     }
+    stat.count--;
+    stat.bytes -= sizeof(Array) + m_buffer_size;
+    stat.capacity -= m_buffer_size / m_layout_member->key_size;
 }
 
 void Array::ReleaseAllSharedObj() {
@@ -119,12 +237,18 @@ void Array::ReleaseAllSharedObj() {
 Map::Map(Layout::MemberPtr layout_member) : RefCntObj(rot_map) {
     m_layout_member = layout_member;
     m_map.m_void = 0;
+    auto backend = layout_member->map_backend ? layout_member->map_backend : gLayoutMgr.GetMapBackend();
+    m_swiss = backend == mb_swiss;
+    m_layout_member->mem_stat.count++;
+    m_layout_member->mem_stat.bytes += sizeof(Map);
     LLOG("Map::Map: %s %p", layout_member->name->data(), this);
 }
 
 Map::~Map() {
     LLOG("Map::~Map: %s %p", GetName().data(), this);
     ReleaseAllSharedObj();
+    m_layout_member->mem_stat.count--;
+    m_layout_member->mem_stat.bytes -= sizeof(Map);
 }
 
 void Map::ReleaseAllSharedObj() {
@@ -144,27 +268,23 @@ void Map::ReleaseAllSharedObj() {
                 case mt_uint32:
                 case mt_float:
                 case mt_bool: {
-                    delete m_map.m_32_32;
-                    m_map.m_32_32 = 0;
+                    DeleteWithStat(m_map.m_32_32);
                     break;
                 }
                 case mt_int64:
                 case mt_uint64:
                 case mt_double: {
-                    delete m_map.m_32_64;
-                    m_map.m_32_64 = 0;
+                    DeleteWithStat(m_map.m_32_64);
                     break;
                 }
                 case mt_string: {
                     ReleaseStrBy32();
-                    delete m_map.m_32_64;
-                    m_map.m_32_64 = 0;
+                    DeleteWithStat(m_map.m_32_64);
                     break;
                 }
                 default: {
                     ReleaseObjBy32();
-                    delete m_map.m_32_64;
-                    m_map.m_32_64 = 0;
+                    DeleteWithStat(m_map.m_32_64);
                     break;
                 }
             }
@@ -178,27 +298,23 @@ void Map::ReleaseAllSharedObj() {
                 case mt_uint32:
                 case mt_float:
                 case mt_bool: {
-                    delete m_map.m_64_32;
-                    m_map.m_64_32 = 0;
+                    DeleteWithStat(m_map.m_64_32);
                     break;
                 }
                 case mt_int64:
                 case mt_uint64:
                 case mt_double: {
-                    delete m_map.m_64_64;
-                    m_map.m_64_64 = 0;
+                    DeleteWithStat(m_map.m_64_64);
                     break;
                 }
                 case mt_string: {
                     ReleaseStrBy64();
-                    delete m_map.m_64_64;
-                    m_map.m_64_64 = 0;
+                    DeleteWithStat(m_map.m_64_64);
                     break;
                 }
                 default: {
                     ReleaseObjBy64();
-                    delete m_map.m_64_64;
-                    m_map.m_64_64 = 0;
+                    DeleteWithStat(m_map.m_64_64);
                     break;
                 }
             }
@@ -211,27 +327,23 @@ void Map::ReleaseAllSharedObj() {
                 case mt_uint32:
                 case mt_float:
                 case mt_bool: {
-                    delete m_map.m_string_32;
-                    m_map.m_string_32 = 0;
+                    DeleteWithStat(m_map.m_string_32);
                     break;
                 }
                 case mt_int64:
                 case mt_uint64:
                 case mt_double: {
-                    delete m_map.m_string_64;
-                    m_map.m_string_64 = 0;
+                    DeleteWithStat(m_map.m_string_64);
                     break;
                 }
                 case mt_string: {
                     ReleaseStrByString();
-                    delete m_map.m_string_64;
-                    m_map.m_string_64 = 0;
+                    DeleteWithStat(m_map.m_string_64);
                     break;
                 }
                 default: {
                     ReleaseObjByString();
-                    delete m_map.m_string_64;
-                    m_map.m_string_64 = 0;
+                    DeleteWithStat(m_map.m_string_64);
                     break;
                 }
             }
@@ -246,6 +358,192 @@ void Map::ReleaseAllSharedObj() {
     }
 }
 
+void Map::Reserve(int n) {
+    int value_message_id = m_layout_member->value_message_id;
+    bool value_32 = value_message_id == mt_int32 || value_message_id == mt_uint32 ||
+                    value_message_id == mt_float || value_message_id == mt_bool;
+    switch (m_layout_member->message_id) {
+        case mt_int32:
+        case mt_uint32:
+        case mt_bool: {
+            if (value_32) {
+                ReserveWithStat(m_map.m_32_32, n);
+            } else {
+                ReserveWithStat(m_map.m_32_64, n);
+            }
+            break;
+        }
+        case mt_int64:
+        case mt_uint64: {
+            if (value_32) {
+                ReserveWithStat(m_map.m_64_32, n);
+            } else {
+                ReserveWithStat(m_map.m_64_64, n);
+            }
+            break;
+        }
+        case mt_string: {
+            if (value_32) {
+                ReserveWithStat(m_map.m_string_32, n);
+            } else {
+                ReserveWithStat(m_map.m_string_64, n);
+            }
+            break;
+        }
+        default: {
+            LERR("Map::Reserve: %s invalid key message_id %d", m_layout_member->name->data(),
+                 m_layout_member->message_id);
+            break;
+        }
+    }
+}
+
+int64_t Map::Compact() {
+    int value_message_id = m_layout_member->value_message_id;
+    bool value_32 = value_message_id == mt_int32 || value_message_id == mt_uint32 ||
+                    value_message_id == mt_float || value_message_id == mt_bool;
+    switch (m_layout_member->message_id) {
+        case mt_int32:
+        case mt_uint32:
+        case mt_bool: {
+            return value_32 ? CompactWithStat(m_map.m_32_32) : CompactWithStat(m_map.m_32_64);
+        }
+        case mt_int64:
+        case mt_uint64: {
+            return value_32 ? CompactWithStat(m_map.m_64_32) : CompactWithStat(m_map.m_64_64);
+        }
+        case mt_string: {
+            return value_32 ? CompactWithStat(m_map.m_string_32) : CompactWithStat(m_map.m_string_64);
+        }
+        default: {
+            LERR("Map::Compact: %s invalid key message_id %d", m_layout_member->name->data(),
+                 m_layout_member->message_id);
+            return 0;
+        }
+    }
+}
+
+void Map::PlanArray() {
+    int value_message_id = m_layout_member->value_message_id;
+    bool value_32 = value_message_id == mt_int32 || value_message_id == mt_uint32 ||
+                    value_message_id == mt_float || value_message_id == mt_bool;
+    switch (m_layout_member->message_id) {
+        case mt_int32:
+        case mt_uint32:
+        case mt_bool: {
+            value_32 ? PlanArrayWithStat(m_map.m_32_32) : PlanArrayWithStat(m_map.m_32_64);
+            break;
+        }
+        case mt_int64:
+        case mt_uint64: {
+            value_32 ? PlanArrayWithStat(m_map.m_64_32) : PlanArrayWithStat(m_map.m_64_64);
+            break;
+        }
+        default: {
+            // string keys have no array part
+            break;
+        }
+    }
+}
+
+int64_t DeepSizer::Size(String *obj) {
+    if (!obj || !Visit(obj)) {
+        return 0;
+    }
+    return sizeof(String) + obj->size() + 1;
+}
+
+int64_t DeepSizer::SizeByMessageId(RefCntObj *obj, int message_id) {
+    if (message_id == mt_string) {
+        return Size((String *) obj);
+    } else if (message_id > mt_string) {
+        return Size((Container *) obj);
+    }
+    return 0;
+}
+
+int64_t DeepSizer::Size(Container *obj) {
+    if (!obj || !Visit(obj)) {
+        return 0;
+    }
+    int64_t ret = sizeof(Container) + obj->GetBufferSize();
+    for (auto &it: obj->GetLayout()->GetMember()) {
+        auto mem = it.second;
+        if (!mem || !mem->shared) {
+            continue;
+        }
+        RefCntObj *value = 0;
+        bool is_nil = false;
+        if (!obj->Load<RefCntObj *>(mem->pos, mem->flag, value, is_nil) || is_nil) {
+            continue;
+        }
+        if (!strcmp(mem->type->c_str(), "array")) {
+            ret += Size((Array *) value);
+        } else if (!strcmp(mem->type->c_str(), "map")) {
+            ret += Size((Map *) value);
+        } else {
+            ret += SizeByMessageId(value, mem->message_id);
+        }
+    }
+    return ret;
+}
+
+int64_t DeepSizer::Size(Array *obj) {
+    if (!obj || !Visit(obj)) {
+        return 0;
+    }
+    int64_t ret = sizeof(Array) + obj->GetBufferSize();
+    auto mem = obj->GetLayoutMember();
+    if (!mem->key_shared) {
+        return ret;
+    }
+    int element_size = obj->GetBufferSize() / mem->key_size;
+    for (int i = 0; i < element_size; ++i) {
+        RefCntObj *value = 0;
+        bool is_nil = false;
+        if (obj->Get<RefCntObj *>(i, value, is_nil) && !is_nil) {
+            ret += SizeByMessageId(value, mem->message_id);
+        }
+    }
+    return ret;
+}
+
+int64_t DeepSizer::Size(Map *obj) {
+    if (!obj || !Visit(obj)) {
+        return 0;
+    }
+    int64_t ret = sizeof(Map);
+    auto map = obj->GetMap();
+    if (!map.m_void) {
+        return ret;
+    }
+    int value_message_id = obj->GetValueMessageId();
+    bool value_32 = value_message_id == mt_int32 || value_message_id == mt_uint32 ||
+                    value_message_id == mt_float || value_message_id == mt_bool;
+    switch (obj->GetKeyMessageId()) {
+        case mt_int32:
+        case mt_uint32:
+        case mt_bool: {
+            ret += value_32 ? MapSize(map.m_32_32, value_message_id) : MapSize(map.m_32_64, value_message_id);
+            break;
+        }
+        case mt_int64:
+        case mt_uint64: {
+            ret += value_32 ? MapSize(map.m_64_32, value_message_id) : MapSize(map.m_64_64, value_message_id);
+            break;
+        }
+        case mt_string: {
+            ret += value_32 ? MapSize(map.m_string_32, value_message_id) : MapSize(map.m_string_64, value_message_id);
+            break;
+        }
+        default: {
+            LERR("DeepSizer::Size: %s invalid key message_id %d", obj->GetName().data(), obj->GetKeyMessageId());
+            break;
+        }
+    }
+    return ret;
+}
+
 static int cpp_table_set_message_id(lua_State *L) {
     size_t name_size = 0;
     const char *name = lua_tolstring(L, 1, &name_size);
@@ -302,6 +600,83 @@ static bool cpp_table_get_layout_member_string(lua_State *L, const char *name, S
     return true;
 }
 
+static int cpp_table_plan_layout(lua_State *L) {
+    size_t name_size = 0;
+    const char *name = lua_tolstring(L, 1, &name_size);
+    if (name_size == 0) {
+        luaL_error(L, "cpp_table_plan_layout: invalid name %s", name);
+        return 0;
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    // optional hot hints, array of member names, hotter first
+    std::unordered_map<std::string, int> hot;
+    if (lua_type(L, 3) == LUA_TTABLE) {
+        int len = lua_rawlen(L, 3);
+        for (int i = 1; i <= len; ++i) {
+            lua_rawgeti(L, 3, i);
+            if (lua_type(L, -1) == LUA_TSTRING) {
+                hot.emplace(lua_tostring(L, -1), i);
+            }
+            lua_pop(L, 1);
+        }
+    }
+
+    std::vector<std::string> names;
+    std::vector<LayoutPlanner::Field> fields;
+    lua_pushnil(L);
+    while (lua_next(L, 2) != 0) {
+        if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TTABLE) {
+            luaL_error(L, "cpp_table_plan_layout: invalid member type %d %d", lua_type(L, -2), lua_type(L, -1));
+            return 0;
+        }
+        std::string member_name = lua_tostring(L, -2);
+        LayoutPlanner::Field field;
+        if (!cpp_table_get_layout_member_number(L, "tag", field.tag)) {
+            return 0;
+        }
+        int size = 0;
+        if (!cpp_table_get_layout_member_number(L, "size", size)) {
+            return 0;
+        }
+        field.size = size - 1;
+        if (field.size <= 0) {
+            luaL_error(L, "cpp_table_plan_layout: %s invalid size %d", member_name.c_str(), size);
+            return 0;
+        }
+        auto it = hot.find(member_name);
+        field.hot = it != hot.end() ? it->second : (int) hot.size() + 1;
+        names.push_back(member_name);
+        fields.push_back(field);
+        lua_pop(L, 1);
+    }
+
+    auto layout_key = gStringHeap.Add(StringView(name, name_size));
+    LayoutPlanner planner(gLayoutMgr.GetLayout(layout_key));
+    int total_size = planner.Plan(fields);
+    if (total_size < 0) {
+        luaL_error(L, "cpp_table_plan_layout: %s member size changed", name);
+        return 0;
+    }
+
+    // return { name = { pos = pos, flag = flag } }, total_size
+    lua_newtable(L);
+    for (size_t i = 0; i < fields.size(); ++i) {
+        lua_pushstring(L, names[i].c_str());
+        lua_newtable(L);
+        lua_pushstring(L, "pos");
+        lua_pushinteger(L, fields[i].pos);
+        lua_settable(L, -3);
+        lua_pushstring(L, "flag");
+        lua_pushinteger(L, fields[i].flag);
+        lua_settable(L, -3);
+        lua_settable(L, -3);
+    }
+    lua_pushinteger(L, total_size);
+    LLOG("cpp_table_plan_layout: %s total size %d", name, total_size);
+    return 2;
+}
+
 static int cpp_table_update_layout(lua_State *L) {
     size_t name_size = 0;
     const char *name = lua_tolstring(L, 1, &name_size);
@@ -310,6 +685,12 @@ static int cpp_table_update_layout(lua_State *L) {
         return 0;
     }
     luaL_checktype(L, 2, LUA_TTABLE);
+    // total size comes from cpp_table_plan_layout, members may leave holes or be deleted
+    int total_size = lua_tointeger(L, 3);
+    if (total_size < 0) {
+        luaL_error(L, "cpp_table_update_layout: invalid total size %d", total_size);
+        return 0;
+    }
 
     auto layout_key = gStringHeap.Add(StringView(name, name_size));
     auto layout = gLayoutMgr.GetLayout(layout_key);
@@ -324,13 +705,13 @@ static int cpp_table_update_layout(lua_State *L) {
     //         key = v.key,
     //         value = v.value,
     //         pos = pos,
+    //         flag = flag,
     //         size = v.size,
     //         tag = v.tag,
     //         shared = v.shared,
     //     }
     // }
     lua_pushnil(L);
-    int total_size = 0;
     while (lua_next(L, 2) != 0) {
         auto mem = MakeShared<Layout::Member>();
         // name
@@ -371,11 +752,22 @@ static int cpp_table_update_layout(lua_State *L) {
             return 0;
         }
 
+        // flag
+        if (!cpp_table_get_layout_member_number(L, "flag", mem->flag)) {
+            return 0;
+        }
+
         // size
         if (!cpp_table_get_layout_member_number(L, "size", mem->size)) {
             return 0;
         }
 
+        if (mem->pos + mem->size - 1 > total_size || (mem->flag >> 3) >= total_size) {
+            luaL_error(L, "cpp_table_update_layout: %s out of total size %d %d %d", name, mem->pos, mem->flag,
+                       total_size);
+            return 0;
+        }
+
         // tag
         if (!cpp_table_get_layout_member_number(L, "tag", mem->tag)) {
             return 0;
@@ -413,8 +805,6 @@ static int cpp_table_update_layout(lua_State *L) {
             layout->SetMember(mem->tag, mem);
         }
         lua_pop(L, 1);
-
-        total_size += mem->size;
     }
 
     auto message_id = gLayoutMgr.GetMessageId(layout_key);
@@ -423,26 +813,63 @@ static int cpp_table_update_layout(lua_State *L) {
         return 0;
     }
 
+    layout->UpdateFlagIndex();
+    layout->SetFieldStat(gLayoutMgr.GetFieldStat());
+
     layout->SetMessageId(message_id);
     layout->SetName(layout_key);
-    layout->SetTotalSize(total_size);
+    // never shrink, old containers may still use the tail
+    layout->SetTotalSize(std::max(total_size, layout->GetTotalSize()));
     LLOG("cpp_table_update_layout: %s total size %d message_id %d", name, total_size, message_id);
 
     return 0;
 }
 
-static int cpp_table_dump_statistic(lua_State *L) {
+static void cpp_table_push_memory_stat(lua_State *L, const char *name, const MemoryStat &stat) {
+    lua_pushstring(L, name);
     lua_newtable(L);
+    lua_pushstring(L, "count");
+    lua_pushinteger(L, stat.count);
+    lua_settable(L, -3);
+    lua_pushstring(L, "bytes");
+    lua_pushinteger(L, stat.bytes);
+    lua_settable(L, -3);
+    lua_pushstring(L, "capacity");
+    lua_pushinteger(L, stat.capacity);
+    lua_settable(L, -3);
+    lua_pushstring(L, "size");
+    lua_pushinteger(L, stat.size);
+    lua_settable(L, -3);
+    lua_settable(L, -3);
+}
 
-    auto ret = gStringHeap.Dump();
-    lua_pushstring(L, "string_heap");
+static void cpp_table_push_refcount(lua_State *L, const char *name, const std::map<int, int64_t> &distribution) {
+    lua_pushstring(L, name);
     lua_newtable(L);
-    for (size_t i = 0; i < ret.size(); ++i) {
-        lua_pushinteger(L, i + 1);
-        lua_pushlstring(L, ret[i]->data(), ret[i]->size());
+    for (auto &it: distribution) {
+        lua_pushinteger(L, it.first);
+        lua_pushinteger(L, it.second);
         lua_settable(L, -3);
     }
     lua_settable(L, -3);
+}
+
+static int cpp_table_dump_statistic(lua_State *L) {
+    bool dump_string = lua_toboolean(L, 1);
+    lua_newtable(L);
+
+    // the string list is as big as the heap, only build it when asked
+    if (dump_string) {
+        auto ret = gStringHeap.Dump();
+        lua_pushstring(L, "string_heap");
+        lua_newtable(L);
+        for (size_t i = 0; i < ret.size(); ++i) {
+            lua_pushinteger(L, i + 1);
+            lua_pushlstring(L, ret[i]->data(), ret[i]->size());
+            lua_settable(L, -3);
+        }
+        lua_settable(L, -3);
+    }
 
     lua_pushstring(L, "container_size");
     lua_pushinteger(L, gLuaContainerHolder.GetContainerSize());
@@ -455,9 +882,182 @@ static int cpp_table_dump_statistic(lua_State *L) {
     lua_pushstring(L, "map_size");
     lua_pushinteger(L, gLuaContainerHolder.GetMapSize());
     lua_settable(L, -3);
+
+    // memory = { container = { Message = stat }, array = { ["Message.field"] = stat }, map = {...}, string = stat }
+    lua_pushstring(L, "memory");
+    lua_newtable(L);
+    int64_t total = 0;
+    lua_pushstring(L, "container");
+    lua_newtable(L);
+    for (auto &it: gLayoutMgr.GetAllLayout()) {
+        auto &stat = it.second->GetContainerStat();
+        total += stat.bytes;
+        cpp_table_push_memory_stat(L, it.first->c_str(), stat);
+    }
+    lua_settable(L, -3);
+    for (auto kind: {"array", "map"}) {
+        lua_pushstring(L, kind);
+        lua_newtable(L);
+        for (auto &it: gLayoutMgr.GetAllLayout()) {
+            for (auto &mem_it: it.second->GetMember()) {
+                auto mem = mem_it.second;
+                if (!mem || strcmp(mem->type->c_str(), kind) || !mem->mem_stat.count) {
+                    continue;
+                }
+                total += mem->mem_stat.bytes;
+                std::string field_name = std::string(it.first->data(), it.first->size()) + "." + mem->name->data();
+                cpp_table_push_memory_stat(L, field_name.c_str(), mem->mem_stat);
+            }
+        }
+        lua_settable(L, -3);
+    }
+    auto string_stat = gStringHeap.GetStat();
+    string_stat.bytes += gStringHeap.GetSetMemorySize();
+    total += string_stat.bytes;
+    cpp_table_push_memory_stat(L, "string", string_stat);
+    lua_pushstring(L, "total_bytes");
+    lua_pushinteger(L, total);
+    lua_settable(L, -3);
+
+    // refcount = { string = { [upper power of 2] = count }, container = {...}, array = {...}, map = {...} }
+    lua_pushstring(L, "refcount");
+    lua_newtable(L);
+    cpp_table_push_refcount(L, "string", gStringHeap.RefCountDistribution());
+    cpp_table_push_refcount(L, "container", gLuaContainerHolder.ContainerRefCountDistribution());
+    cpp_table_push_refcount(L, "array", gLuaContainerHolder.ArrayRefCountDistribution());
+    cpp_table_push_refcount(L, "map", gLuaContainerHolder.MapRefCountDistribution());
+    lua_settable(L, -3);
+    lua_settable(L, -3);
+
+#if CPP_TABLE_FIELD_STAT
+    // field_stat = { ["layout.field"] = { read = n, write = n } }
+    lua_pushstring(L, "field_stat");
+    lua_newtable(L);
+    for (auto &it: gLayoutMgr.GetAllLayout()) {
+        auto layout = it.second;
+        for (auto &mem_it: layout->GetMember()) {
+            auto mem = mem_it.second;
+            if (!mem || (!mem->read_count && !mem->write_count)) {
+                continue;
+            }
+            std::string field_name = std::string(it.first->data(), it.first->size()) + "." + mem->name->data();
+            lua_pushstring(L, field_name.c_str());
+            lua_newtable(L);
+            lua_pushstring(L, "read");
+            lua_pushinteger(L, mem->read_count);
+            lua_settable(L, -3);
+            lua_pushstring(L, "write");
+            lua_pushinteger(L, mem->write_count);
+            lua_settable(L, -3);
+            lua_settable(L, -3);
+        }
+    }
+    lua_settable(L, -3);
+#endif
     return 1;
 }
 
+static int cpp_table_deep_size(lua_State *L) {
+    auto pointer = lua_touserdata(L, 1);
+    if (!pointer) {
+        luaL_error(L, "cpp_table_deep_size: invalid object");
+        return 0;
+    }
+    DeepSizer sizer;
+    int64_t size = 0;
+    if (auto container = gLuaContainerHolder.Get(pointer)) {
+        size = sizer.Size(container.get());
+    } else if (auto array = gLuaContainerHolder.GetArray(pointer)) {
+        size = sizer.Size(array.get());
+    } else if (auto map = gLuaContainerHolder.GetMap(pointer)) {
+        size = sizer.Size(map.get());
+    } else {
+        luaL_error(L, "cpp_table_deep_size: no object found %p", pointer);
+        return 0;
+    }
+    lua_pushinteger(L, size);
+    lua_pushinteger(L, sizer.GetObjectCount());
+    return 2;
+}
+
+static int cpp_table_string_heap_compact(lua_State *L) {
+    lua_pushinteger(L, gStringHeap.Compact());
+    return 1;
+}
+
+static int cpp_table_set_field_stat(lua_State *L) {
+#if CPP_TABLE_FIELD_STAT
+    bool enable = lua_toboolean(L, 1);
+    bool reset = lua_toboolean(L, 2);
+    gLayoutMgr.SetFieldStat(enable);
+    if (reset) {
+        for (auto &it: gLayoutMgr.GetAllLayout()) {
+            for (auto &mem_it: it.second->GetMember()) {
+                if (mem_it.second) {
+                    mem_it.second->read_count = 0;
+                    mem_it.second->write_count = 0;
+                }
+            }
+        }
+    }
+    lua_pushboolean(L, 1);
+#else
+    lua_pushboolean(L, 0);
+#endif
+    return 1;
+}
+
+// backend of maps created from now on, globally or for one map field when layout and field name are given
+static int cpp_table_set_map_backend(lua_State *L) {
+    const char *name = lua_tostring(L, 1);
+    int backend = mb_default;
+    if (name && !strcmp(name, "coalesced")) {
+        backend = mb_coalesced;
+    } else if (name && !strcmp(name, "swiss")) {
+        backend = mb_swiss;
+    } else if (!name || strcmp(name, "default")) {
+        luaL_error(L, "cpp_table_set_map_backend: invalid backend %s", name ? name : "nil");
+        return 0;
+    }
+
+    if (lua_isnoneornil(L, 2)) {
+        if (backend == mb_default) {
+            luaL_error(L, "cpp_table_set_map_backend: default is only for a field");
+            return 0;
+        }
+        gLayoutMgr.SetMapBackend(backend);
+        return 0;
+    }
+
+    size_t layout_name_size = 0;
+    const char *layout_name = lua_tolstring(L, 2, &layout_name_size);
+    size_t field_name_size = 0;
+    const char *field_name = lua_tolstring(L, 3, &field_name_size);
+    if (!layout_name || !field_name) {
+        luaL_error(L, "cpp_table_set_map_backend: invalid layout or field name");
+        return 0;
+    }
+    auto layout = gLayoutMgr.GetLayout(gStringHeap.Add(StringView(layout_name, layout_name_size)));
+    if (!layout) {
+        luaL_error(L, "cpp_table_set_map_backend: no layout found %s", layout_name);
+        return 0;
+    }
+    auto field_key = gStringHeap.Add(StringView(field_name, field_name_size));
+    for (auto &it: layout->GetMember()) {
+        auto mem = it.second;
+        if (mem && mem->name.get() == field_key.get()) {
+            if (strcmp(mem->type->c_str(), "map")) {
+                luaL_error(L, "cpp_table_set_map_backend: %s.%s is not a map", layout_name, field_name);
+                return 0;
+            }
+            mem->map_backend = backend;
+            return 0;
+        }
+    }
+    luaL_error(L, "cpp_table_set_map_backend: no layout member found %s.%s", layout_name, field_name);
+    return 0;
+}
+
 static void cpp_table_reg_userdata(lua_State *L, void *p, const std::string &lua_table_name,
                                    const std::string &lua_layout_table_name, const std::string &lua_key_name) {
     // set meta table from lua_layout_table_name
@@ -582,6 +1182,7 @@ template<typename T>
 int cpp_table_container_get_normal(lua_State *L) {
     auto pointer = lua_touserdata(L, 1);
     int idx = lua_tointeger(L, 2);
+    int flag = lua_tointeger(L, 3);
     if (!pointer) {
         luaL_error(L, "cpp_table_container_get_normal: invalid container");
         return 0;
@@ -593,9 +1194,10 @@ int cpp_table_container_get_normal(lua_State *L) {
     }
     T value = 0;
     bool is_nil = false;
-    auto ret = container->Get<T>(idx, value, is_nil);
+    auto ret = container->Get<T>(idx, flag, value, is_nil);
     if (!ret) {
-        luaL_error(L, "cpp_table_container_get_normal: %s invalid idx %d", container->GetName().data(), idx);
+        luaL_error(L, "cpp_table_container_get_normal: %s invalid idx %d flag %d",
+                   container->GetName().data(), idx, flag);
         return 0;
     }
     if (is_nil) {
@@ -708,7 +1310,8 @@ template<typename T>
 int cpp_table_container_set_normal(lua_State *L) {
     auto pointer = lua_touserdata(L, 1);
     int idx = lua_tointeger(L, 2);
-    bool is_nil = lua_isnil(L, 3);
+    int flag = lua_tointeger(L, 3);
+    bool is_nil = lua_isnil(L, 4);
     if (!pointer) {
         luaL_error(L, "cpp_table_container_set_normal: invalid container");
         return 0;
@@ -722,41 +1325,42 @@ int cpp_table_container_set_normal(lua_State *L) {
 #if ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
     if constexpr (std::is_same<T, int32_t>::value || std::is_same<T, uint32_t>::value ||
                   std::is_same<T, int64_t>::value || std::is_same<T, uint64_t>::value) {
-        if (lua_type(L, 3) != LUA_TNUMBER && lua_type(L, 3) != LUA_TNIL) {
-            luaL_error(L, "cpp_table_container_set_normal: invalid value type %d", lua_type(L, 3));
+        if (lua_type(L, 4) != LUA_TNUMBER && lua_type(L, 4) != LUA_TNIL) {
+            luaL_error(L, "cpp_table_container_set_normal: invalid value type %d", lua_type(L, 4));
             return 0;
         }
-        T value = lua_tointeger(L, 3);
-        ret = container->Set<T>(idx, value, is_nil);
+        T value = lua_tointeger(L, 4);
+        ret = container->Set<T>(idx, flag, value, is_nil);
     } else if constexpr (std::is_same<T, bool>::value) {
-        if (lua_type(L, 3) != LUA_TBOOLEAN && lua_type(L, 3) != LUA_TNIL) {
-            luaL_error(L, "cpp_table_container_set_normal: invalid value type %d", lua_type(L, 3));
+        if (lua_type(L, 4) != LUA_TBOOLEAN && lua_type(L, 4) != LUA_TNIL) {
+            luaL_error(L, "cpp_table_container_set_normal: invalid value type %d", lua_type(L, 4));
             return 0;
         }
-        T value = lua_toboolean(L, 3);
-        ret = container->Set<T>(idx, value, is_nil);
+        T value = lua_toboolean(L, 4);
+        ret = container->Set<T>(idx, flag, value, is_nil);
     } else if constexpr (std::is_same<T, float>::value || std::is_same<T, double>::value) {
-        if (lua_type(L, 3) != LUA_TNUMBER && lua_type(L, 3) != LUA_TNIL) {
-            luaL_error(L, "cpp_table_container_set_normal: invalid value type %d", lua_type(L, 3));
+        if (lua_type(L, 4) != LUA_TNUMBER && lua_type(L, 4) != LUA_TNIL) {
+            luaL_error(L, "cpp_table_container_set_normal: invalid value type %d", lua_type(L, 4));
             return 0;
         }
-        T value = lua_tonumber(L, 3);
-        ret = container->Set<T>(idx, value, is_nil);
+        T value = lua_tonumber(L, 4);
+        ret = container->Set<T>(idx, flag, value, is_nil);
     } else {
         luaL_error(L, "cpp_table_container_set_normal: invalid type %s %s", container->GetName().data(),
                    typeid(T).name());
         return 0;
     }
 #else
-    if (lua_type(L, 3) != lua_get_type<T>(L) && lua_type(L, 3) != LUA_TNIL) {
-        luaL_error(L, "cpp_table_container_set_normal: invalid value type %d", lua_type(L, 3));
+    if (lua_type(L, 4) != lua_get_type<T>(L) && lua_type(L, 4) != LUA_TNIL) {
+        luaL_error(L, "cpp_table_container_set_normal: invalid value type %d", lua_type(L, 4));
         return 0;
     }
-    T value = lua_get_helper<T>(L, container, 3);
-    ret = container->Set<T>(idx, value, is_nil);
+    T value = lua_get_helper<T>(L, container, 4);
+    ret = container->Set<T>(idx, flag, value, is_nil);
 #endif
     if (!ret) {
-        luaL_error(L, "cpp_table_container_set_normal: %s invalid idx %d", container->GetName().data(), idx);
+        luaL_error(L, "cpp_table_container_set_normal: %s invalid idx %d flag %d",
+                   container->GetName().data(), idx, flag);
         return 0;
     }
     lua_pushboolean(L, 1);
@@ -766,6 +1370,7 @@ int cpp_table_container_set_normal(lua_State *L) {
 static int cpp_table_container_get_string(lua_State *L) {
     auto pointer = lua_touserdata(L, 1);
     int idx = lua_tointeger(L, 2);
+    int flag = lua_tointeger(L, 3);
     if (!pointer) {
         luaL_error(L, "cpp_table_container_get_string: invalid container");
         return 0;
@@ -777,9 +1382,10 @@ static int cpp_table_container_get_string(lua_State *L) {
     }
     StringPtr value;
     bool is_nil = false;
-    auto ret = container->GetSharedObj<String>(idx, value, is_nil);
+    auto ret = container->GetSharedObj<String>(idx, flag, value, is_nil);
     if (!ret) {
-        luaL_error(L, "cpp_table_container_get_string: %s invalid idx %d", container->GetName().data(), idx);
+        luaL_error(L, "cpp_table_container_get_string: %s invalid idx %d flag %d",
+                   container->GetName().data(), idx, flag);
         return 0;
     }
     if (is_nil) {
@@ -793,13 +1399,14 @@ static int cpp_table_container_get_string(lua_State *L) {
 static int cpp_table_container_set_string(lua_State *L) {
     auto pointer = lua_touserdata(L, 1);
     int idx = lua_tointeger(L, 2);
+    int flag = lua_tointeger(L, 3);
     size_t size = 0;
-    if (lua_type(L, 3) != LUA_TSTRING && lua_type(L, 3) != LUA_TNIL) {
-        luaL_error(L, "cpp_table_container_set_string: invalid value type %d", lua_type(L, 3));
+    if (lua_type(L, 4) != LUA_TSTRING && lua_type(L, 4) != LUA_TNIL) {
+        luaL_error(L, "cpp_table_container_set_string: invalid value type %d", lua_type(L, 4));
         return 0;
     }
-    const char *str = lua_tolstring(L, 3, &size);
-    bool is_nil = lua_isnil(L, 3);
+    const char *str = lua_tolstring(L, 4, &size);
+    bool is_nil = lua_isnil(L, 4);
     if (!pointer) {
         luaL_error(L, "cpp_table_container_set_string: invalid container");
         return 0;
@@ -813,9 +1420,10 @@ static int cpp_table_container_set_string(lua_State *L) {
     if (!is_nil) {
         shared_str = gStringHeap.Add(StringView(str, size));
     }
-    auto ret = container->SetSharedObj(idx, shared_str, is_nil);
+    auto ret = container->SetSharedObj(idx, flag, shared_str, is_nil);
     if (!ret) {
-        luaL_error(L, "cpp_table_container_set_string: %s invalid idx %d", container->GetName().data(), idx);
+        luaL_error(L, "cpp_table_container_set_string: %s invalid idx %d flag %d",
+                   container->GetName().data(), idx, flag);
         return 0;
     }
     return 0;
@@ -824,6 +1432,7 @@ static int cpp_table_container_set_string(lua_State *L) {
 static int cpp_table_container_get_obj(lua_State *L) {
     auto pointer = lua_touserdata(L, 1);
     int idx = lua_tointeger(L, 2);
+    int flag = lua_tointeger(L, 3);
     if (!pointer) {
         luaL_error(L, "cpp_table_container_get_obj: invalid container");
         return 0;
@@ -835,9 +1444,10 @@ static int cpp_table_container_get_obj(lua_State *L) {
     }
     ContainerPtr obj;
     bool is_nil = false;
-    auto ret = container->GetSharedObj<Container>(idx, obj, is_nil);
+    auto ret = container->GetSharedObj<Container>(idx, flag, obj, is_nil);
     if (!ret) {
-        luaL_error(L, "cpp_table_container_get_obj: %s invalid idx %d", container->GetName().data(), idx);
+        luaL_error(L, "cpp_table_container_get_obj: %s invalid idx %d flag %d",
+                   container->GetName().data(), idx, flag);
         return 0;
     }
     if (is_nil) {
@@ -852,13 +1462,14 @@ static int cpp_table_container_get_obj(lua_State *L) {
 static int cpp_table_container_set_obj(lua_State *L) {
     auto pointer = lua_touserdata(L, 1);
     int idx = lua_tointeger(L, 2);
-    if (lua_type(L, 3) != LUA_TUSERDATA && lua_type(L, 3) != LUA_TNIL) {
-        luaL_error(L, "cpp_table_container_set_obj: invalid value type %d", lua_type(L, 3));
+    int flag = lua_tointeger(L, 3);
+    if (lua_type(L, 4) != LUA_TUSERDATA && lua_type(L, 4) != LUA_TNIL) {
+        luaL_error(L, "cpp_table_container_set_obj: invalid value type %d", lua_type(L, 4));
         return 0;
     }
-    void *obj_pointer = lua_touserdata(L, 3);
-    bool is_nil = lua_isnil(L, 3);
-    int message_id = lua_tointeger(L, 4);
+    void *obj_pointer = lua_touserdata(L, 4);
+    bool is_nil = lua_isnil(L, 4);
+    int message_id = lua_tointeger(L, 5);
     if (!pointer) {
         luaL_error(L, "cpp_table_container_set_obj: invalid container");
         return 0;
@@ -882,9 +1493,10 @@ static int cpp_table_container_set_obj(lua_State *L) {
         luaL_error(L, "cpp_table_container_set_obj: %s invalid message_id %d", obj->GetName().data(), message_id);
         return 0;
     }
-    auto ret = container->SetSharedObj<Container>(idx, obj, is_nil);
+    auto ret = container->SetSharedObj<Container>(idx, flag, obj, is_nil);
     if (!ret) {
-        luaL_error(L, "cpp_table_container_set_obj: %s invalid idx %d", container->GetName().data(), idx);
+        luaL_error(L, "cpp_table_container_set_obj: %s invalid idx %d flag %d",
+                   container->GetName().data(), idx, flag);
         return 0;
     }
     return 0;
@@ -893,6 +1505,7 @@ static int cpp_table_container_set_obj(lua_State *L) {
 static int cpp_table_container_get_array(lua_State *L) {
     auto pointer = lua_touserdata(L, 1);
     int idx = lua_tointeger(L, 2);
+    int flag = lua_tointeger(L, 3);
     if (!pointer) {
         luaL_error(L, "cpp_table_container_get_array: invalid container");
         return 0;
@@ -904,9 +1517,10 @@ static int cpp_table_container_get_array(lua_State *L) {
     }
     ArrayPtr array;
     bool is_nil = false;
-    auto ret = container->GetSharedObj<Array>(idx, array, is_nil);
+    auto ret = container->GetSharedObj<Array>(idx, flag, array, is_nil);
     if (!ret) {
-        luaL_error(L, "cpp_table_container_get_array: %s invalid idx %d", container->GetName().data(), idx);
+        luaL_error(L, "cpp_table_container_get_array: %s invalid idx %d flag %d",
+                   container->GetName().data(), idx, flag);
         return 0;
     }
     if (is_nil) {
@@ -924,13 +1538,14 @@ static int cpp_table_container_get_array(lua_State *L) {
 static int cpp_table_container_set_array(lua_State *L) {
     auto pointer = lua_touserdata(L, 1);
     int idx = lua_tointeger(L, 2);
-    if (lua_type(L, 3) != LUA_TUSERDATA && lua_type(L, 3) != LUA_TNIL) {
-        luaL_error(L, "cpp_table_container_set_array: invalid value type %d", lua_type(L, 3));
+    int flag = lua_tointeger(L, 3);
+    if (lua_type(L, 4) != LUA_TUSERDATA && lua_type(L, 4) != LUA_TNIL) {
+        luaL_error(L, "cpp_table_container_set_array: invalid value type %d", lua_type(L, 4));
         return 0;
     }
-    void *array_pointer = lua_touserdata(L, 3);
-    bool is_nil = lua_isnil(L, 3);
-    int message_id = lua_tointeger(L, 4);
+    void *array_pointer = lua_touserdata(L, 4);
+    bool is_nil = lua_isnil(L, 4);
+    int message_id = lua_tointeger(L, 5);
     if (!pointer) {
         luaL_error(L, "cpp_table_container_set_array: invalid container");
         return 0;
@@ -954,9 +1569,10 @@ static int cpp_table_container_set_array(lua_State *L) {
         luaL_error(L, "cpp_table_container_set_array: %s invalid message_id %d", array->GetName().data(), message_id);
         return 0;
     }
-    auto ret = container->SetSharedObj<Array>(idx, array, is_nil);
+    auto ret = container->SetSharedObj<Array>(idx, flag, array, is_nil);
     if (!ret) {
-        luaL_error(L, "cpp_table_container_set_array: %s invalid idx %d", container->GetName().data(), idx);
+        luaL_error(L, "cpp_table_container_set_array: %s invalid idx %d flag %d",
+                   container->GetName().data(), idx, flag);
         return 0;
     }
     return 0;
@@ -965,6 +1581,7 @@ static int cpp_table_container_set_array(lua_State *L) {
 static int cpp_table_container_get_map(lua_State *L) {
     auto pointer = lua_touserdata(L, 1);
     int idx = lua_tointeger(L, 2);
+    int flag = lua_tointeger(L, 3);
     if (!pointer) {
         luaL_error(L, "cpp_table_container_get_map: invalid container");
         return 0;
@@ -976,9 +1593,10 @@ static int cpp_table_container_get_map(lua_State *L) {
     }
     MapPtr map;
     bool is_nil = false;
-    auto ret = container->GetSharedObj<Map>(idx, map, is_nil);
+    auto ret = container->GetSharedObj<Map>(idx, flag, map, is_nil);
     if (!ret) {
-        luaL_error(L, "cpp_table_container_get_map: %s invalid idx %d", container->GetName().data(), idx);
+        luaL_error(L, "cpp_table_container_get_map: %s invalid idx %d flag %d",
+                   container->GetName().data(), idx, flag);
         return 0;
     }
     if (is_nil) {
@@ -996,14 +1614,15 @@ static int cpp_table_container_get_map(lua_State *L) {
 static int cpp_table_container_set_map(lua_State *L) {
     auto pointer = lua_touserdata(L, 1);
     int idx = lua_tointeger(L, 2);
-    if (lua_type(L, 3) != LUA_TUSERDATA && lua_type(L, 3) != LUA_TNIL) {
-        luaL_error(L, "cpp_table_container_set_map: invalid value type %d", lua_type(L, 3));
+    int flag = lua_tointeger(L, 3);
+    if (lua_type(L, 4) != LUA_TUSERDATA && lua_type(L, 4) != LUA_TNIL) {
+        luaL_error(L, "cpp_table_container_set_map: invalid value type %d", lua_type(L, 4));
         return 0;
     }
-    void *map_pointer = lua_touserdata(L, 3);
-    bool is_nil = lua_isnil(L, 3);
-    int key_message_id = lua_tointeger(L, 4);
-    int value_message_id = lua_tointeger(L, 5);
+    void *map_pointer = lua_touserdata(L, 4);
+    bool is_nil = lua_isnil(L, 4);
+    int key_message_id = lua_tointeger(L, 5);
+    int value_message_id = lua_tointeger(L, 6);
     if (!pointer) {
         luaL_error(L, "cpp_table_container_set_map: invalid container");
         return 0;
@@ -1031,9 +1650,10 @@ static int cpp_table_container_set_map(lua_State *L) {
         luaL_error(L, "cpp_table_container_set_map: %s invalid message_id %d", map->GetName().data(), value_message_id);
         return 0;
     }
-    auto ret = container->SetSharedObj<Map>(idx, map, is_nil);
+    auto ret = container->SetSharedObj<Map>(idx, flag, map, is_nil);
     if (!ret) {
-        luaL_error(L, "cpp_table_container_set_map: %s invalid idx %d", container->GetName().data(), idx);
+        luaL_error(L, "cpp_table_container_set_map: %s invalid idx %d flag %d",
+                   container->GetName().data(), idx, flag);
         return 0;
     }
     return 0;
@@ -1578,6 +2198,184 @@ static int cpp_table_map_container_get(lua_State *L) {
     }
 }
 
+static void cpp_table_map_push_value(lua_State *L, const Map::MapValue32 &value, int value_message_id) {
+    switch (value_message_id) {
+        case mt_int32:
+            lua_pushinteger(L, value.m_32);
+            break;
+        case mt_uint32:
+            lua_pushinteger(L, value.m_u32);
+            break;
+        case mt_float:
+            lua_pushnumber(L, value.m_float);
+            break;
+        default:
+            lua_pushboolean(L, value.m_bool);
+            break;
+    }
+}
+
+static void cpp_table_map_push_value(lua_State *L, const Map::MapValue64 &value, int value_message_id) {
+    switch (value_message_id) {
+        case mt_int64:
+            lua_pushinteger(L, value.m_64);
+            break;
+        case mt_uint64:
+            lua_pushinteger(L, value.m_u64);
+            break;
+        case mt_double:
+            lua_pushnumber(L, value.m_double);
+            break;
+        case mt_string:
+            lua_pushlstring(L, value.m_string->c_str(), value.m_string->size());
+            break;
+        default:
+            cpp_table_get_container_push_pointer(L, value.m_obj);
+            break;
+    }
+}
+
+// keys are looked up a few ahead of their prefetch, so the cache misses of the batch overlap,
+// a key of the wrong type is not valid and its result is nil
+template<typename M, typename V, typename K>
+void cpp_table_map_container_get_many_from(lua_State *L, M *m, const std::vector<K> &keys,
+                                           const std::vector<char> &valid, int value_message_id, int out) {
+    const size_t distance = 16;
+    size_t n = keys.size();
+    for (size_t i = 0; i < n && i < distance; i++) {
+        if (valid[i]) {
+            m->Prefetch(keys[i]);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (i + distance < n && valid[i + distance]) {
+            m->Prefetch(keys[i + distance]);
+        }
+        V value;
+        if (valid[i] && m->Find(keys[i], value)) {
+            cpp_table_map_push_value(L, value, value_message_id);
+        } else {
+            lua_pushnil(L);
+        }
+        lua_rawseti(L, out, (lua_Integer) i + 1);
+    }
+}
+
+template<typename M32, typename M64, typename K>
+void cpp_table_map_container_get_many_by(lua_State *L, M32 *m32, M64 *m64, const std::vector<K> &keys,
+                                         const std::vector<char> &valid, int value_message_id, int out) {
+    bool value_32 = value_message_id == mt_int32 || value_message_id == mt_uint32 ||
+                    value_message_id == mt_float || value_message_id == mt_bool;
+    if (value_32) {
+        cpp_table_map_container_get_many_from<M32, Map::MapValue32>(L, m32, keys, valid, value_message_id, out);
+    } else {
+        cpp_table_map_container_get_many_from<M64, Map::MapValue64>(L, m64, keys, valid, value_message_id, out);
+    }
+}
+
+// look up every key of the keys array, result i is the value of keys[i] or nil, written to out or a new table
+static int cpp_table_map_container_get_many(lua_State *L) {
+    auto pointer = lua_touserdata(L, 1);
+    if (!pointer) {
+        luaL_error(L, "cpp_table_map_container_get_many: invalid map");
+        return 0;
+    }
+    auto map = gLuaContainerHolder.GetMap(pointer);
+    if (!map) {
+        luaL_error(L, "cpp_table_map_container_get_many: no map found %p", pointer);
+        return 0;
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int n = (int) lua_rawlen(L, 2);
+    if (lua_istable(L, 3)) {
+        lua_settop(L, 3);
+    } else {
+        lua_settop(L, 2);
+        lua_createtable(L, n, 0);
+    }
+
+    int key_message_id = map->GetKeyMessageId();
+    int value_message_id = map->GetValueMessageId();
+    auto m = map->GetMap();
+    std::vector<char> valid(n, 0);
+    if (!m.m_void) {
+        for (int i = 1; i <= n; i++) {
+            lua_pushnil(L);
+            lua_rawseti(L, 3, i);
+        }
+    } else {
+        switch (key_message_id) {
+            case mt_int32:
+            case mt_uint32:
+            case mt_bool: {
+                std::vector<int32_t> keys(n);
+                for (int i = 0; i < n; i++) {
+                    lua_rawgeti(L, 2, i + 1);
+                    if (key_message_id == mt_bool) {
+                        valid[i] = lua_type(L, -1) == LUA_TBOOLEAN;
+                        keys[i] = (int32_t) lua_toboolean(L, -1);
+                    } else if (lua_type(L, -1) == LUA_TNUMBER) {
+                        int isnum = 0;
+                        keys[i] = (int32_t) lua_tointegerx(L, -1, &isnum);
+                        valid[i] = isnum;
+                    }
+                    lua_pop(L, 1);
+                }
+                cpp_table_map_container_get_many_by(L, m.m_32_32, m.m_32_64, keys, valid, value_message_id, 3);
+                break;
+            }
+            case mt_int64:
+            case mt_uint64: {
+                std::vector<int64_t> keys(n);
+                for (int i = 0; i < n; i++) {
+                    lua_rawgeti(L, 2, i + 1);
+                    if (lua_type(L, -1) == LUA_TNUMBER) {
+                        int isnum = 0;
+                        keys[i] = (int64_t) lua_tointegerx(L, -1, &isnum);
+                        valid[i] = isnum;
+                    }
+                    lua_pop(L, 1);
+                }
+                cpp_table_map_container_get_many_by(L, m.m_64_32, m.m_64_64, keys, valid, value_message_id, 3);
+                break;
+            }
+            case mt_string: {
+                // a string not in the heap is in no map, so look it up without adding it
+                std::vector<StringPtr> keys(n);
+                for (int i = 0; i < n; i++) {
+                    lua_rawgeti(L, 2, i + 1);
+                    if (lua_type(L, -1) == LUA_TSTRING) {
+                        size_t size = 0;
+                        const char *str = lua_tolstring(L, -1, &size);
+                        keys[i] = gStringHeap.Get(StringView(str, size));
+                        valid[i] = keys[i].get() != 0;
+                    }
+                    lua_pop(L, 1);
+                }
+                cpp_table_map_container_get_many_by(L, m.m_string_32, m.m_string_64, keys, valid, value_message_id,
+                                                    3);
+                break;
+            }
+            default: {
+                luaL_error(L, "cpp_table_map_container_get_many: invalid key type %d", key_message_id);
+                return 0;
+            }
+        }
+    }
+
+    // a reused out may hold results of an earlier longer batch, with nil holes, so walk all of it
+    lua_pushnil(L);
+    while (lua_next(L, 3)) {
+        lua_pop(L, 1);
+        if (lua_isinteger(L, -1) && lua_tointeger(L, -1) > n) {
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, 3);
+        }
+    }
+    return 1;
+}
+
 template<typename K>
 void map_set_32(MapPtr map, K key, Map::MapValue32 value) {
     static_assert(true, "map_set_32: invalid type");
@@ -1725,12 +2523,13 @@ void cpp_table_map_container_remove_map_value64(MapPtr map, K key) {
 }
 
 template<typename K>
-void cpp_table_map_container_set_by(lua_State *L, MapPtr map, K key, int value_message_id, bool is_nil) {
+void cpp_table_map_container_set_by(lua_State *L, MapPtr map, K key, int value_message_id, bool is_nil,
+                                    int value_idx = 3) {
     switch (value_message_id) {
         case mt_int32: {
             if (!is_nil) {
                 Map::MapValue32 value;
-                value.m_32 = lua_tointeger(L, 3);
+                value.m_32 = lua_tointeger(L, value_idx);
                 cpp_table_map_container_set_map_value32(map, key, value);
             } else {
                 cpp_table_map_container_remove_map_value32(map, key);
@@ -1740,7 +2539,7 @@ void cpp_table_map_container_set_by(lua_State *L, MapPtr map, K key, int value_m
         case mt_uint32: {
             if (!is_nil) {
                 Map::MapValue32 value;
-                value.m_u32 = lua_tointeger(L, 3);
+                value.m_u32 = lua_tointeger(L, value_idx);
                 cpp_table_map_container_set_map_value32(map, key, value);
             } else {
                 cpp_table_map_container_remove_map_value32(map, key);
@@ -1750,7 +2549,7 @@ void cpp_table_map_container_set_by(lua_State *L, MapPtr map, K key, int value_m
         case mt_int64: {
             if (!is_nil) {
                 Map::MapValue64 value;
-                value.m_64 = lua_tointeger(L, 3);
+                value.m_64 = lua_tointeger(L, value_idx);
                 cpp_table_map_container_set_map_value64(map, key, value);
             } else {
                 cpp_table_map_container_remove_map_value64(map, key);
@@ -1760,7 +2559,7 @@ void cpp_table_map_container_set_by(lua_State *L, MapPtr map, K key, int value_m
         case mt_uint64: {
             if (!is_nil) {
                 Map::MapValue64 value;
-                value.m_u64 = lua_tointeger(L, 3);
+                value.m_u64 = lua_tointeger(L, value_idx);
                 cpp_table_map_container_set_map_value64(map, key, value);
             } else {
                 cpp_table_map_container_remove_map_value64(map, key);
@@ -1770,7 +2569,7 @@ void cpp_table_map_container_set_by(lua_State *L, MapPtr map, K key, int value_m
         case mt_float: {
             if (!is_nil) {
                 Map::MapValue32 value;
-                value.m_float = lua_tonumber(L, 3);
+                value.m_float = lua_tonumber(L, value_idx);
                 cpp_table_map_container_set_map_value32(map, key, value);
             } else {
                 cpp_table_map_container_remove_map_value32(map, key);
@@ -1780,7 +2579,7 @@ void cpp_table_map_container_set_by(lua_State *L, MapPtr map, K key, int value_m
         case mt_double: {
             if (!is_nil) {
                 Map::MapValue64 value;
-                value.m_double = lua_tonumber(L, 3);
+                value.m_double = lua_tonumber(L, value_idx);
                 cpp_table_map_container_set_map_value64(map, key, value);
             } else {
                 cpp_table_map_container_remove_map_value64(map, key);
@@ -1790,7 +2589,7 @@ void cpp_table_map_container_set_by(lua_State *L, MapPtr map, K key, int value_m
         case mt_bool: {
             if (!is_nil) {
                 Map::MapValue32 value;
-                value.m_bool = lua_toboolean(L, 3);
+                value.m_bool = lua_toboolean(L, value_idx);
                 cpp_table_map_container_set_map_value32(map, key, value);
             } else {
                 cpp_table_map_container_remove_map_value32(map, key);
@@ -1800,7 +2599,7 @@ void cpp_table_map_container_set_by(lua_State *L, MapPtr map, K key, int value_m
         case mt_string: {
             if (!is_nil) {
                 size_t size = 0;
-                const char *str = lua_tolstring(L, 3, &size);
+                const char *str = lua_tolstring(L, value_idx, &size);
                 auto new_value = gStringHeap.Add(StringView(str, size));
 
                 bool old_is_nil = false;
@@ -1831,7 +2630,7 @@ void cpp_table_map_container_set_by(lua_State *L, MapPtr map, K key, int value_m
         }
         default: {
             if (!is_nil) {
-                auto new_obj = gLuaContainerHolder.Get(lua_touserdata(L, 3));
+                auto new_obj = gLuaContainerHolder.Get(lua_touserdata(L, value_idx));
                 if (!new_obj) {
                     luaL_error(L, "cpp_table_map_container_set: invalid obj");
                     return;
@@ -1870,74 +2669,171 @@ void cpp_table_map_container_set_by(lua_State *L, MapPtr map, K key, int value_m
     }
 }
 
-static int cpp_table_map_container_set(lua_State *L) {
-    auto pointer = lua_touserdata(L, 1);
-    if (!pointer) {
-        luaL_error(L, "cpp_table_map_container_set: invalid map");
-        return 0;
-    }
-    auto map = gLuaContainerHolder.GetMap(pointer);
-    if (!map) {
-        luaL_error(L, "cpp_table_map_container_set: no map found %p", pointer);
-        return 0;
-    }
-    int key_message_id = lua_tointeger(L, 4);
-    int value_message_id = lua_tointeger(L, 5);
-    bool is_nil = lua_isnil(L, 3);
-
-    if (key_message_id != map->GetKeyMessageId() || value_message_id != map->GetValueMessageId()) {
-        luaL_error(L, "cpp_table_map_container_set: invalid message_id %d %d", key_message_id, value_message_id);
-        return 0;
-    }
-
+static void cpp_table_map_container_set_kv(lua_State *L, MapPtr map, int key_idx, int value_idx, int key_message_id,
+                                           int value_message_id) {
+    bool is_nil = lua_isnil(L, value_idx);
     switch (key_message_id) {
         case mt_int32: {
-            int32_t key = (int32_t) lua_tointeger(L, 2);
-            cpp_table_map_container_set_by<int32_t>(L, map, (int32_t) key, value_message_id, is_nil);
-            return 0;
+            int32_t key = (int32_t) lua_tointeger(L, key_idx);
+            cpp_table_map_container_set_by<int32_t>(L, map, (int32_t) key, value_message_id, is_nil, value_idx);
+            return;
         }
         case mt_uint32: {
-            uint32_t key = (uint32_t) lua_tointeger(L, 2);
-            cpp_table_map_container_set_by<int32_t>(L, map, (int32_t) key, value_message_id, is_nil);
-            return 0;
+            uint32_t key = (uint32_t) lua_tointeger(L, key_idx);
+            cpp_table_map_container_set_by<int32_t>(L, map, (int32_t) key, value_message_id, is_nil, value_idx);
+            return;
         }
         case mt_int64: {
-            int64_t key = (int64_t) lua_tointeger(L, 2);
-            cpp_table_map_container_set_by<int64_t>(L, map, (int64_t) key, value_message_id, is_nil);
-            return 0;
+            int64_t key = (int64_t) lua_tointeger(L, key_idx);
+            cpp_table_map_container_set_by<int64_t>(L, map, (int64_t) key, value_message_id, is_nil, value_idx);
+            return;
         }
         case mt_uint64: {
-            uint64_t key = (uint64_t) lua_tointeger(L, 2);
-            cpp_table_map_container_set_by<int64_t>(L, map, (int64_t) key, value_message_id, is_nil);
-            return 0;
+            uint64_t key = (uint64_t) lua_tointeger(L, key_idx);
+            cpp_table_map_container_set_by<int64_t>(L, map, (int64_t) key, value_message_id, is_nil, value_idx);
+            return;
         }
         case mt_float: {
             luaL_error(L, "cpp_table_map_container_set: invalid key type %d", key_message_id);
-            return 0;
+            return;
         }
         case mt_double: {
             luaL_error(L, "cpp_table_map_container_set: invalid key type %d", key_message_id);
-            return 0;
+            return;
         }
         case mt_bool: {
-            bool key = (bool) lua_toboolean(L, 2);
-            cpp_table_map_container_set_by<int32_t>(L, map, (int32_t) key, value_message_id, is_nil);
-            return 0;
+            bool key = (bool) lua_toboolean(L, key_idx);
+            cpp_table_map_container_set_by<int32_t>(L, map, (int32_t) key, value_message_id, is_nil, value_idx);
+            return;
         }
         case mt_string: {
             size_t size = 0;
-            const char *str = lua_tolstring(L, 2, &size);
+            const char *str = lua_tolstring(L, key_idx, &size);
             auto shared_str = gStringHeap.Add(StringView(str, size));
-            cpp_table_map_container_set_by<StringPtr>(L, map, shared_str, value_message_id, is_nil);
-            return 0;
+            cpp_table_map_container_set_by<StringPtr>(L, map, shared_str, value_message_id, is_nil, value_idx);
+            return;
         }
         default: {
             luaL_error(L, "cpp_table_map_container_set: invalid key type %d", key_message_id);
-            return 0;
+            return;
         }
     }
 }
 
+static int cpp_table_map_container_set(lua_State *L) {
+    auto pointer = lua_touserdata(L, 1);
+    if (!pointer) {
+        luaL_error(L, "cpp_table_map_container_set: invalid map");
+        return 0;
+    }
+    auto map = gLuaContainerHolder.GetMap(pointer);
+    if (!map) {
+        luaL_error(L, "cpp_table_map_container_set: no map found %p", pointer);
+        return 0;
+    }
+    int key_message_id = lua_tointeger(L, 4);
+    int value_message_id = lua_tointeger(L, 5);
+
+    if (key_message_id != map->GetKeyMessageId() || value_message_id != map->GetValueMessageId()) {
+        luaL_error(L, "cpp_table_map_container_set: invalid message_id %d %d", key_message_id, value_message_id);
+        return 0;
+    }
+
+    cpp_table_map_container_set_kv(L, map, 2, 3, key_message_id, value_message_id);
+    return 0;
+}
+
+static int cpp_table_map_container_reserve(lua_State *L) {
+    auto pointer = lua_touserdata(L, 1);
+    int n = lua_tointeger(L, 2);
+    if (!pointer) {
+        luaL_error(L, "cpp_table_map_container_reserve: invalid map");
+        return 0;
+    }
+    auto map = gLuaContainerHolder.GetMap(pointer);
+    if (!map) {
+        luaL_error(L, "cpp_table_map_container_reserve: no map found %p", pointer);
+        return 0;
+    }
+    if (n > 0) {
+        map->Reserve(n);
+    }
+    return 0;
+}
+
+static int cpp_table_map_container_compact(lua_State *L) {
+    auto pointer = lua_touserdata(L, 1);
+    if (!pointer) {
+        luaL_error(L, "cpp_table_map_container_compact: invalid map");
+        return 0;
+    }
+    auto map = gLuaContainerHolder.GetMap(pointer);
+    if (!map) {
+        luaL_error(L, "cpp_table_map_container_compact: no map found %p", pointer);
+        return 0;
+    }
+    lua_pushinteger(L, map->Compact());
+    return 1;
+}
+
+// after a map is filled key by key, e.g. a map of messages sunk from lua, move a dense range of its keys to the
+// array part
+static int cpp_table_map_container_plan_array(lua_State *L) {
+    auto pointer = lua_touserdata(L, 1);
+    if (!pointer) {
+        luaL_error(L, "cpp_table_map_container_plan_array: invalid map");
+        return 0;
+    }
+    auto map = gLuaContainerHolder.GetMap(pointer);
+    if (!map) {
+        luaL_error(L, "cpp_table_map_container_plan_array: no map found %p", pointer);
+        return 0;
+    }
+    map->PlanArray();
+    return 0;
+}
+
+// bulk build, presize by the table count then insert every kv without going through __newindex
+static int cpp_table_map_container_set_all(lua_State *L) {
+    auto pointer = lua_touserdata(L, 1);
+    if (!pointer) {
+        luaL_error(L, "cpp_table_map_container_set_all: invalid map");
+        return 0;
+    }
+    auto map = gLuaContainerHolder.GetMap(pointer);
+    if (!map) {
+        luaL_error(L, "cpp_table_map_container_set_all: no map found %p", pointer);
+        return 0;
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int key_message_id = lua_tointeger(L, 3);
+    int value_message_id = lua_tointeger(L, 4);
+    if (key_message_id != map->GetKeyMessageId() || value_message_id != map->GetValueMessageId()) {
+        luaL_error(L, "cpp_table_map_container_set_all: invalid message_id %d %d", key_message_id, value_message_id);
+        return 0;
+    }
+
+    int count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 2) != 0) {
+        count++;
+        lua_pop(L, 1);
+    }
+    map->Reserve(count);
+
+    lua_pushnil(L);
+    while (lua_next(L, 2) != 0) {
+        // copy key, converting it in place would break lua_next
+        lua_pushvalue(L, -2);
+        int top = lua_gettop(L);
+        cpp_table_map_container_set_kv(L, map, top, top - 1, key_message_id, value_message_id);
+        lua_pop(L, 2);
+    }
+    // keys went to the presized hash part, move a dense range of them to the array part
+    map->PlanArray();
+    return 0;
+}
+
 static int cpp_table_delete_map_container(lua_State *L) {
     auto pointer = lua_touserdata(L, 1);
     if (!pointer) {
@@ -1959,8 +2855,13 @@ static int cpp_table_delete_map_container(lua_State *L) {
 std::vector<luaL_Reg> GetCppTableFuncs() {
     return {
             {"cpp_table_set_message_id",             cpp_table::cpp_table_set_message_id},
+            {"cpp_table_plan_layout",                cpp_table::cpp_table_plan_layout},
             {"cpp_table_update_layout",              cpp_table::cpp_table_update_layout},
             {"cpp_table_dump_statistic",             cpp_table::cpp_table_dump_statistic},
+            {"cpp_table_set_field_stat",             cpp_table::cpp_table_set_field_stat},
+            {"cpp_table_set_map_backend",            cpp_table::cpp_table_set_map_backend},
+            {"cpp_table_deep_size",                  cpp_table::cpp_table_deep_size},
+            {"cpp_table_string_heap_compact",        cpp_table::cpp_table_string_heap_compact},
 
             {"cpp_table_create_container",           cpp_table::cpp_table_create_container},
             {"cpp_table_delete_container",           cpp_table::cpp_table_delete_container},
@@ -2010,7 +2911,12 @@ std::vector<luaL_Reg> GetCppTableFuncs() {
 
             {"cpp_table_create_map_container",       cpp_table::cpp_table_create_map_container},
             {"cpp_table_map_container_get",          cpp_table::cpp_table_map_container_get},
+            {"cpp_table_map_container_get_many",     cpp_table::cpp_table_map_container_get_many},
             {"cpp_table_map_container_set",          cpp_table::cpp_table_map_container_set},
+            {"cpp_table_map_container_reserve",      cpp_table::cpp_table_map_container_reserve},
+            {"cpp_table_map_container_set_all",      cpp_table::cpp_table_map_container_set_all},
+            {"cpp_table_map_container_compact",      cpp_table::cpp_table_map_container_compact},
+            {"cpp_table_map_container_plan_array",   cpp_table::cpp_table_map_container_plan_array},
             {"cpp_table_delete_map_container",       cpp_table::cpp_table_delete_map_container},
     };
 }
@@ -2,6 +2,12 @@
 
 #include "core.h"
 #include "coalesced_hashmap.h"
+#include "swiss_hashmap.h"
+
+// compile per member access counters in, still need cpp_table_set_field_stat(true) to start counting
+#ifndef CPP_TABLE_FIELD_STAT
+#define CPP_TABLE_FIELD_STAT 1
+#endif
 
 namespace cpp_table {
 
@@ -270,6 +276,14 @@ protected:
     int m_len = 0;
 };
 
+// memory counters, maintained incrementally when objects are created, resized and destroyed
+struct MemoryStat {
+    int64_t count = 0; // object count
+    int64_t bytes = 0; // object and buffer bytes
+    int64_t capacity = 0; // array slots, map nodes
+    int64_t size = 0; // array non nil elements, map entries
+};
+
 // a simple string heap class, use to store unique string data
 class StringHeap {
 public:
@@ -284,12 +298,61 @@ public:
         }
         auto value = MakeSharedBySize<String>(sizeof(String) + str.size() + 1, str.data(), str.size());
         m_string_set.Insert(value);
+        m_stat.count++;
+        m_stat.bytes += sizeof(String) + str.size() + 1;
         return value;
     }
 
+    // find a string without adding it, null if it is not in the heap
+    StringPtr Get(StringView str) {
+        WeakStringPtr wv;
+        if (m_string_set.Find(str, wv)) {
+            return wv.lock();
+        }
+        return StringPtr();
+    }
+
     void Remove(StringView str) {
         LLOG("StringHeap remove string %s", str.data());
-        m_string_set.Erase(str);
+        if (m_string_set.Erase(str)) {
+            m_stat.count--;
+            m_stat.bytes -= sizeof(String) + str.size() + 1;
+        }
+    }
+
+    // count and bytes of strings, capacity is the node count of the set
+    MemoryStat GetStat() const {
+        auto ret = m_stat;
+        ret.capacity = m_string_set.Capacity();
+        ret.size = m_stat.count;
+        return ret;
+    }
+
+    size_t GetSetMemorySize() const {
+        return m_string_set.MemorySize();
+    }
+
+    // shrink the string set after many strings are gone, e.g. config reload, return bytes released
+    int64_t Compact() {
+        int64_t old_bytes = m_string_set.MemorySize();
+        m_string_set.Compact();
+        return old_bytes - m_string_set.MemorySize();
+    }
+
+    // refcount of all strings, key is the upper power of 2 of refcount
+    std::map<int, int64_t> RefCountDistribution() {
+        std::map<int, int64_t> ret;
+        for (auto it = m_string_set.Begin(); it != m_string_set.End(); ++it) {
+            auto str = it.GetKey().get();
+            if (str && str->Ref() > 0) {
+                int bucket = 1;
+                while (bucket < str->Ref()) {
+                    bucket <<= 1;
+                }
+                ret[bucket]++;
+            }
+        }
+        return ret;
     }
 
     std::vector<StringPtr> Dump() {
@@ -326,6 +389,7 @@ private:
     };
 
     coalesced_hashmap::CoalescedHashSet <WeakStringPtr, WeakStringHash, WeakStringEqual> m_string_set;
+    MemoryStat m_stat;
 };
 
 enum MessageIdType {
@@ -339,6 +403,13 @@ enum MessageIdType {
     mt_string = 8,
 };
 
+// hash map implementation of Map, mb_default follows the global setting of LayoutMgr
+enum MapBackend {
+    mb_default = 0,
+    mb_coalesced = 1,
+    mb_swiss = 2,
+};
+
 // same as lua table, use to store key-value schema data
 class Layout : public RefCntObj {
 public:
@@ -355,6 +426,7 @@ public:
             key = other->key;
             value = other->value;
             pos = other->pos;
+            flag = other->flag;
             size = other->size;
             tag = other->tag;
             shared = other->shared;
@@ -368,7 +440,8 @@ public:
         StringPtr type;
         StringPtr key;
         StringPtr value;
-        int pos = 0;
+        int pos = 0; // value offset in container buffer, aligned to value size
+        int flag = 0; // presence bit index in container buffer, byte = flag / 8, bit = flag % 8
         int size = 0;
         int tag = 0;
         int shared = 0;
@@ -376,6 +449,13 @@ public:
         int value_message_id = 0;
         int key_size = 0;
         int key_shared = 0;
+        // access counters, not copied by CopyFrom, same tag keeps counting after hot fix
+        uint64_t read_count = 0;
+        uint64_t write_count = 0;
+        // array or map memory of this member, not copied by CopyFrom
+        MemoryStat mem_stat;
+        // MapBackend of maps created for this member, not copied by CopyFrom
+        int map_backend = mb_default;
     };
 
     typedef SharedPtr<Member> MemberPtr;
@@ -384,8 +464,13 @@ public:
         m_member[tag] = member;
     }
 
+    // find, not operator[], a miss must not insert a null member
     MemberPtr GetMember(int tag) {
-        return m_member[tag];
+        auto it = m_member.find(tag);
+        if (it == m_member.end()) {
+            return MemberPtr();
+        }
+        return it->second;
     }
 
     std::unordered_map<int, MemberPtr> &GetMember() {
@@ -416,11 +501,53 @@ public:
         return m_message_id;
     }
 
+    // members never removed, so raw pointer is safe, call after members changed
+    void UpdateFlagIndex() {
+        m_flag_member.clear();
+        for (auto &it: m_member) {
+            auto mem = it.second.get();
+            if (!mem) {
+                continue;
+            }
+            if (mem->flag >= (int) m_flag_member.size()) {
+                m_flag_member.resize(mem->flag + 1, 0);
+            }
+            m_flag_member[mem->flag] = mem;
+        }
+    }
+
+    void SetFieldStat(bool enable) {
+        m_field_stat = enable;
+    }
+
+    MemoryStat &GetContainerStat() {
+        return m_container_stat;
+    }
+
+    void CountRead(int flag) {
+#if CPP_TABLE_FIELD_STAT
+        if (m_field_stat && flag < (int) m_flag_member.size() && m_flag_member[flag]) {
+            ++m_flag_member[flag]->read_count;
+        }
+#endif
+    }
+
+    void CountWrite(int flag) {
+#if CPP_TABLE_FIELD_STAT
+        if (m_field_stat && flag < (int) m_flag_member.size() && m_flag_member[flag]) {
+            ++m_flag_member[flag]->write_count;
+        }
+#endif
+    }
+
 private:
     int m_message_id;
     StringPtr m_name;
     std::unordered_map<int, MemberPtr> m_member;
-    int m_total_size;
+    int m_total_size = 0;
+    bool m_field_stat = false;
+    std::vector<Member *> m_flag_member;
+    MemoryStat m_container_stat;
 };
 
 typedef SharedPtr<Layout> LayoutPtr;
@@ -456,9 +583,71 @@ public:
         m_message_id[name] = message_id;
     }
 
+    std::unordered_map<StringPtr, LayoutPtr, StringPtrHash, StringPtrEqual> &GetAllLayout() {
+        return m_layout;
+    }
+
+    void SetFieldStat(bool enable) {
+        m_field_stat = enable;
+        for (auto &it: m_layout) {
+            it.second->SetFieldStat(enable);
+        }
+    }
+
+    bool GetFieldStat() const {
+        return m_field_stat;
+    }
+
+    void SetMapBackend(int backend) {
+        m_map_backend = backend;
+    }
+
+    int GetMapBackend() const {
+        return m_map_backend;
+    }
+
 private:
     std::unordered_map<StringPtr, LayoutPtr, StringPtrHash, StringPtrEqual> m_layout;
     std::unordered_map<StringPtr, int, StringPtrHash, StringPtrEqual> m_message_id;
+    bool m_field_stat = false;
+    int m_map_backend = mb_coalesced;
+};
+
+// plan the container buffer layout of a message, the result only depends on the proto, not on lua pairs order
+// every member gets an aligned value offset and a presence bit, presence bits are packed into flag bytes
+// new members are placed by hot hint, then alignment desc, size desc, tag asc, each one into the first free hole
+// when the layout already exists (hot fix), old members keep their place, new members only use never used bytes
+class LayoutPlanner {
+public:
+    struct Field {
+        int tag = 0;
+        int size = 0; // value size, without presence flag
+        int hot = 0; // hot hint rank, smaller is hotter
+        int pos = -1;
+        int flag = -1;
+    };
+
+    LayoutPlanner(LayoutPtr old_layout);
+
+    ~LayoutPlanner() {}
+
+    // fill pos and flag of fields, return total size, or -1 if conflict with old layout
+    int Plan(std::vector<Field> &fields);
+
+    static int Align(int size) {
+        return (size == 1 || size == 2 || size == 4 || size == 8) ? size : (size > 8 ? 8 : 1);
+    }
+
+private:
+    void Occupy(int pos, int size);
+
+    int Alloc(int size, int align);
+
+private:
+    LayoutPtr m_old_layout;
+    std::vector<char> m_used;
+    std::vector<int> m_free_flag; // free presence bits in used flag bytes, back is the smallest
+    int m_total_size = 0;
 };
 
 // use to store lua struct data
@@ -476,10 +665,29 @@ public:
         return m_layout->GetMessageId();
     }
 
+    LayoutPtr GetLayout() const {
+        return m_layout;
+    }
+
+    int GetBufferSize() const {
+        return m_buffer_size;
+    }
+
+    // idx is the value offset, flag is the presence bit, both come from Layout::Member
     template<typename T>
-    bool Get(int idx, T &value, bool &is_nil) {
-        int max = idx + 1 + sizeof(T);
-        if (idx < 0 || max > m_layout->GetTotalSize()) {
+    bool Get(int idx, int flag, T &value, bool &is_nil) {
+        if (!Load<T>(idx, flag, value, is_nil)) {
+            return false;
+        }
+        m_layout->CountRead(flag);
+        return true;
+    }
+
+    // same as Get, but not counted as field read
+    template<typename T>
+    bool Load(int idx, int flag, T &value, bool &is_nil) {
+        int max = std::max(idx + (int) sizeof(T), (flag >> 3) + 1);
+        if (idx < 0 || flag < 0 || max > m_layout->GetTotalSize()) {
             return false;
         }
         if (max > m_buffer_size) {
@@ -487,10 +695,9 @@ public:
             is_nil = true;
             return true;
         }
-        char flag = m_buffer[idx] & 0x01;
-        if (flag) {
+        if (m_buffer[flag >> 3] & (1 << (flag & 0x07))) {
             is_nil = false;
-            value = *(T *) (m_buffer + idx + 1);
+            value = *(T *) (m_buffer + idx);
         } else {
             is_nil = true;
         }
@@ -498,14 +705,16 @@ public:
     }
 
     template<typename T>
-    bool Set(int idx, const T &value, bool is_nil) {
-        int max = idx + 1 + sizeof(T);
-        if (idx < 0 || max > m_layout->GetTotalSize()) {
+    bool Set(int idx, int flag, const T &value, bool is_nil) {
+        int max = std::max(idx + (int) sizeof(T), (flag >> 3) + 1);
+        if (idx < 0 || flag < 0 || max > m_layout->GetTotalSize()) {
             return false;
         }
+        m_layout->CountWrite(flag);
         if (max > m_buffer_size) {
             // hot fix, new member added, need to resize buffer, use double size
             auto new_size = std::min(m_layout->GetTotalSize(), max * 2);
+            m_layout->GetContainerStat().bytes += new_size - m_buffer_size;
             auto new_buffer = new char[new_size];
             memset(new_buffer, 0, new_size);
             if (m_buffer) {
@@ -516,19 +725,19 @@ public:
             m_buffer_size = new_size;
         }
         if (is_nil) {
-            m_buffer[idx] &= 0xfe;
+            m_buffer[flag >> 3] &= ~(1 << (flag & 0x07));
         } else {
-            m_buffer[idx] |= 0x01;
-            *(T *) (m_buffer + idx + 1) = value;
+            m_buffer[flag >> 3] |= (1 << (flag & 0x07));
+            *(T *) (m_buffer + idx) = value;
         }
         return true;
     }
 
     template<typename T>
-    bool GetSharedObj(int idx, SharedPtr<T> &out, bool &is_nil) {
+    bool GetSharedObj(int idx, int flag, SharedPtr<T> &out, bool &is_nil) {
         T *old = 0;
         bool is_old_nil = false;
-        auto ret = Get<T *>(idx, old, is_old_nil);
+        auto ret = Get<T *>(idx, flag, old, is_old_nil);
         if (!ret) {
             return false;
         }
@@ -542,10 +751,10 @@ public:
     }
 
     template<typename T>
-    bool SetSharedObj(int idx, SharedPtr<T> in, bool is_nil) {
+    bool SetSharedObj(int idx, int flag, SharedPtr<T> in, bool is_nil) {
         T *old = 0;
         bool is_old_nil = false;
-        auto ret = Get<T *>(idx, old, is_old_nil);
+        auto ret = Load<T *>(idx, flag, old, is_old_nil);
         if (!ret) {
             return false;
         }
@@ -553,13 +762,13 @@ public:
             if (!is_old_nil) {
                 old->Release();
             }
-            return Set<T *>(idx, 0, true);
+            return Set<T *>(idx, flag, 0, true);
         } else {
             in.get()->AddRef();
             if (!is_old_nil) {
                 old->Release();
             }
-            return Set<T *>(idx, in.get(), false);
+            return Set<T *>(idx, flag, in.get(), false);
         }
     }
 
@@ -594,6 +803,10 @@ public:
         return m_layout_member->message_id;
     }
 
+    int GetBufferSize() const {
+        return m_buffer_size;
+    }
+
     template<typename T>
     bool Get(int idx, T &value, bool &is_nil) {
         idx = idx * m_layout_member->key_size;
@@ -623,9 +836,12 @@ public:
         if (idx < 0) {
             return false;
         }
+        auto &stat = m_layout_member->mem_stat;
         if (max > m_buffer_size) {
             // out of range, need to resize buffer, use double size
             auto new_size = 2 * max;
+            stat.bytes += new_size - m_buffer_size;
+            stat.capacity += (new_size - m_buffer_size) / m_layout_member->key_size;
             auto new_buffer = new char[new_size];
             memset(new_buffer, 0, new_size);
             if (m_buffer) {
@@ -635,11 +851,14 @@ public:
             m_buffer = new_buffer;
             m_buffer_size = new_size;
         }
+        bool old_nil = !(m_buffer[idx] & 0x01);
         if (is_nil) {
             m_buffer[idx] &= 0xfe;
+            stat.size -= old_nil ? 0 : 1;
         } else {
             m_buffer[idx] |= 0x01;
             *(T *) (m_buffer + idx + 1) = value;
+            stat.size += old_nil ? 1 : 0;
         }
         return true;
     }
@@ -695,6 +914,148 @@ private:
 static_assert(sizeof(Array) == 24, "Array size must be 24");
 typedef SharedPtr<Array> ArrayPtr;
 
+// a hash map of either backend, chosen when it is created
+template<typename Key, typename Value, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>>
+class SwitchableHashMap {
+public:
+    typedef coalesced_hashmap::SmallCoalescedHashMap<Key, Value, Hash, Equal> CoalescedType;
+    typedef swiss_hashmap::SwissHashMap<Key, Value, Hash, Equal> SwissType;
+
+    explicit SwitchableHashMap(bool swiss = false) : m_swiss(swiss) {
+        if (m_swiss) {
+            new(&m_storage.swiss) SwissType();
+        } else {
+            new(&m_storage.coalesced) CoalescedType();
+        }
+    }
+
+    ~SwitchableHashMap() {
+        if (m_swiss) {
+            m_storage.swiss.~SwissType();
+        } else {
+            m_storage.coalesced.~CoalescedType();
+        }
+    }
+
+    SwitchableHashMap(const SwitchableHashMap &) = delete;
+
+    SwitchableHashMap &operator=(const SwitchableHashMap &) = delete;
+
+    bool IsSwiss() const {
+        return m_swiss;
+    }
+
+    bool Insert(const Key &key, const Value &value) {
+        return m_swiss ? m_storage.swiss.Insert(key, value) : m_storage.coalesced.Insert(key, value);
+    }
+
+    bool Find(const Key &key, Value &value) {
+        return m_swiss ? m_storage.swiss.Find(key, value) : m_storage.coalesced.Find(key, value);
+    }
+
+    bool Erase(const Key &key) {
+        return m_swiss ? m_storage.swiss.Erase(key) : m_storage.coalesced.Erase(key);
+    }
+
+    void Prefetch(const Key &key) const {
+        if (m_swiss) {
+            m_storage.swiss.Prefetch(key);
+        } else {
+            m_storage.coalesced.Prefetch(key);
+        }
+    }
+
+    int Capacity() const {
+        return m_swiss ? m_storage.swiss.Capacity() : m_storage.coalesced.Capacity();
+    }
+
+    size_t MemorySize() const {
+        return m_swiss ? sizeof(*this) - sizeof(SwissType) + m_storage.swiss.MemorySize() :
+               sizeof(*this) - sizeof(CoalescedType) + m_storage.coalesced.MemorySize();
+    }
+
+    int Size() const {
+        return m_swiss ? m_storage.swiss.Size() : m_storage.coalesced.Size();
+    }
+
+    void Reserve(int n) {
+        if (m_swiss) {
+            m_storage.swiss.Reserve(n);
+        } else {
+            m_storage.coalesced.Reserve(n);
+        }
+    }
+
+    void Compact() {
+        if (m_swiss) {
+            m_storage.swiss.Compact();
+        } else {
+            m_storage.coalesced.Compact();
+        }
+    }
+
+    // only the coalesced backend has an array part
+    void PlanArray() {
+        if (!m_swiss) {
+            m_storage.coalesced.PlanArray();
+        }
+    }
+
+    class Iterator {
+    public:
+        Iterator(typename CoalescedType::Iterator it) : m_swiss(false), m_coalesced_iter(it) {}
+
+        Iterator(typename SwissType::Iterator it) : m_swiss(true), m_coalesced_iter(0, 0), m_swiss_iter(it) {}
+
+        Key GetKey() const {
+            return m_swiss ? m_swiss_iter.GetKey() : m_coalesced_iter.GetKey();
+        }
+
+        const Value &GetValue() const {
+            return m_swiss ? m_swiss_iter.GetValue() : m_coalesced_iter.GetValue();
+        }
+
+        Iterator &operator++() {
+            if (m_swiss) {
+                ++m_swiss_iter;
+            } else {
+                ++m_coalesced_iter;
+            }
+            return *this;
+        }
+
+        bool operator!=(const Iterator &other) {
+            return m_swiss ? m_swiss_iter != other.m_swiss_iter : m_coalesced_iter != other.m_coalesced_iter;
+        }
+
+    private:
+        bool m_swiss;
+        typename CoalescedType::Iterator m_coalesced_iter;
+        typename SwissType::Iterator m_swiss_iter;
+    };
+
+    Iterator Begin() {
+        return m_swiss ? Iterator(m_storage.swiss.Begin()) : Iterator(m_storage.coalesced.Begin());
+    }
+
+    Iterator End() {
+        return m_swiss ? Iterator(m_storage.swiss.End()) : Iterator(m_storage.coalesced.End());
+    }
+
+private:
+    union Storage {
+        Storage() {}
+
+        ~Storage() {}
+
+        CoalescedType coalesced;
+        SwissType swiss;
+    };
+
+    Storage m_storage;
+    bool m_swiss;
+};
+
 class Map : public RefCntObj {
 public:
     Map(Layout::MemberPtr layout_member);
@@ -742,18 +1103,18 @@ public:
     union MapPointer {
         void *m_void;
 
-        typedef coalesced_hashmap::CoalescedHashMap <int32_t, MapValue32> Map32by32;
-        typedef coalesced_hashmap::CoalescedHashMap <int32_t, MapValue64> Map64by32;
+        typedef SwitchableHashMap <int32_t, MapValue32> Map32by32;
+        typedef SwitchableHashMap <int32_t, MapValue64> Map64by32;
         Map32by32 *m_32_32;
         Map64by32 *m_32_64;
 
-        typedef coalesced_hashmap::CoalescedHashMap <int64_t, MapValue32> Map32by64;
-        typedef coalesced_hashmap::CoalescedHashMap <int64_t, MapValue64> Map64by64;
+        typedef SwitchableHashMap <int64_t, MapValue32> Map32by64;
+        typedef SwitchableHashMap <int64_t, MapValue64> Map64by64;
         Map32by64 *m_64_32;
         Map64by64 *m_64_64;
 
-        typedef coalesced_hashmap::CoalescedHashMap <StringPtr, MapValue32, StringPtrHash, StringPtrEqual> Map32byString;
-        typedef coalesced_hashmap::CoalescedHashMap <StringPtr, MapValue64, StringPtrHash, StringPtrEqual> Map64byString;
+        typedef SwitchableHashMap <StringPtr, MapValue32, StringPtrHash, StringPtrEqual> Map32byString;
+        typedef SwitchableHashMap <StringPtr, MapValue64, StringPtrHash, StringPtrEqual> Map64byString;
         Map32byString *m_string_32;
         Map64byString *m_string_64;
     };
@@ -762,6 +1123,10 @@ public:
         return m_map;
     }
 
+    bool IsSwiss() const {
+        return m_swiss;
+    }
+
     MapValue32 Get32by32(int32_t key, bool &is_nil) {
         MapValue32 value;
         is_nil = !m_map.m_32_32->Find(key, value);
@@ -799,86 +1164,159 @@ public:
     }
 
     void Set32by32(int32_t key, MapValue32 value) {
-        if (!m_map.m_32_32) {
-            m_map.m_32_32 = new MapPointer::Map32by32();
-        }
-        m_map.m_32_32->Insert(key, value);
+        InsertWithStat(m_map.m_32_32, key, value);
     }
 
     void Set64by32(int32_t key, MapValue64 value) {
-        if (!m_map.m_32_64) {
-            m_map.m_32_64 = new MapPointer::Map64by32();
-        }
-        m_map.m_32_64->Insert(key, value);
+        InsertWithStat(m_map.m_32_64, key, value);
     }
 
     void Set32by64(int64_t key, MapValue32 value) {
-        if (!m_map.m_64_32) {
-            m_map.m_64_32 = new MapPointer::Map32by64();
-        }
-        m_map.m_64_32->Insert(key, value);
+        InsertWithStat(m_map.m_64_32, key, value);
     }
 
     void Set64by64(int64_t key, MapValue64 value) {
-        if (!m_map.m_64_64) {
-            m_map.m_64_64 = new MapPointer::Map64by64();
-        }
-        m_map.m_64_64->Insert(key, value);
+        InsertWithStat(m_map.m_64_64, key, value);
     }
 
     void Set32byString(StringPtr key, MapValue32 value) {
-        if (!m_map.m_string_32) {
-            m_map.m_string_32 = new MapPointer::Map32byString();
-        }
-        m_map.m_string_32->Insert(key, value);
+        InsertWithStat(m_map.m_string_32, key, value);
     }
 
     void Set64byString(StringPtr key, MapValue64 value) {
-        if (!m_map.m_string_64) {
-            m_map.m_string_64 = new MapPointer::Map64byString();
-        }
-        m_map.m_string_64->Insert(key, value);
+        InsertWithStat(m_map.m_string_64, key, value);
     }
 
     void Remove32by32(int32_t key) {
         if (m_map.m_32_32) {
-            m_map.m_32_32->Erase(key);
+            EraseWithStat(m_map.m_32_32, key);
         }
     }
 
     void Remove64by32(int32_t key) {
         if (m_map.m_32_64) {
-            m_map.m_32_64->Erase(key);
+            EraseWithStat(m_map.m_32_64, key);
         }
     }
 
     void Remove32by64(int64_t key) {
         if (m_map.m_64_32) {
-            m_map.m_64_32->Erase(key);
+            EraseWithStat(m_map.m_64_32, key);
         }
     }
 
     void Remove64by64(int64_t key) {
         if (m_map.m_64_64) {
-            m_map.m_64_64->Erase(key);
+            EraseWithStat(m_map.m_64_64, key);
         }
     }
 
     void Remove32byString(StringPtr key) {
         if (m_map.m_string_32) {
-            m_map.m_string_32->Erase(key);
+            EraseWithStat(m_map.m_string_32, key);
         }
     }
 
     void Remove64byString(StringPtr key) {
         if (m_map.m_string_64) {
-            m_map.m_string_64->Erase(key);
+            EraseWithStat(m_map.m_string_64, key);
         }
     }
 
+    // presize for n entries, e.g. when sinking a lua table
+    void Reserve(int n);
+
+    // shrink to the smallest capacity holding all entries, return bytes released
+    int64_t Compact();
+
+    // move dense integer keys into the array part, e.g. after sinking a lua table
+    void PlanArray();
+
 private:
     void ReleaseAllSharedObj();
 
+    template<typename M>
+    void ReserveWithStat(M *&map, int n) {
+        auto &stat = m_layout_member->mem_stat;
+        if (!map) {
+            map = new M(m_swiss);
+            stat.bytes += map->MemorySize();
+            stat.capacity += map->Capacity();
+        }
+        int64_t old_bytes = map->MemorySize();
+        int64_t old_capacity = map->Capacity();
+        map->Reserve(n);
+        stat.bytes += map->MemorySize() - old_bytes;
+        stat.capacity += map->Capacity() - old_capacity;
+    }
+
+    template<typename M, typename K, typename V>
+    void InsertWithStat(M *&map, const K &key, const V &value) {
+        auto &stat = m_layout_member->mem_stat;
+        if (!map) {
+            map = new M(m_swiss);
+            stat.bytes += map->MemorySize();
+            stat.capacity += map->Capacity();
+        }
+        int64_t old_bytes = map->MemorySize();
+        int64_t old_capacity = map->Capacity();
+        if (map->Insert(key, value)) {
+            stat.size++;
+        }
+        stat.bytes += map->MemorySize() - old_bytes;
+        stat.capacity += map->Capacity() - old_capacity;
+    }
+
+    // erase may shrink a sparse map, so bytes and capacity change too
+    template<typename M, typename K>
+    void EraseWithStat(M *map, const K &key) {
+        auto &stat = m_layout_member->mem_stat;
+        int64_t old_bytes = map->MemorySize();
+        int64_t old_capacity = map->Capacity();
+        if (map->Erase(key)) {
+            stat.size--;
+        }
+        stat.bytes += map->MemorySize() - old_bytes;
+        stat.capacity += map->Capacity() - old_capacity;
+    }
+
+    template<typename M>
+    int64_t CompactWithStat(M *map) {
+        if (!map) {
+            return 0;
+        }
+        auto &stat = m_layout_member->mem_stat;
+        int64_t old_bytes = map->MemorySize();
+        int64_t old_capacity = map->Capacity();
+        map->Compact();
+        stat.bytes += map->MemorySize() - old_bytes;
+        stat.capacity += map->Capacity() - old_capacity;
+        return old_bytes - map->MemorySize();
+    }
+
+    template<typename M>
+    void PlanArrayWithStat(M *map) {
+        if (!map) {
+            return;
+        }
+        auto &stat = m_layout_member->mem_stat;
+        int64_t old_bytes = map->MemorySize();
+        int64_t old_capacity = map->Capacity();
+        map->PlanArray();
+        stat.bytes += map->MemorySize() - old_bytes;
+        stat.capacity += map->Capacity() - old_capacity;
+    }
+
+    template<typename M>
+    void DeleteWithStat(M *&map) {
+        auto &stat = m_layout_member->mem_stat;
+        stat.bytes -= map->MemorySize();
+        stat.capacity -= map->Capacity();
+        stat.size -= map->Size();
+        delete map;
+        map = 0;
+    }
+
     void ReleaseStrBy32() {
         for (auto it = m_map.m_32_64->Begin(); it != m_map.m_32_64->End(); ++it) {
             auto v = it.GetValue();
@@ -924,6 +1362,7 @@ private:
 private:
     Layout::MemberPtr m_layout_member;
     MapPointer m_map;
+    bool m_swiss;
 };
 
 typedef SharedPtr<Map> MapPtr;
@@ -995,12 +1434,104 @@ public:
         return m_map.size();
     }
 
+    // refcount of objects held by lua, key is the upper power of 2 of refcount
+    template<typename T>
+    static std::map<int, int64_t> RefCountDistribution(const std::unordered_map<void *, T> &objs) {
+        std::map<int, int64_t> ret;
+        for (auto &it: objs) {
+            int bucket = 1;
+            while (bucket < it.second->Ref()) {
+                bucket <<= 1;
+            }
+            ret[bucket]++;
+        }
+        return ret;
+    }
+
+    std::map<int, int64_t> ContainerRefCountDistribution() const {
+        return RefCountDistribution(m_container);
+    }
+
+    std::map<int, int64_t> ArrayRefCountDistribution() const {
+        return RefCountDistribution(m_array);
+    }
+
+    std::map<int, int64_t> MapRefCountDistribution() const {
+        return RefCountDistribution(m_map);
+    }
+
 private:
     std::unordered_map<void *, ContainerPtr> m_container;
     std::unordered_map<void *, ArrayPtr> m_array;
     std::unordered_map<void *, MapPtr> m_map;
 };
 
+// deep memory size of one object and everything it references, shared objects are counted once
+class DeepSizer {
+public:
+    DeepSizer() {}
+
+    ~DeepSizer() {}
+
+    int64_t Size(Container *obj);
+
+    int64_t Size(Array *obj);
+
+    int64_t Size(Map *obj);
+
+    int64_t Size(String *obj);
+
+    int64_t GetObjectCount() const {
+        return m_visited.size();
+    }
+
+private:
+    bool Visit(void *obj) {
+        return m_visited.insert(obj).second;
+    }
+
+    // shared pointer stored in container or array, string or message
+    int64_t SizeByMessageId(RefCntObj *obj, int message_id);
+
+    template<typename M>
+    int64_t MapSize(M *map, int value_message_id) {
+        int64_t ret = map->MemorySize();
+        for (auto it = map->Begin(); it != map->End(); ++it) {
+            ret += KeySize(it.GetKey());
+            ret += ValueSize(it.GetValue(), value_message_id);
+        }
+        return ret;
+    }
+
+    int64_t KeySize(int32_t key) {
+        return 0;
+    }
+
+    int64_t KeySize(int64_t key) {
+        return 0;
+    }
+
+    int64_t KeySize(const StringPtr &key) {
+        return Size(key.get());
+    }
+
+    int64_t ValueSize(Map::MapValue32 value, int value_message_id) {
+        return 0;
+    }
+
+    int64_t ValueSize(Map::MapValue64 value, int value_message_id) {
+        if (value_message_id == mt_string) {
+            return Size(value.m_string);
+        } else if (value_message_id > mt_string) {
+            return Size(value.m_obj);
+        }
+        return 0;
+    }
+
+private:
+    std::unordered_set<void *> m_visited;
+};
+
 }
 
 std::vector<luaL_Reg> GetCppTableFuncs();
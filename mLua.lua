@@ -1,8 +1,13 @@
 local core = require "libmluacore"
 
 local core_cpp_table_set_message_id = core.cpp_table_set_message_id
+local core_cpp_table_plan_layout = core.cpp_table_plan_layout
 local core_cpp_table_update_layout = core.cpp_table_update_layout
 local core_cpp_table_dump_statistic = core.cpp_table_dump_statistic
+local core_cpp_table_set_field_stat = core.cpp_table_set_field_stat
+local core_cpp_table_set_map_backend = core.cpp_table_set_map_backend
+local core_cpp_table_deep_size = core.cpp_table_deep_size
+local core_cpp_table_string_heap_compact = core.cpp_table_string_heap_compact
 
 local core_cpp_table_create_container = core.cpp_table_create_container
 local core_cpp_table_container_get_int32 = core.cpp_table_container_get_int32
@@ -52,7 +57,12 @@ local core_cpp_table_delete_array_container = core.cpp_table_delete_array_contai
 
 local core_cpp_table_create_map_container = core.cpp_table_create_map_container
 local core_cpp_table_map_container_get = core.cpp_table_map_container_get
+local core_cpp_table_map_container_get_many = core.cpp_table_map_container_get_many
 local core_cpp_table_map_container_set = core.cpp_table_map_container_set
+local core_cpp_table_map_container_reserve = core.cpp_table_map_container_reserve
+local core_cpp_table_map_container_set_all = core.cpp_table_map_container_set_all
+local core_cpp_table_map_container_compact = core.cpp_table_map_container_compact
+local core_cpp_table_map_container_plan_array = core.cpp_table_map_container_plan_array
 local core_cpp_table_delete_map_container = core.cpp_table_delete_map_container
 
 local core_roaring64map_add = core.roaring64map_add
@@ -65,9 +75,24 @@ local core_roaring64map_clear = core.roaring64map_clear
 
 local core_quick_archiver_save = core.quick_archiver_save
 local core_quick_archiver_load = core.quick_archiver_load
+local core_quick_archiver_save_file = core.quick_archiver_save_file
+local core_quick_archiver_load_file = core.quick_archiver_load_file
+local core_quick_archiver_save_async = core.quick_archiver_save_async
+local core_quick_archiver_open = core.quick_archiver_open
 local core_quick_archiver_set_lz_threshold = core.quick_archiver_set_lz_threshold
 local core_quick_archiver_set_max_buffer_size = core.quick_archiver_set_max_buffer_size
 local core_quick_archiver_set_lz_acceleration = core.quick_archiver_set_lz_acceleration
+local core_quick_archiver_set_lz_level = core.quick_archiver_set_lz_level
+local core_quick_archiver_set_string_dedup_min_length = core.quick_archiver_set_string_dedup_min_length
+local core_quick_archiver_set_dict = core.quick_archiver_set_dict
+local core_quick_archiver_set_lz_dict = core.quick_archiver_set_lz_dict
+local core_quick_archiver_make_lz_dict = core.quick_archiver_make_lz_dict
+local core_quick_archiver_set_track_refs = core.quick_archiver_set_track_refs
+local core_quick_archiver_set_table_dedup = core.quick_archiver_set_table_dedup
+local core_quick_archiver_set_share_dedup_tables = core.quick_archiver_set_share_dedup_tables
+local core_quick_archiver_set_indexed = core.quick_archiver_set_indexed
+local core_quick_archiver_stat = core.quick_archiver_stat
+local core_quick_archiver_new = core.quick_archiver_new
 
 --------------------------cpp-table begin-------------------------------------
 
@@ -76,12 +101,22 @@ local lua_to_cpp = {}
 function lua_to_cpp.sink_map(message_name, layout_member, map)
     local value = layout_member.value
     local container = core_cpp_table_create_map_container(message_name, layout_member.tag)
+    if lua_to_cpp.is_normal_type(value) then
+        -- bulk build in cpp, presized by the table count
+        core_cpp_table_map_container_set_all(container, map, layout_member.message_id, layout_member.value_message_id)
+        return container
+    end
+    local count = 0
+    for _, _ in pairs(map) do
+        count = count + 1
+    end
+    core_cpp_table_map_container_reserve(container, count)
     for k, v in pairs(map) do
-        if not lua_to_cpp.is_normal_type(value) then
-            v = _G.cpp_table_sink(value, v)
-        end
+        v = _G.cpp_table_sink(value, v)
         container[k] = v
     end
+    -- the presized hash part never grew, so the array part is planned once all keys are in
+    core_cpp_table_map_container_plan_array(container)
     return container
 end
 
@@ -333,6 +368,7 @@ end
 function lua_to_cpp.create_layout_meta_func(message_name, layout)
     for k, v in pairs(layout.members) do
         local pos = v.pos
+        local flag = v.flag
         local t = v.type
         local key = v.key
         local key_size = v.key_size
@@ -342,92 +378,92 @@ function lua_to_cpp.create_layout_meta_func(message_name, layout)
         if t == "normal" then
             if key == "int32" then
                 v.index_func = function(t)
-                    return core_cpp_table_container_get_int32(t, pos)
+                    return core_cpp_table_container_get_int32(t, pos, flag)
                 end
                 v.newindex_func = function(t, value)
-                    core_cpp_table_container_set_int32(t, pos, value)
+                    core_cpp_table_container_set_int32(t, pos, flag, value)
                 end
             elseif key == "uint32" then
                 v.index_func = function(t)
-                    return core_cpp_table_container_get_uint32(t, pos)
+                    return core_cpp_table_container_get_uint32(t, pos, flag)
                 end
                 v.newindex_func = function(t, value)
-                    core_cpp_table_container_set_uint32(t, pos, value)
+                    core_cpp_table_container_set_uint32(t, pos, flag, value)
                 end
             elseif key == "int64" then
                 v.index_func = function(t)
-                    return core_cpp_table_container_get_int64(t, pos)
+                    return core_cpp_table_container_get_int64(t, pos, flag)
                 end
                 v.newindex_func = function(t, value)
-                    core_cpp_table_container_set_int64(t, pos, value)
+                    core_cpp_table_container_set_int64(t, pos, flag, value)
                 end
             elseif key == "uint64" then
                 v.index_func = function(t)
-                    return core_cpp_table_container_get_uint64(t, pos)
+                    return core_cpp_table_container_get_uint64(t, pos, flag)
                 end
                 v.newindex_func = function(t, value)
-                    core_cpp_table_container_set_uint64(t, pos, value)
+                    core_cpp_table_container_set_uint64(t, pos, flag, value)
                 end
             elseif key == "float" then
                 v.index_func = function(t)
-                    return core_cpp_table_container_get_float(t, pos)
+                    return core_cpp_table_container_get_float(t, pos, flag)
                 end
                 v.newindex_func = function(t, value)
-                    core_cpp_table_container_set_float(t, pos, value)
+                    core_cpp_table_container_set_float(t, pos, flag, value)
                 end
             elseif key == "double" then
                 v.index_func = function(t)
-                    return core_cpp_table_container_get_double(t, pos)
+                    return core_cpp_table_container_get_double(t, pos, flag)
                 end
                 v.newindex_func = function(t, value)
-                    core_cpp_table_container_set_double(t, pos, value)
+                    core_cpp_table_container_set_double(t, pos, flag, value)
                 end
             elseif key == "bool" then
                 v.index_func = function(t)
-                    return core_cpp_table_container_get_bool(t, pos)
+                    return core_cpp_table_container_get_bool(t, pos, flag)
                 end
                 v.newindex_func = function(t, value)
-                    core_cpp_table_container_set_bool(t, pos, value)
+                    core_cpp_table_container_set_bool(t, pos, flag, value)
                 end
             elseif key == "string" then
                 v.index_func = function(t)
-                    return core_cpp_table_container_get_string(t, pos)
+                    return core_cpp_table_container_get_string(t, pos, flag)
                 end
                 v.newindex_func = function(t, value)
-                    core_cpp_table_container_set_string(t, pos, value)
+                    core_cpp_table_container_set_string(t, pos, flag, value)
                 end
             else
                 v.index_func = function(t)
-                    return core_cpp_table_container_get_obj(t, pos)
+                    return core_cpp_table_container_get_obj(t, pos, flag)
                 end
                 v.newindex_func = function(t, value)
                     if type(value) == "table" then
                         value = _G.cpp_table_sink(key, value)
                     end
-                    core_cpp_table_container_set_obj(t, pos, value, message_id)
+                    core_cpp_table_container_set_obj(t, pos, flag, value, message_id)
                 end
             end
         elseif t == "array" then
             lua_to_cpp.create_layout_array_meta_func(v)
             v.index_func = function(t)
-                return core_cpp_table_container_get_array(t, pos)
+                return core_cpp_table_container_get_array(t, pos, flag)
             end
             v.newindex_func = function(t, value)
                 if type(value) == "table" then
                     value = lua_to_cpp.sink_array(message_name, v, value)
                 end
-                core_cpp_table_container_set_array(t, pos, value, message_id)
+                core_cpp_table_container_set_array(t, pos, flag, value, message_id)
             end
         elseif t == "map" then
             lua_to_cpp.create_layout_map_meta_func(v)
             v.index_func = function(t)
-                return core_cpp_table_container_get_map(t, pos)
+                return core_cpp_table_container_get_map(t, pos, flag)
             end
             v.newindex_func = function(t, value)
                 if type(value) == "table" then
                     value = lua_to_cpp.sink_map(message_name, v, value)
                 end
-                core_cpp_table_container_set_map(t, pos, value, message_id, value_message_id)
+                core_cpp_table_container_set_map(t, pos, flag, value, message_id, value_message_id)
             end
         else
             error("create layout meta func error, unknown type " .. type)
@@ -466,90 +502,67 @@ function lua_to_cpp.update_message_layout_id(message_name, layout)
 end
 
 ---create a cpp table layout
-function lua_to_cpp.create_layout(message_name, message)
+function lua_to_cpp.create_layout(message_name, message, hints)
     _G.CPP_TABLE_LAYOUT = _G.CPP_TABLE_LAYOUT or {}
     local old_proto = _G.CPP_TABLE_LAYOUT[message_name]
     if old_proto then
         error("create layout error, message " .. message_name .. " already exist")
     end
 
+    -- pos and flag are planned in cpp, same proto always get same layout
+    local plan, total_size = core_cpp_table_plan_layout(message_name, message, hints)
     local layout = {
         members = {},
-        total_size = 0
+        total_size = total_size
     }
-    local pos = 0
     for k, v in pairs(message) do
         layout.members[k] = {
             type = v.type,
             key = v.key,
             value = v.value or "",
-            pos = pos,
+            pos = plan[k].pos,
+            flag = plan[k].flag,
             size = v.size,
             tag = v.tag,
             shared = v.shared,
             key_size = v.key_size or 0,
             key_shared = v.key_shared or 0,
         }
-        pos = pos + v.size
     end
-    layout.total_size = pos
 
     lua_to_cpp.update_message_layout_id(message_name, layout)
     lua_to_cpp.create_layout_meta_func(message_name, layout)
-    core_cpp_table_update_layout(message_name, layout.members)
+    core_cpp_table_update_layout(message_name, layout.members, layout.total_size)
 
     _G.CPP_TABLE_LAYOUT[message_name] = layout
 end
 
 ---merge layout members by tag
-function lua_to_cpp.merge_layout(message_name, message, delete_members, new_members)
+function lua_to_cpp.merge_layout(message_name, message, delete_members, new_members, hints)
     local layout = _G.CPP_TABLE_LAYOUT[message_name]
     if not layout then
         error("merge layout error, message " .. message_name .. " not exist")
     end
 
+    -- old tag keep its pos and flag, eg: "int32 a = 1;" ==> "uint32 d = 1;"
+    -- new tag only use the bytes never used before
+    local plan, total_size = core_cpp_table_plan_layout(message_name, message, hints)
     for _, k in ipairs(new_members) do
         local v = message[k]
-        local tag = v.tag
-
-        local old_layout_k
-        local old_layout_v
-        for ok, ov in pairs(layout.members) do
-            if ov.tag == tag then
-                old_layout_k = ok
-                old_layout_v = ov
-                break
-            end
-        end
-
-        if old_layout_v then
-            -- eg: "int32 a = 1;" ==> "uint32 d = 1;"
-            layout.members[k] = {
-                type = v.type,
-                key = v.key,
-                value = v.value or "",
-                pos = old_layout_v.pos,
-                size = v.size,
-                tag = v.tag,
-                shared = v.shared,
-                key_size = v.key_size or 0,
-                key_shared = v.key_shared or 0,
-            }
-        else
-            layout.members[k] = {
-                type = v.type,
-                key = v.key,
-                value = v.value or "",
-                pos = layout.total_size,
-                size = v.size,
-                tag = v.tag,
-                shared = v.shared,
-                key_size = v.key_size or 0,
-                key_shared = v.key_shared or 0,
-            }
-            layout.total_size = layout.total_size + v.size
-        end
+        layout.members[k] = {
+            type = v.type,
+            key = v.key,
+            value = v.value or "",
+            pos = plan[k].pos,
+            flag = plan[k].flag,
+            size = v.size,
+            tag = v.tag,
+            shared = v.shared,
+            key_size = v.key_size or 0,
+            key_shared = v.key_shared or 0,
+        }
     end
+    layout.total_size = total_size
 
     for _, k in ipairs(delete_members) do
         layout.members[k] = nil
@@ -557,7 +570,7 @@ function lua_to_cpp.merge_layout(message_name, message, delete_members, new_memb
 
     lua_to_cpp.update_message_layout_id(message_name, layout)
     lua_to_cpp.create_layout_meta_func(message_name, layout)
-    core_cpp_table_update_layout(message_name, layout.members)
+    core_cpp_table_update_layout(message_name, layout.members, layout.total_size)
 end
 
 ---merge proto members by tag
@@ -599,15 +612,15 @@ function lua_to_cpp.merge_proto(old_proto, new_proto)
     return delete_members, new_members
 end
 
-function lua_to_cpp.load_proto(message_name, message)
+function lua_to_cpp.load_proto(message_name, message, hints)
     _G.OLD_CPP_TABLE_PROTO = _G.OLD_CPP_TABLE_PROTO or {}
     local old_proto = _G.OLD_CPP_TABLE_PROTO[message_name]
     if old_proto then
         local delete_members, new_members = lua_to_cpp.merge_proto(old_proto, message)
-        lua_to_cpp.merge_layout(message_name, old_proto, delete_members, new_members)
+        lua_to_cpp.merge_layout(message_name, old_proto, delete_members, new_members, hints)
     else
         _G.OLD_CPP_TABLE_PROTO[message_name] = message
-        lua_to_cpp.create_layout(message_name, message)
+        lua_to_cpp.create_layout(message_name, message, hints)
     end
 end
 
@@ -680,7 +693,13 @@ function lua_to_cpp.alloc_message_id(protos)
         }
         _G.cpp_table_message_global_id = 8
     end
-    for message_name, message in pairs(protos) do
+    -- sort by name, so the same protos always get the same message id
+    local names = {}
+    for message_name, _ in pairs(protos) do
+        table.insert(names, message_name)
+    end
+    table.sort(names)
+    for _, message_name in ipairs(names) do
         if not _G.cpp_table_message_id[message_name] then
             _G.cpp_table_message_global_id = _G.cpp_table_message_global_id + 1
             _G.cpp_table_message_id[message_name] = _G.cpp_table_message_global_id
@@ -691,11 +710,12 @@ end
 
 ---load cpp table proto, if old message exist, will merge the old message
 ---@param protos table contains the proto message
-function _G.cpp_table_load_proto(protos)
+---@param hints table optional hot member names of message, hotter first, eg: { Player = { "name", "score" } }
+function _G.cpp_table_load_proto(protos, hints)
     lua_to_cpp.alloc_message_id(protos)
     _G.cpp_table_proto = _G.cpp_table_proto or {}
     for message_name, message in pairs(protos) do
-        lua_to_cpp.load_proto(message_name, message)
+        lua_to_cpp.load_proto(message_name, message, hints and hints[message_name])
         lua_to_cpp.create_metatable(message_name)
     end
 end
@@ -722,9 +742,57 @@ function _G.cpp_table_sink(name, table)
     return container
 end
 
--- print all the string in cpp table heap
-function _G.cpp_table_dump_statistic()
-    return core_cpp_table_dump_statistic()
+-- dump cpp table statistic, object count, memory, field access
+---@param dump_string boolean also return every string in heap, costs as much memory as the heap
+function _G.cpp_table_dump_statistic(dump_string)
+    return core_cpp_table_dump_statistic(dump_string)
+end
+
+---memory of one cpp table and everything it references, shared objects are counted once
+---@param obj userdata the cpp table, array or map
+---@return number bytes
+---@return number object count
+function _G.cpp_table_deep_size(obj)
+    return core_cpp_table_deep_size(obj)
+end
+
+---start or stop counting field read/write of all layouts, result is in cpp_table_dump_statistic().field_stat
+---@param enable boolean
+---@param reset boolean clear old counters
+---@return boolean false if counters not compiled in
+function _G.cpp_table_set_field_stat(enable, reset)
+    return core_cpp_table_set_field_stat(enable, reset)
+end
+
+---look up many keys of a cpp table map in one call, cheaper than indexing the map key by key
+---@param map userdata the cpp table map
+---@param keys table array of keys, a key of the wrong type gives nil
+---@param out table|nil optional table to reuse, out[i] is set to the value of keys[i] or nil, later entries are cleared
+---@return table out or a new table
+function _G.cpp_table_map_get_many(map, keys, out)
+    return core_cpp_table_map_container_get_many(map, keys, out)
+end
+
+---choose the hash map of cpp table maps created from now on, existing maps keep theirs
+---"coalesced" is compact and has an array part for dense integer keys, "swiss" probes 16 slots at once
+---@param backend string "coalesced" or "swiss", or "default" to make a field follow the global setting again
+---@param layout_name string|nil message name, nil to set the global backend
+---@param field_name string|nil map field of the message
+function _G.cpp_table_set_map_backend(backend, layout_name, field_name)
+    core_cpp_table_set_map_backend(backend, layout_name, field_name)
+end
+
+---shrink a cpp table map after most of its entries are removed, maps also shrink by themselves when very sparse
+---@param map userdata the cpp table map
+---@return number bytes released
+function _G.cpp_table_map_compact(map)
+    return core_cpp_table_map_container_compact(map)
+end
+
+---shrink the global string set, e.g. after reloading config
+---@return number bytes released
+function _G.cpp_table_string_heap_compact()
+    return core_cpp_table_string_heap_compact()
 end
 
 --------------------------cpp-table end-------------------------------------
@@ -1300,10 +1368,38 @@ function _G.quick_archiver_load(bin)
     return core_quick_archiver_load(bin)
 end
 
+---save t to the file at path chunk by chunk, lz compressed when the lz threshold is not 0.
+---it is written to a temp file next to path first, a failed save leaves the old file
+---@return number|nil bytes written, nil if failed
+function _G.quick_archiver_save_file(path, t)
+    return core_quick_archiver_save_file(path, t)
+end
+
+function _G.quick_archiver_load_file(path)
+    return core_quick_archiver_load_file(path)
+end
+
+---like quick_archiver_save_file, but only t is encoded here, compression and the file write run on a worker thread.
+---t may be changed as soon as this returns. the handle has done() to poll and wait() to block,
+---wait() returns bytes written and a fnv-1a 64 checksum of the data after the header, nil if failed.
+---the bytes are added to save_bytes of the stat by the first wait()
+---@return userdata|nil handle, nil if failed
+function _G.quick_archiver_save_async(path, t)
+    return core_quick_archiver_save_async(path, t)
+end
+
+---like quick_archiver_load, but tables saved indexed come back as userdata views, decoded when first read.
+---views support t[k], #t, pairs and ipairs, writes go to the decoded copy. they keep bin alive
+---@return any value, nil if failed
+function _G.quick_archiver_open(bin)
+    return core_quick_archiver_open(bin)
+end
+
 function _G.quick_archiver_set_lz_threshold(sz)
     return core_quick_archiver_set_lz_threshold(sz)
 end
 
+---buffers grow as needed, ones bigger than sz are freed after each save or load, default 1MB
 function _G.quick_archiver_set_max_buffer_size(sz)
     return core_quick_archiver_set_max_buffer_size(sz)
 end
@@ -1312,4 +1408,87 @@ function _G.quick_archiver_set_lz_acceleration(sz)
     return core_quick_archiver_set_lz_acceleration(sz)
 end
 
+---0 is the fast lz4, 1 to 12 search harder for a smaller save, loads are as fast. default 0
+---@param level number
+function _G.quick_archiver_set_lz_level(level)
+    return core_quick_archiver_set_lz_level(level)
+end
+
+---equal strings of at least sz bytes are saved once even when they are different lua strings, 0 turns it off, default 41
+---shorter ones are only saved once when they are the same lua string, which strings up to 40 bytes always are
+function _G.quick_archiver_set_string_dedup_min_length(sz)
+    return core_quick_archiver_set_string_dedup_min_length(sz)
+end
+
+---register common strings such as field names, saves refer to them by index instead of inlining them.
+---saves record the id, loading one needs the same id set, so bump it whenever the strings change
+---@param id number|nil dictionary version, nil or 0 removes the dictionary
+---@param strings table|nil array of strings
+function _G.quick_archiver_set_dict(id, strings)
+    return core_quick_archiver_set_dict(id, strings)
+end
+
+---preset lz dictionary, small blobs compress much better when they look like it. at most the last 64KB are used.
+---lz data made with it records the id, loading it needs the same id set
+---@param id number|nil dictionary version, nil or 0 removes the dictionary
+---@param dict string|nil dictionary bytes, e.g. from quick_archiver_make_lz_dict
+function _G.quick_archiver_set_lz_dict(id, dict)
+    return core_quick_archiver_set_lz_dict(id, dict)
+end
+
+---build a lz dictionary from typical values, the most typical last
+---@param samples table array of sample values
+---@param max_size number|nil dictionary size limit, default and max 64KB
+---@return string
+function _G.quick_archiver_make_lz_dict(samples, max_size)
+    return core_quick_archiver_make_lz_dict(samples, max_size)
+end
+
+---when on, a table reached again is saved as a reference, so shared tables stay shared after load and cycles work
+---@param track_refs boolean default false
+function _G.quick_archiver_set_track_refs(track_refs)
+    return core_quick_archiver_set_track_refs(track_refs)
+end
+
+---when on, a table with the same content as an earlier one is saved as a copy of it. not used by save_file
+---@param table_dedup boolean default false
+function _G.quick_archiver_set_table_dedup(table_dedup)
+    return core_quick_archiver_set_table_dedup(table_dedup)
+end
+
+---when on, copies load as the table they copy, much smaller but only for data that is not changed after load.
+---when off they load as new tables
+---@param share boolean default false
+function _G.quick_archiver_set_share_dedup_tables(share)
+    return core_quick_archiver_set_share_dedup_tables(share)
+end
+
+---when on, tables of 32 or more entries record their size and arrays the offsets of their elements,
+---so quick_archiver_open can read a few fields of a big save. the save is bigger, track_refs and table_dedup are off.
+---not used by save_file
+---@param indexed boolean default false
+function _G.quick_archiver_set_indexed(indexed)
+    return core_quick_archiver_set_indexed(indexed)
+end
+
+---memory and save/load counters of the global archiver
+---@return table { memory, peak_buffer_size, save_count, save_bytes, load_count, load_bytes, dedup_bytes,
+---table_dedup_bytes }
+function _G.quick_archiver_stat()
+    return core_quick_archiver_stat()
+end
+
+_G.quick_archiver = _G.quick_archiver or {}
+
+---an archiver with its own buffers, settings and stat, e.g. one per subsystem or per lua state
+---it has the methods save, load, save_file, load_file, save_async, open, set_lz_threshold, set_lz_acceleration,
+---set_lz_level, set_max_buffer_size, set_string_dedup_min_length, set_dict, set_lz_dict, make_lz_dict, set_track_refs,
+---set_table_dedup, set_share_dedup_tables, set_indexed, stat
+---@param settings table|nil { lz_threshold = , lz_acceleration = , lz_level = , max_buffer_size = ,
+---string_dedup_min_length = , track_refs = , table_dedup = , share_dedup_tables = , indexed = }
+---@return userdata
+function _G.quick_archiver.new(settings)
+    return core_quick_archiver_new(settings)
+end
+
 --------------------------quick-archiver end-------------------------------------
@@ -1,9 +1,16 @@
 #include "quick_archiver.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace quick_archiver {
 
 static QuickArchiver *gQuickArchiver;
 
+static void PushSaveJob(lua_State *L, SaveJob *job);
+
+static void PushView(lua_State *L, int source, size_t pos, size_t offset_pos, uint64_t count,
+                     QuickArchiver::Type type);
+
 static void CheckQuickArchiver() {
     if (!gQuickArchiver) {
         gQuickArchiver = new QuickArchiver();
@@ -11,215 +18,1210 @@ static void CheckQuickArchiver() {
 }
 
 QuickArchiver::QuickArchiver() {
-    m_buffer_size = 16 * 1024 * 1024;
-    SetMaxBufferSize(m_buffer_size);
 }
 
 QuickArchiver::~QuickArchiver() {
-    if (m_buffer) {
-        delete[] m_buffer;
+    free(m_buffer);
+    free(m_lz_buffer);
+    if (m_lz_stream) {
+        LZ4_freeStream(m_lz_stream);
+    }
+    if (m_lz_dict_stream) {
+        LZ4_freeStream(m_lz_dict_stream);
+    }
+    if (m_lz_hc_stream) {
+        LZ4_freeStreamHC(m_lz_hc_stream);
+    }
+}
+
+// grow to hold at least size bytes, doubling so appends stay amortized O(1)
+// v2 values start with a type byte, its high 4 bits hold a small length, count, string index or zigzag integer,
+// 15 there means a LEB128 varint of the rest follows. sequences 1..n are written as values only
+static const uint64_t HEAD_INLINE_MAX = 15;
+
+static const size_t HEAD_SIZE_MAX = sizeof(char) + 10;
+// smaller tables are not worth an entry in the table dedup
+static const size_t TABLE_DEDUP_MIN_SIZE = 4;
+
+static bool GrowBuffer(char *&buffer, size_t &buffer_size, size_t size) {
+    if (size <= buffer_size) {
+        return true;
+    }
+    size_t new_size = QuickArchiver::INIT_BUFFER_SIZE;
+    if (buffer_size > new_size) {
+        new_size = buffer_size;
+    }
+    while (new_size < size) {
+        new_size *= 2;
+    }
+    auto new_buffer = (char *) realloc(buffer, new_size);
+    if (!new_buffer) {
+        return false;
+    }
+    buffer = new_buffer;
+    buffer_size = new_size;
+    return true;
+}
+
+bool QuickArchiver::Reserve(size_t size) {
+    return GrowBuffer(m_buffer, m_buffer_size, size);
+}
+
+// room for size more bytes at m_pos, when saving to a file full chunks are written out first
+bool QuickArchiver::Ensure(size_t size) {
+    if (m_writer && m_pos >= (size_t) LZ_CHUNK_SIZE && !Flush(false)) {
+        return false;
+    }
+    return Reserve(m_pos + size);
+}
+
+bool QuickArchiver::ResetLzStream() {
+    if (!m_lz_stream) {
+        m_lz_stream = LZ4_createStream();
+        if (!m_lz_stream) {
+            LERR("ResetLzStream: create lz stream failed");
+            return false;
+        }
+    } else {
+        LZ4_resetStream_fast(m_lz_stream);
+    }
+    return true;
+}
+
+bool QuickArchiver::ResetLzHcStream() {
+    if (!m_lz_hc_stream) {
+        m_lz_hc_stream = LZ4_createStreamHC();
+        if (!m_lz_hc_stream) {
+            LERR("ResetLzHcStream: create lz hc stream failed");
+            return false;
+        }
+    }
+    LZ4_resetStreamHC_fast(m_lz_hc_stream, m_lz_level);
+    return true;
+}
+
+// 8 bytes at a time, the strings are long
+size_t QuickArchiver::StringKeyHash::operator()(const StringKey &key) const {
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ key.size;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= key.size; i += sizeof(uint64_t)) {
+        uint64_t k = 0;
+        memcpy(&k, key.str + i, sizeof(uint64_t));
+        h = (h ^ k) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    for (; i < key.size; i++) {
+        h = (h ^ (uint8_t) key.str[i]) * 0x100000001B3ull;
+    }
+    return (size_t) (h ^ (h >> 29));
+}
+
+size_t QuickArchiver::MemorySize() const {
+    size_t dict_size = 0;
+    for (auto &str : m_dict_string) {
+        dict_size += sizeof(str) + str.capacity();
+    }
+    dict_size += m_lz_dict.capacity() + (m_lz_dict_stream ? sizeof(LZ4_stream_t) : 0);
+    return sizeof(*this) + m_buffer_size + m_lz_buffer_size + (m_lz_stream ? sizeof(LZ4_stream_t) : 0) + dict_size +
+           (m_lz_hc_stream ? sizeof(LZ4_streamHC_t) : 0);
+}
+
+// give back the memory of a big save or load, so an idle archiver stays small
+void QuickArchiver::ShrinkBuffer() {
+    if (m_buffer_size + m_lz_buffer_size > m_stat.peak_buffer_size) {
+        m_stat.peak_buffer_size = m_buffer_size + m_lz_buffer_size;
+    }
+    if (m_buffer_size > m_max_buffer_size) {
+        free(m_buffer);
         m_buffer = 0;
+        m_buffer_size = 0;
     }
-    if (m_lz_buffer) {
-        delete[] m_lz_buffer;
+    if (m_lz_buffer_size > m_max_buffer_size) {
+        free(m_lz_buffer);
         m_lz_buffer = 0;
+        m_lz_buffer_size = 0;
     }
 }
 
-void QuickArchiver::SetMaxBufferSize(size_t size) {
-    if (m_buffer) {
-        delete[] m_buffer;
+void QuickArchiver::ResetSave() {
+    m_saved_string.clear();
+    m_saved_long_string.clear();
+    m_saved_table.clear();
+    m_saved_ref_count = 0;
+    m_table_count = 0;
+    m_table_hash.clear();
+    m_table_entry.clear();
+    m_table_key.clear();
+    m_table_child.clear();
+    m_index_offset.clear();
+    m_pos = 0;
+    m_table_depth = 0;
+}
+
+// a save with a dictionary starts with a dict value holding its id, then a table_refs value if tables are numbered
+bool QuickArchiver::SaveHeader() {
+    if (!Ensure(HEAD_SIZE_MAX * 2)) {
+        LERR("SaveHeader: out of memory");
+        return false;
+    }
+    m_data_start = m_pos;
+    if (m_dict_id) {
+        SaveHead(Type::dict, m_dict_id);
     }
-    if (m_lz_buffer) {
-        delete[] m_lz_buffer;
+    if ((m_track_refs || m_table_dedup) && !Indexed()) {
+        SaveHead(Type::table_refs, 0);
     }
-    m_buffer_size = size;
-    m_buffer = new char[m_buffer_size];
-    m_lz_buffer_size = 1 + LZ4_compressBound(size - 1);
-    m_lz_buffer = new char[m_lz_buffer_size];
+    return true;
 }
 
 int QuickArchiver::Save(lua_State *L) {
-    m_saved_string.clear();
-    m_pos = 0;
-    m_buffer[m_pos] = 'N';
+    ResetSave();
+    if (!Reserve(sizeof(char))) {
+        LERR("Save: out of memory");
+        return 0;
+    }
+    m_buffer[m_pos] = 'n';
     m_pos += sizeof(char);
-    m_table_depth = 0;
-    int64_t int_value = 0;
-    if (!SaveValue(L, 1, int_value)) {
+    if (!SaveHeader() || !SaveValue(L, 1)) {
+        ShrinkBuffer();
         return 0;
     }
-    if (m_lz_threshold > 0 && m_pos > m_lz_threshold) {
-        // lz compress
-        int lz_size = LZ4_compress_fast(m_buffer + 1, m_lz_buffer + 1, m_pos - 1, m_lz_buffer_size - 1,
-                                        m_lz_acceleration);
-        if (lz_size > 0 && lz_size < (int) m_pos - 1) {
-            m_lz_buffer[0] = 'Z';
-            lua_pushlstring(L, m_lz_buffer, lz_size + 1);
-        } else {
-            LERR("Save: lz compress failed");
-            lua_pushlstring(L, m_buffer, m_pos);
-        }
+    size_t lz_size = 0;
+    if (m_lz_threshold > 0 && m_pos > m_lz_threshold && Compress(lz_size) && lz_size < m_pos) {
+        lua_pushlstring(L, m_lz_buffer, lz_size);
     } else {
         lua_pushlstring(L, m_buffer, m_pos);
+        lz_size = m_pos;
     }
+    m_stat.save_count++;
+    m_stat.save_bytes += lz_size;
+    ShrinkBuffer();
     return 1;
 }
 
+// 'c' [raw size, 8 bytes] [chunk size, 4 bytes], with a preset dictionary 'd' and the dictionary id, 8 bytes.
+// with a level it is 'h' [raw size] [chunk size] [level, 1 byte], the high bit of the level is set when the
+// dictionary id follows
+static const uint8_t LZ_LEVEL_DICT_BIT = 0x80;
+
+static size_t EncodeLzHeader(char *out, uint64_t raw_size, int level, uint64_t dict_id) {
+    uint32_t chunk_size = QuickArchiver::LZ_CHUNK_SIZE;
+    out[0] = level ? 'h' : (dict_id ? 'd' : 'c');
+    size_t pos = sizeof(char);
+    memcpy(&out[pos], &raw_size, sizeof(raw_size));
+    pos += sizeof(raw_size);
+    memcpy(&out[pos], &chunk_size, sizeof(chunk_size));
+    pos += sizeof(chunk_size);
+    if (level) {
+        out[pos] = (char) (level | (dict_id ? LZ_LEVEL_DICT_BIT : 0));
+        pos += sizeof(uint8_t);
+    }
+    if (dict_id) {
+        memcpy(&out[pos], &dict_id, sizeof(dict_id));
+        pos += sizeof(dict_id);
+    }
+    return pos;
+}
+
+// lz compress the saved data chunk by chunk, chunks are linked so the ratio is the same as one big block.
+// the header is as in EncodeLzHeader, then every chunk is [lz size, 4 bytes] [lz data]
+bool QuickArchiver::Compress(size_t &lz_size) {
+    if (m_lz_level) {
+        if (!ResetLzHcStream()) {
+            return false;
+        }
+        if (m_lz_dict_id) {
+            LZ4_loadDictHC(m_lz_hc_stream, m_lz_dict.data(), (int) m_lz_dict.size());
+        }
+    } else {
+        if (!ResetLzStream()) {
+            return false;
+        }
+        if (m_lz_dict_id) {
+            LZ4_attach_dictionary(m_lz_stream, m_lz_dict_stream);
+        }
+    }
+
+    uint64_t raw_size = m_pos - 1;
+    uint32_t chunk_size = LZ_CHUNK_SIZE;
+    if (!GrowBuffer(m_lz_buffer, m_lz_buffer_size, LZ_HEADER_MAX_SIZE)) {
+        LERR("Compress: out of memory");
+        return false;
+    }
+    size_t lz_pos = EncodeLzHeader(m_lz_buffer, raw_size, m_lz_level, m_lz_dict_id);
+
+    for (size_t offset = 0; offset < raw_size; offset += chunk_size) {
+        int size = (int) (raw_size - offset < chunk_size ? raw_size - offset : chunk_size);
+        int bound = LZ4_compressBound(size);
+        if (!GrowBuffer(m_lz_buffer, m_lz_buffer_size, lz_pos + sizeof(uint32_t) + bound)) {
+            LERR("Compress: out of memory");
+            return false;
+        }
+        int size_after = m_lz_level ?
+                         LZ4_compress_HC_continue(m_lz_hc_stream, &m_buffer[sizeof(char) + offset],
+                                                  &m_lz_buffer[lz_pos + sizeof(uint32_t)], size, bound) :
+                         LZ4_compress_fast_continue(m_lz_stream, &m_buffer[sizeof(char) + offset],
+                                                    &m_lz_buffer[lz_pos + sizeof(uint32_t)], size, bound,
+                                                    m_lz_acceleration);
+        if (size_after <= 0) {
+            LERR("Compress: lz compress failed");
+            return false;
+        }
+        uint32_t chunk_lz_size = size_after;
+        memcpy(&m_lz_buffer[lz_pos], &chunk_lz_size, sizeof(chunk_lz_size));
+        lz_pos += sizeof(uint32_t) + size_after;
+        if (lz_pos >= m_pos) {
+            // not worth it, keep the raw data
+            break;
+        }
+    }
+    lz_size = lz_pos;
+    return true;
+}
+
+bool QuickArchiver::Decompress(const char *data, size_t size, size_t &raw_size, char type) {
+    uint64_t total = 0;
+    uint32_t chunk_size = 0;
+    uint64_t dict_id = 0;
+    // the level only matters to the compressor
+    size_t pos = sizeof(total) + sizeof(chunk_size);
+    bool with_dict = type == 'd';
+    if (type == 'h') {
+        if (size < pos + sizeof(uint8_t)) {
+            LERR("Decompress: invalid header");
+            return false;
+        }
+        with_dict = (uint8_t) data[pos] & LZ_LEVEL_DICT_BIT;
+        pos += sizeof(uint8_t);
+    }
+    size_t dict_pos = pos;
+    pos += with_dict ? sizeof(dict_id) : 0;
+    if (size < pos) {
+        LERR("Decompress: invalid header");
+        return false;
+    }
+    memcpy(&total, data, sizeof(total));
+    memcpy(&chunk_size, data + sizeof(total), sizeof(chunk_size));
+    if (with_dict) {
+        memcpy(&dict_id, data + dict_pos, sizeof(dict_id));
+        if (dict_id != m_lz_dict_id) {
+            LERR("Decompress: lz dict %llu needed, lz dict %llu is set", (unsigned long long) dict_id,
+                 (unsigned long long) m_lz_dict_id);
+            return false;
+        }
+    }
+    if (!chunk_size || chunk_size > (uint32_t) LZ4_MAX_INPUT_SIZE) {
+        LERR("Decompress: invalid chunk size %u", chunk_size);
+        return false;
+    }
+    // lz4 expands at most 255 times
+    if (total > (uint64_t) size * 255) {
+        LERR("Decompress: invalid raw size %llu", (unsigned long long) total);
+        return false;
+    }
+    if (!Reserve(total)) {
+        LERR("Decompress: out of memory, size %llu", (unsigned long long) total);
+        return false;
+    }
+
+    LZ4_streamDecode_t decode;
+    if (with_dict) {
+        LZ4_setStreamDecode(&decode, m_lz_dict.data(), (int) m_lz_dict.size());
+    } else {
+        LZ4_setStreamDecode(&decode, 0, 0);
+    }
+    uint64_t out = 0;
+    while (out < total) {
+        uint32_t lz_size = 0;
+        if (pos + sizeof(lz_size) > size) {
+            LERR("Decompress: truncated data");
+            return false;
+        }
+        memcpy(&lz_size, data + pos, sizeof(lz_size));
+        pos += sizeof(lz_size);
+        if (lz_size > size - pos) {
+            LERR("Decompress: truncated data");
+            return false;
+        }
+        int chunk = (int) (total - out < chunk_size ? total - out : chunk_size);
+        if (LZ4_decompress_safe_continue(&decode, data + pos, m_buffer + out, lz_size, chunk) != chunk) {
+            LERR("Decompress: lz decompress failed");
+            return false;
+        }
+        pos += lz_size;
+        out += chunk;
+    }
+    if (pos != size) {
+        LERR("Decompress: %llu bytes of trailing data", (unsigned long long) (size - pos));
+        return false;
+    }
+    raw_size = total;
+    return true;
+}
+
+// one lz block of unknown raw size, written by older versions
+bool QuickArchiver::DecompressLegacy(const char *data, size_t size, size_t &raw_size) {
+    if (!Reserve(size * 4)) {
+        LERR("DecompressLegacy: out of memory");
+        return false;
+    }
+    while (true) {
+        int capacity = m_buffer_size < (size_t) INT32_MAX ? (int) m_buffer_size : INT32_MAX;
+        int lz_size = LZ4_decompress_safe(data, m_buffer, size, capacity);
+        if (lz_size > 0) {
+            raw_size = lz_size;
+            return true;
+        }
+        // lz4 expands at most 255 times, past that the data is bad
+        if (m_buffer_size > size * 255 + 16 || capacity == INT32_MAX || !Reserve(m_buffer_size * 2)) {
+            LERR("DecompressLegacy: lz decompress failed");
+            return false;
+        }
+    }
+}
+
 int QuickArchiver::Load(lua_State *L) {
     size_t size = 0;
     const char *data = lua_tolstring(L, 1, &size);
+    return LoadData(L, data, size) ? 1 : 0;
+}
+
+bool QuickArchiver::LoadData(lua_State *L, const char *data, size_t size) {
     if (size == 0) {
         LERR("Load: empty data");
-        return 0;
+        return false;
     }
-    bool lz = false;
-    if (data[0] == 'Z') {
-        lz = true;
-    } else if (data[0] != 'N') {
+    // lower case tags are the v2 encoding, upper case ones v1, written by older versions
+    char type = data[0];
+    bool v1 = type == 'N' || type == 'C' || type == 'Z';
+    if (!v1 && type != 'n' && type != 'c' && type != 'd' && type != 'h') {
         LERR("Load: unknown data type %c", data[0]);
-        return 0;
+        return false;
     }
 
+    m_stat.load_count++;
+    m_stat.load_bytes += size;
     data++;
     size--;
 
-    if (lz) {
-        int lz_size = LZ4_decompress_safe(data, m_buffer, size, m_buffer_size);
-        if (lz_size <= 0) {
-            LERR("Load: lz decompress failed");
-            return 0;
-        }
-        size = lz_size;
-    } else {
-        memcpy(m_buffer, data, size);
+    bool ok = true;
+    if (type == 'c' || type == 'd' || type == 'h' || type == 'C') {
+        ok = Decompress(data, size, size, type);
+        data = m_buffer;
+    } else if (type == 'Z') {
+        ok = DecompressLegacy(data, size, size);
+        data = m_buffer;
     }
 
+    // not compressed data is decoded where it is
+    ok = ok && LoadPayload(L, data, size, v1, 0);
+    ShrinkBuffer();
+    return ok;
+}
+
+void QuickArchiver::ResetLoad(const char *data, size_t size, int view_stack) {
+    m_data = data;
+    m_data_size = size;
+    m_view_stack = view_stack;
     m_loaded_string.clear();
     m_pos = 0;
-    if (!LoadValue(L, true)) {
-        return 0;
+    m_table_depth = 0;
+    m_dict_stack = 0;
+    m_dict_count = 0;
+    m_ref_stack = 0;
+    m_ref_count = 0;
+    m_rebuild_depth = 0;
+    m_loaded_table_pos.clear();
+}
+
+// decodes the header and the value, with a view_stack indexed tables are pushed as views
+bool QuickArchiver::LoadPayload(lua_State *L, const char *data, size_t size, bool v1, int view_stack) {
+    ResetLoad(data, size, view_stack);
+    bool ok = v1 || LoadHeader(L);
+    if (ok && m_view_stack && m_dict_stack) {
+        lua_pushvalue(L, m_dict_stack);
+        lua_rawseti(L, m_view_stack, 2);
+    }
+    ok = ok && (v1 ? LoadValueV1(L, true) : LoadValue(L, true));
+    if (ok && m_pos != m_data_size) {
+        LERR("Load: %llu bytes of trailing data", (unsigned long long) (m_data_size - m_pos));
+        lua_pop(L, 1);
+        ok = false;
+    }
+    // the ref table is pushed after the dict one
+    if (ok && m_ref_stack) {
+        lua_remove(L, m_ref_stack);
+    }
+    if (ok && m_dict_stack) {
+        lua_remove(L, m_dict_stack);
+    }
+    m_dict_stack = 0;
+    m_ref_stack = 0;
+    m_data = 0;
+    m_data_size = 0;
+    return ok;
+}
+
+// the data is kept in a string the views hold, the save itself for 'n', or decompressed once for lz data.
+// v1 saves have no index and are loaded whole
+int QuickArchiver::Open(lua_State *L) {
+    size_t size = 0;
+    const char *data = lua_tolstring(L, 1, &size);
+    if (!data || size == 0 || (data[0] != 'n' && data[0] != 'c' && data[0] != 'd' && data[0] != 'h')) {
+        return Load(L);
     }
+    m_stat.load_count++;
+    m_stat.load_bytes += size;
+    lua_settop(L, 2);
 
-    return 1;
+    size_t skip = sizeof(char);
+    if (data[0] != 'n') {
+        bool ok = Decompress(data + sizeof(char), size - sizeof(char), size, data[0]);
+        if (ok) {
+            lua_pushlstring(L, m_buffer, size);
+            lua_replace(L, 1);
+        }
+        ShrinkBuffer();
+        if (!ok) {
+            return 0;
+        }
+        data = lua_tostring(L, 1);
+        skip = 0;
+    }
+
+    lua_createtable(L, 4, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_pushinteger(L, skip);
+    lua_rawseti(L, -2, 3);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, 4);
+    bool ok = LoadPayload(L, data + skip, size - skip, false, lua_gettop(L));
+    m_view_stack = 0;
+    return ok ? 1 : 0;
 }
 
-#define FIND_INT_LEN(v) ((int64_t)v >= INT8_MIN && (int64_t)v <= INT8_MAX) ? sizeof(int8_t) : \
-                      ((int64_t)v >= INT16_MIN && (int64_t)v <= INT16_MAX) ? sizeof(int16_t) : \
-                      ((int64_t)v >= INT32_MIN && (int64_t)v <= INT32_MAX) ? sizeof(int32_t) : sizeof(int64_t)
+// the source keeps the string, the dict is pushed for dict strings
+bool QuickArchiver::BeginView(lua_State *L, int source) {
+    if (!lua_checkstack(L, 4)) {
+        LERR("BeginView: lua_checkstack failed");
+        return false;
+    }
+    lua_rawgeti(L, source, 1);
+    lua_rawgeti(L, source, 3);
+    size_t size = 0;
+    const char *data = lua_tolstring(L, -2, &size);
+    size_t skip = (size_t) lua_tointeger(L, -1);
+    lua_pop(L, 2);
+    ResetLoad(data + skip, size - skip, source);
+    if (lua_rawgeti(L, source, 2) == LUA_TTABLE) {
+        m_dict_stack = lua_gettop(L);
+        m_dict_count = lua_rawlen(L, -1);
+    } else {
+        lua_pop(L, 1);
+    }
+    return true;
+}
 
-#define LOAD_INT(v, len) { \
-    switch (len) {         \
-          case sizeof(int8_t): { \
-                int8_t v8 = 0; \
-                memcpy(&v8, &m_buffer[m_pos], sizeof(int8_t)); \
-                v = v8; \
-                m_pos += sizeof(int8_t); \
-                break; \
-          } \
-          case sizeof(int16_t): { \
-                int16_t v16 = 0; \
-                memcpy(&v16, &m_buffer[m_pos], sizeof(int16_t)); \
-                v = v16; \
-                m_pos += sizeof(int16_t); \
-                break; \
-          } \
-          case sizeof(int32_t): { \
-                int32_t v32 = 0; \
-                memcpy(&v32, &m_buffer[m_pos], sizeof(int32_t)); \
-                v = v32; \
-                m_pos += sizeof(int32_t); \
-                break; \
-          } \
-          case sizeof(int64_t): {\
-                int64_t v64 = 0; \
-                memcpy(&v64, &m_buffer[m_pos], sizeof(int64_t)); \
-                v = v64; \
-                m_pos += sizeof(int64_t); \
-                break; \
-          } \
-          default: \
-                LERR("LoadInt: unknown len %d", len); \
-                return false; \
-     } \
+void QuickArchiver::EndView(lua_State *L, bool ok) {
+    if (ok && m_dict_stack) {
+        lua_remove(L, m_dict_stack);
+    }
+    m_dict_stack = 0;
+    m_view_stack = 0;
+    m_data = 0;
+    m_data_size = 0;
 }
 
-#define SAVE_INT(v, len) { \
-    switch (len) {         \
-          case sizeof(int8_t): { \
-                int8_t v8 = (int8_t) v; \
-                memcpy(&m_buffer[m_pos], &v8, sizeof(int8_t)); \
-                m_pos += sizeof(int8_t); \
-                break; \
-          } \
-          case sizeof(int16_t): { \
-                int16_t v16 = (int16_t) v; \
-                memcpy(&m_buffer[m_pos], &v16, sizeof(int16_t)); \
-                m_pos += sizeof(int16_t); \
-                break; \
-          } \
-          case sizeof(int32_t): { \
-                int32_t v32 = (int32_t) v; \
-                memcpy(&m_buffer[m_pos], &v32, sizeof(int32_t)); \
-                m_pos += sizeof(int32_t); \
-                break; \
-          } \
-          case sizeof(int64_t): {\
-                int64_t v64 = (int64_t) v; \
-                memcpy(&m_buffer[m_pos], &v64, sizeof(int64_t)); \
-                m_pos += sizeof(int64_t); \
-                break; \
-          } \
-          default: \
-                LERR("SaveInt: unknown len %d", len); \
-                return false; \
-     } \
+bool QuickArchiver::LoadViewValue(lua_State *L, int source, size_t pos) {
+    if (!BeginView(L, source)) {
+        return false;
+    }
+    m_pos = pos;
+    bool ok = LoadValue(L, true);
+    EndView(L, ok);
+    return ok;
 }
 
-bool QuickArchiver::LoadValue(lua_State *L, bool can_be_nil) {
-    if (!lua_checkstack(L, 1)) {
-        LERR("LoadValue: lua_checkstack failed");
+// the values are left for later, each key is set to a light userdata of where its value is
+bool QuickArchiver::LoadViewKeys(lua_State *L, int source, int keys, size_t pos, size_t offset_pos, uint64_t count) {
+    if (!BeginView(L, source)) {
         return false;
     }
+    bool ok = true;
+    for (uint64_t i = 0; i < count && ok; i++) {
+        uint32_t offset = 0;
+        memcpy(&offset, &m_data[offset_pos + i * sizeof(uint32_t)], sizeof(offset));
+        m_pos = pos + offset;
+        ok = LoadValue(L, false);
+        if (ok) {
+            lua_pushlightuserdata(L, (void *) m_pos);
+            lua_rawset(L, keys);
+        }
+    }
+    EndView(L, ok);
+    return ok;
+}
 
-    if (m_pos >= m_buffer_size) {
-        LERR("LoadValue: buffer overflow");
+int QuickArchiver::SaveFile(lua_State *L) {
+    const char *path = lua_tostring(L, 1);
+    if (!path) {
+        LERR("SaveFile: invalid path");
+        return 0;
+    }
+    FileWriter writer;
+    if (!writer.Open(path, m_lz_threshold > 0, m_lz_acceleration, m_lz_level, m_lz_dict, m_lz_dict_id)) {
+        return 0;
+    }
+
+    ResetSave();
+    m_writer = &writer;
+    bool ok = SaveHeader() && SaveValue(L, 2) && Flush(true);
+    m_writer = 0;
+    ok = writer.Close(ok);
+    ShrinkBuffer();
+    if (!ok) {
+        return 0;
+    }
+    m_stat.save_count++;
+    m_stat.save_bytes += writer.Written();
+    lua_pushinteger(L, writer.Written());
+    return 1;
+}
+
+// write full chunks, or everything when final, then move the rest to the front of the buffer
+bool QuickArchiver::Flush(bool final) {
+    size_t offset = 0;
+    while (m_pos - offset >= (size_t) LZ_CHUNK_SIZE || (final && offset < m_pos)) {
+        size_t size = m_pos - offset < (size_t) LZ_CHUNK_SIZE ? m_pos - offset : (size_t) LZ_CHUNK_SIZE;
+        if (!m_writer->Write(&m_buffer[offset], size)) {
+            return false;
+        }
+        offset += size;
+    }
+    if (!offset) {
+        return true;
+    }
+    if (!final && !m_writer->KeepDict()) {
         return false;
     }
+    memmove(m_buffer, &m_buffer[offset], m_pos - offset);
+    m_pos -= offset;
+    return true;
+}
 
-    char type = m_buffer[m_pos];
-    m_pos += sizeof(char);
+// only the traversal runs here, the encoded data is handed to a SaveJob
+int QuickArchiver::SaveAsync(lua_State *L) {
+    const char *path = lua_tostring(L, 1);
+    if (!path) {
+        LERR("SaveAsync: invalid path");
+        return 0;
+    }
+    SaveJob::FreeReleased();
+    ResetSave();
+    if (!SaveHeader() || !SaveValue(L, 2)) {
+        ShrinkBuffer();
+        return 0;
+    }
 
-    Type low_type = (Type) (type & 0x0F);
+    auto job = new SaveJob(this, path, m_buffer, m_pos, m_lz_threshold > 0, m_lz_acceleration, m_lz_level,
+                           m_lz_dict, m_lz_dict_id);
+    m_buffer = 0;
+    m_buffer_size = 0;
+    if (!job->Start()) {
+        delete job;
+        return 0;
+    }
+    m_stat.save_count++;
+    PushSaveJob(L, job);
+    return 1;
+}
 
-    switch (low_type) {
-        case Type::nil:
-            if (!can_be_nil) {
-                LERR("LoadValue: nil not allowed");
-                return false;
-            }
-            lua_pushnil(L);
-            return true;
-        case Type::number: {
-            if (m_pos + sizeof(double) > m_buffer_size) {
-                LERR("LoadValue: buffer overflow");
-                return false;
-            }
-            double v = 0;
-            memcpy(&v, &m_buffer[m_pos], sizeof(double));
-            m_pos += sizeof(double);
-            lua_pushnumber(L, v);
-            return true;
+int QuickArchiver::SetDict(lua_State *L) {
+    uint64_t id = lua_isnoneornil(L, 1) ? 0 : (uint64_t) luaL_checkinteger(L, 1);
+    if (id && !lua_istable(L, 2)) {
+        return luaL_error(L, "set_dict: strings must be an array of strings");
+    }
+    std::vector<std::string> strings;
+    size_t count = id ? lua_rawlen(L, 2) : 0;
+    for (size_t i = 1; i <= count; i++) {
+        lua_rawgeti(L, 2, i);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            return luaL_error(L, "set_dict: strings[%d] is not a string", (int) i);
         }
-        case Type::integer: {
-            int len = (type >> 4) & 0x0F;
-            if (m_pos + len > m_buffer_size) {
+        size_t size = 0;
+        const char *str = lua_tolstring(L, -1, &size);
+        strings.push_back(std::string(str, size));
+        lua_pop(L, 1);
+    }
+
+    m_dict_id = id;
+    m_dict_index.clear();
+    m_dict_max_length = 0;
+    m_dict_string.swap(strings);
+    for (size_t i = 0; i < m_dict_string.size(); i++) {
+        auto &str = m_dict_string[i];
+        m_dict_index.insert(std::make_pair(StringKey{str.data(), str.size()}, (int) i));
+        if (str.size() > m_dict_max_length) {
+            m_dict_max_length = str.size();
+        }
+    }
+    return 0;
+}
+
+int QuickArchiver::SetLzDict(lua_State *L) {
+    uint64_t id = lua_isnoneornil(L, 1) ? 0 : (uint64_t) luaL_checkinteger(L, 1);
+    size_t size = 0;
+    const char *dict = id ? luaL_checklstring(L, 2, &size) : "";
+    if (size > (size_t) LZ_DICT_MAX_SIZE) {
+        // only the end is used
+        dict += size - LZ_DICT_MAX_SIZE;
+        size = LZ_DICT_MAX_SIZE;
+    }
+    if (id && !m_lz_dict_stream) {
+        m_lz_dict_stream = LZ4_createStream();
+        if (!m_lz_dict_stream) {
+            return luaL_error(L, "set_lz_dict: create lz stream failed");
+        }
+    }
+    m_lz_dict_id = id;
+    m_lz_dict.assign(dict, size);
+    if (id) {
+        LZ4_loadDict(m_lz_dict_stream, m_lz_dict.data(), (int) m_lz_dict.size());
+    }
+    return 0;
+}
+
+int QuickArchiver::MakeLzDict(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    size_t max_size = lua_isnoneornil(L, 2) ? LZ_DICT_MAX_SIZE : (size_t) luaL_checkinteger(L, 2);
+    if (max_size > (size_t) LZ_DICT_MAX_SIZE) {
+        max_size = LZ_DICT_MAX_SIZE;
+    }
+    std::string dict;
+    size_t count = lua_rawlen(L, 1);
+    for (size_t i = 1; i <= count; i++) {
+        lua_rawgeti(L, 1, i);
+        ResetSave();
+        bool ok = SaveHeader() && SaveValue(L, lua_gettop(L));
+        lua_pop(L, 1);
+        if (!ok) {
+            ShrinkBuffer();
+            return 0;
+        }
+        dict.append(m_buffer, m_pos);
+        if (dict.size() > max_size * 2) {
+            dict.erase(0, dict.size() - max_size);
+        }
+    }
+    if (dict.size() > max_size) {
+        dict.erase(0, dict.size() - max_size);
+    }
+    ShrinkBuffer();
+    lua_pushlstring(L, dict.data(), dict.size());
+    return 1;
+}
+
+// strerror is not reentrant and FileWriter runs on SaveJob threads, strerror_r is the gnu or the posix one
+static inline const char *ErrorString(int ret, const char *buf) {
+    return ret ? "unknown error" : buf;
+}
+
+static inline const char *ErrorString(const char *ret, const char *buf) {
+    return ret;
+}
+
+#define FILE_WRITER_ERR(fmt, ...) { \
+    char err_buf[128] = {0}; \
+    LERR(fmt, __VA_ARGS__, ErrorString(strerror_r(errno, err_buf, sizeof(err_buf)), err_buf)); \
+}
+
+// tmp file names of all writers, the pid keeps processes saving the same path apart
+static std::atomic<uint32_t> gTmpFileSeq(0);
+
+FileWriter::~FileWriter() {
+    if (m_fd >= 0) {
+        Close(false);
+    }
+}
+
+bool FileWriter::Open(const char *path, bool lz, int acceleration, int level, const std::string &lz_dict,
+                      uint64_t lz_dict_id) {
+    m_path = path;
+    m_lz = lz;
+    m_acceleration = acceleration;
+    m_level = level;
+    // written next to path and renamed over it by Close, so a failed save keeps the old file.
+    // created 0666 so the umask applies as to any new file, a file it replaces gives its own mode
+    struct stat st;
+    bool replace = stat(path, &st) == 0;
+    for (int i = 0; i < 16 && m_fd < 0; i++) {
+        m_tmp_path = m_path + "." + std::to_string(getpid()) + "." + std::to_string(gTmpFileSeq++) + ".tmp";
+        m_fd = open(m_tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (m_fd < 0 && errno != EEXIST) {
+            break;
+        }
+    }
+    if (m_fd < 0) {
+        FILE_WRITER_ERR("FileWriter: open %s failed, %s", m_tmp_path.c_str());
+        return false;
+    }
+    if (replace && fchmod(m_fd, st.st_mode & 07777) != 0) {
+        FILE_WRITER_ERR("FileWriter: chmod %s failed, %s", m_tmp_path.c_str());
+        Close(false);
+        return false;
+    }
+    if (!m_lz) {
+        return WriteAll("n", sizeof(char));
+    }
+
+    if (m_level) {
+        m_hc_stream = LZ4_createStreamHC();
+    } else {
+        m_stream = LZ4_createStream();
+    }
+    m_lz_buffer = (char *) malloc(sizeof(uint32_t) + LZ4_compressBound(QuickArchiver::LZ_CHUNK_SIZE));
+    m_dict = (char *) malloc(QuickArchiver::LZ_CHUNK_SIZE);
+    if ((!m_stream && !m_hc_stream) || !m_lz_buffer || !m_dict) {
+        LERR("FileWriter: out of memory");
+        Close(false);
+        return false;
+    }
+    if (m_level) {
+        LZ4_resetStreamHC_fast(m_hc_stream, m_level);
+        if (lz_dict_id) {
+            LZ4_loadDictHC(m_hc_stream, lz_dict.data(), (int) lz_dict.size());
+        }
+    } else if (lz_dict_id) {
+        LZ4_loadDict(m_stream, lz_dict.data(), (int) lz_dict.size());
+    }
+    // the raw size is patched in by Close
+    char header[QuickArchiver::LZ_HEADER_MAX_SIZE];
+    return WriteAll(header, EncodeLzHeader(header, 0, m_level, lz_dict_id));
+}
+
+bool FileWriter::Write(const char *data, size_t size) {
+    m_raw_size += size;
+    if (!m_lz) {
+        return WriteAll(data, size);
+    }
+    int bound = LZ4_compressBound(size);
+    int size_after = m_level ?
+                     LZ4_compress_HC_continue(m_hc_stream, data, &m_lz_buffer[sizeof(uint32_t)], size, bound) :
+                     LZ4_compress_fast_continue(m_stream, data, &m_lz_buffer[sizeof(uint32_t)], size, bound,
+                                                m_acceleration);
+    if (size_after <= 0) {
+        LERR("FileWriter: lz compress failed");
+        return false;
+    }
+    uint32_t lz_size = size_after;
+    memcpy(m_lz_buffer, &lz_size, sizeof(lz_size));
+    return WriteAll(m_lz_buffer, sizeof(uint32_t) + size_after);
+}
+
+bool FileWriter::KeepDict() {
+    if (!m_lz) {
+        return true;
+    }
+    int saved = m_level ? LZ4_saveDictHC(m_hc_stream, m_dict, QuickArchiver::LZ_CHUNK_SIZE) :
+                LZ4_saveDict(m_stream, m_dict, QuickArchiver::LZ_CHUNK_SIZE);
+    if (saved < 0) {
+        LERR("FileWriter: lz save dict failed");
+        return false;
+    }
+    return true;
+}
+
+bool FileWriter::WriteAll(const char *data, size_t size) {
+    // the header is the first write, it is not part of the checksum
+    bool header = m_written == 0;
+    if (header) {
+        m_checksum = 14695981039346656037ull;
+    }
+    m_written += size;
+    if (!header) {
+        for (size_t i = 0; i < size; i++) {
+            m_checksum = (m_checksum ^ (uint8_t) data[i]) * 1099511628211ull;
+        }
+    }
+    while (size > 0) {
+        auto n = write(m_fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            FILE_WRITER_ERR("FileWriter: write %s failed, %s", m_tmp_path.c_str());
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool FileWriter::Close(bool ok) {
+    if (m_fd < 0) {
+        ok = false;
+    } else {
+        if (ok && m_lz &&
+            pwrite(m_fd, &m_raw_size, sizeof(m_raw_size), sizeof(char)) != (ssize_t) sizeof(m_raw_size)) {
+            FILE_WRITER_ERR("FileWriter: write %s failed, %s", m_tmp_path.c_str());
+            ok = false;
+        }
+        // on disk before the rename, or a crash may leave path empty
+        if (ok && fsync(m_fd) != 0) {
+            FILE_WRITER_ERR("FileWriter: sync %s failed, %s", m_tmp_path.c_str());
+            ok = false;
+        }
+        if (close(m_fd) != 0 && ok) {
+            FILE_WRITER_ERR("FileWriter: close %s failed, %s", m_tmp_path.c_str());
+            ok = false;
+        }
+        m_fd = -1;
+        if (ok && rename(m_tmp_path.c_str(), m_path.c_str()) != 0) {
+            FILE_WRITER_ERR("FileWriter: rename %s to %s failed, %s", m_tmp_path.c_str(), m_path.c_str());
+            ok = false;
+        }
+        if (!ok) {
+            unlink(m_tmp_path.c_str());
+        }
+    }
+    if (m_stream) {
+        LZ4_freeStream(m_stream);
+        m_stream = 0;
+    }
+    if (m_hc_stream) {
+        LZ4_freeStreamHC(m_hc_stream);
+        m_hc_stream = 0;
+    }
+    free(m_lz_buffer);
+    m_lz_buffer = 0;
+    free(m_dict);
+    m_dict = 0;
+    return ok;
+}
+
+SaveJob::SaveJob(QuickArchiver *owner, const char *path, char *data, size_t size, bool lz, int acceleration,
+                 int level, const std::string &lz_dict, uint64_t lz_dict_id) : m_owner(owner), m_path(path),
+                                                                               m_data(data), m_size(size), m_lz(lz),
+                                                                               m_acceleration(acceleration),
+                                                                               m_level(level), m_lz_dict(lz_dict),
+                                                                               m_lz_dict_id(lz_dict_id) {
+}
+
+SaveJob::~SaveJob() {
+    Wait();
+    free(m_data);
+}
+
+bool SaveJob::Start() {
+    try {
+        m_thread = std::thread(&SaveJob::Run, this);
+    } catch (const std::exception &e) {
+        LERR("SaveJob: start thread failed, %s", e.what());
+        return false;
+    }
+    return true;
+}
+
+void SaveJob::Wait() {
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+void SaveJob::CountBytes() {
+    if (m_ok && !m_counted) {
+        m_counted = true;
+        m_owner->AddSaveBytes(m_writer.Written());
+    }
+}
+
+void SaveJob::Run() {
+    bool ok = m_writer.Open(m_path.c_str(), m_lz, m_acceleration, m_level, m_lz_dict, m_lz_dict_id);
+    // the data is contiguous, so linked chunks need no KeepDict
+    for (size_t offset = 0; ok && offset < m_size; offset += QuickArchiver::LZ_CHUNK_SIZE) {
+        size_t size = m_size - offset < (size_t) QuickArchiver::LZ_CHUNK_SIZE ? m_size - offset :
+                      (size_t) QuickArchiver::LZ_CHUNK_SIZE;
+        ok = m_writer.Write(&m_data[offset], size);
+    }
+    m_ok = m_writer.Close(ok);
+    free(m_data);
+    m_data = 0;
+    m_done.store(true, std::memory_order_release);
+}
+
+// released jobs still running, what is left when the library is unloaded is waited for, so their files land
+struct ReleasedSaveJobs {
+    std::mutex mutex;
+    std::vector<SaveJob *> jobs;
+
+    ~ReleasedSaveJobs() {
+        for (auto job: jobs) {
+            delete job;
+        }
+    }
+};
+
+static ReleasedSaveJobs gReleasedSaveJobs;
+
+void SaveJob::Release(SaveJob *job) {
+    if (job->IsDone()) {
+        delete job;
+    } else {
+        std::lock_guard<std::mutex> lock(gReleasedSaveJobs.mutex);
+        gReleasedSaveJobs.jobs.push_back(job);
+    }
+    FreeReleased();
+}
+
+void SaveJob::FreeReleased() {
+    std::vector<SaveJob *> done;
+    {
+        std::lock_guard<std::mutex> lock(gReleasedSaveJobs.mutex);
+        auto &jobs = gReleasedSaveJobs.jobs;
+        for (size_t i = 0; i < jobs.size();) {
+            if (jobs[i]->IsDone()) {
+                done.push_back(jobs[i]);
+                jobs[i] = jobs.back();
+                jobs.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+    // the thread of a done job is at its end, the join in the destructor does not wait
+    for (auto job: done) {
+        delete job;
+    }
+}
+
+// the file is mapped, so not compressed data is decoded straight from the page cache
+int QuickArchiver::LoadFile(lua_State *L) {
+    const char *path = lua_tostring(L, 1);
+    if (!path) {
+        LERR("LoadFile: invalid path");
+        return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LERR("LoadFile: open %s failed, %s", path, strerror(errno));
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        LERR("LoadFile: %s is empty or can not stat", path);
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    void *data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LERR("LoadFile: mmap %s failed, %s", path, strerror(errno));
+        return 0;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    bool ok = LoadData(L, (const char *) data, size);
+    munmap(data, size);
+    return ok ? 1 : 0;
+}
+
+#define LOAD_INT(v, len) { \
+    if (m_pos + len > m_data_size) { \
+        LERR("LoadInt: buffer overflow"); \
+        return false; \
+    } \
+    switch (len) {         \
+          case sizeof(int8_t): { \
+                int8_t v8 = 0; \
+                memcpy(&v8, &m_data[m_pos], sizeof(int8_t)); \
+                v = v8; \
+                m_pos += sizeof(int8_t); \
+                break; \
+          } \
+          case sizeof(int16_t): { \
+                int16_t v16 = 0; \
+                memcpy(&v16, &m_data[m_pos], sizeof(int16_t)); \
+                v = v16; \
+                m_pos += sizeof(int16_t); \
+                break; \
+          } \
+          case sizeof(int32_t): { \
+                int32_t v32 = 0; \
+                memcpy(&v32, &m_data[m_pos], sizeof(int32_t)); \
+                v = v32; \
+                m_pos += sizeof(int32_t); \
+                break; \
+          } \
+          case sizeof(int64_t): {\
+                int64_t v64 = 0; \
+                memcpy(&v64, &m_data[m_pos], sizeof(int64_t)); \
+                v = v64; \
+                m_pos += sizeof(int64_t); \
+                break; \
+          } \
+          default: \
+                LERR("LoadInt: unknown len %d", len); \
+                return false; \
+     } \
+}
+
+static inline uint64_t ZigZag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t UnZigZag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static size_t EncodeVarint(char *out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (char) (v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (char) v;
+    return n;
+}
+
+// writes at most HEAD_SIZE_MAX bytes, returns how many
+static size_t EncodeHead(char *out, int type, uint64_t v) {
+    if (v < HEAD_INLINE_MAX) {
+        out[0] = (char) (type | (int) (v << 4));
+        return 1;
+    }
+    out[0] = (char) (type | (int) (HEAD_INLINE_MAX << 4));
+    return 1 + EncodeVarint(out + 1, v - HEAD_INLINE_MAX);
+}
+
+// needs HEAD_SIZE_MAX bytes ensured
+void QuickArchiver::SaveHead(Type type, uint64_t v) {
+    m_pos += EncodeHead(&m_buffer[m_pos], (int) type, v);
+}
+
+bool QuickArchiver::LoadHead(char type, uint64_t &v) {
+    v = (uint8_t) type >> 4;
+    if (v < HEAD_INLINE_MAX) {
+        return true;
+    }
+    uint64_t rest = 0;
+    if (!LoadVarint(rest)) {
+        return false;
+    }
+    v += rest;
+    return true;
+}
+
+bool QuickArchiver::LoadVarint(uint64_t &v) {
+    v = 0;
+    for (int shift = 0;; shift += 7) {
+        if (m_pos >= m_data_size || shift > 63) {
+            LERR("LoadVarint: invalid varint");
+            return false;
+        }
+        uint8_t b = m_data[m_pos++];
+        v |= (uint64_t) (b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+}
+
+// the dictionary a save was made with must be the one set now, its strings are pushed from the stack while loading.
+// numbered tables are kept in a table on the stack too, so table_ref can push them again
+bool QuickArchiver::LoadHeader(lua_State *L) {
+    if (!lua_checkstack(L, 2)) {
+        LERR("Load: lua_checkstack failed");
+        return false;
+    }
+    if (m_pos < m_data_size && (Type) (m_data[m_pos] & 0x0F) == Type::dict) {
+        char type = m_data[m_pos];
+        m_pos += sizeof(char);
+        uint64_t id = 0;
+        if (!LoadHead(type, id)) {
+            return false;
+        }
+        if (id != m_dict_id) {
+            LERR("Load: dict %llu needed, dict %llu is set", (unsigned long long) id, (unsigned long long) m_dict_id);
+            return false;
+        }
+        m_dict_count = m_dict_string.size();
+        // views decode later, when the dict may be another one, so they keep its strings
+        if (m_view_stack) {
+            lua_createtable(L, (int) m_dict_count, 0);
+            for (size_t i = 0; i < m_dict_count; i++) {
+                lua_pushlstring(L, m_dict_string[i].data(), m_dict_string[i].size());
+                lua_rawseti(L, -2, (lua_Integer) i + 1);
+            }
+            m_dict_stack = lua_gettop(L);
+        }
+    }
+    if (m_pos < m_data_size && (Type) (m_data[m_pos] & 0x0F) == Type::table_refs) {
+        char type = m_data[m_pos];
+        m_pos += sizeof(char);
+        uint64_t flags = 0;
+        if (!LoadHead(type, flags)) {
+            return false;
+        }
+        lua_newtable(L);
+        m_ref_stack = lua_gettop(L);
+    }
+    return true;
+}
+
+// tables get numbers in the order they start, when the save has table_refs, start is where a table_copy rebuilds
+// it from. tables rebuilt by a copy are not numbered again
+void QuickArchiver::AddLoadedTable(lua_State *L, size_t start) {
+    if (m_ref_stack && !m_rebuild_depth) {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, m_ref_stack, ++m_ref_count);
+        m_loaded_table_pos.push_back(start);
+    }
+}
+
+bool QuickArchiver::LoadValue(lua_State *L, bool can_be_nil) {
+    if (!lua_checkstack(L, 2)) {
+        LERR("LoadValue: lua_checkstack failed");
+        return false;
+    }
+
+    if (m_pos >= m_data_size) {
+        LERR("LoadValue: buffer overflow");
+        return false;
+    }
+
+    size_t start = m_pos;
+    char type = m_data[m_pos];
+    m_pos += sizeof(char);
+
+    Type low_type = (Type) (type & 0x0F);
+
+    switch (low_type) {
+        case Type::nil:
+            if (!can_be_nil) {
+                LERR("LoadValue: nil not allowed");
+                return false;
+            }
+            lua_pushnil(L);
+            return true;
+        case Type::number: {
+            if (m_pos + sizeof(double) > m_data_size) {
                 LERR("LoadValue: buffer overflow");
                 return false;
             }
-            int64_t v = 0;
-            LOAD_INT(v, len);
-            lua_pushinteger(L, v);
+            double v = 0;
+            memcpy(&v, &m_data[m_pos], sizeof(double));
+            m_pos += sizeof(double);
+            lua_pushnumber(L, v);
+            return true;
+        }
+        case Type::integer: {
+            uint64_t v = 0;
+            if (!LoadHead(type, v)) {
+                return false;
+            }
+            lua_pushinteger(L, UnZigZag(v));
             return true;
         }
         case Type::bool_true:
@@ -229,61 +1231,481 @@ bool QuickArchiver::LoadValue(lua_State *L, bool can_be_nil) {
             lua_pushboolean(L, 0);
             return true;
         case Type::string_idx: {
-            int len = (type >> 4) & 0x0F;
-            int64_t idx = 0;
-            LOAD_INT(idx, len);
-            if (idx < 0 || idx >= (int) m_loaded_string.size()) {
-                LERR("LoadValue: invalid string idx %d", idx);
+            uint64_t idx = 0;
+            if (!LoadHead(type, idx)) {
+                return false;
+            }
+            if (idx >= m_loaded_string.size()) {
+                LERR("LoadValue: invalid string idx %llu", (unsigned long long) idx);
                 return false;
             }
             lua_pushlstring(L, m_loaded_string[idx].first, m_loaded_string[idx].second);
             return true;
         }
         case Type::string: {
-            int len = (type >> 4) & 0x0F;
-            int64_t size = 0;
-            LOAD_INT(size, len);
-            if (m_pos + size > m_buffer_size) {
+            uint64_t size = 0;
+            if (!LoadHead(type, size)) {
+                return false;
+            }
+            if (size > m_data_size - m_pos) {
                 LERR("LoadValue: buffer overflow");
                 return false;
             }
-            m_loaded_string.push_back(std::make_pair(&m_buffer[m_pos], size));
-            lua_pushlstring(L, &m_buffer[m_pos], size);
+            if (!m_rebuild_depth) {
+                m_loaded_string.push_back(std::make_pair(&m_data[m_pos], size));
+            }
+            lua_pushlstring(L, &m_data[m_pos], size);
             m_pos += size;
             return true;
         }
-        case Type::table_hash: {
-            int kv_count = 0;
-            memcpy(&kv_count, &m_buffer[m_pos], sizeof(int));
-            m_pos += sizeof(int);
-            lua_createtable(L, 0, kv_count);
-            for (int i = 0; i < kv_count; i++) {
-                if (!LoadValue(L, false)) {
-                    return false;
-                }
-                if (!LoadValue(L, true)) {
+        case Type::table_hash:
+        case Type::table_array:
+            return LoadTable(L, type, start);
+        case Type::table_packed:
+            return LoadPacked(L, type, start);
+        case Type::index:
+            return LoadIndexed(L, type);
+        case Type::table_ref: {
+            uint64_t idx = 0;
+            if (!LoadHead(type, idx)) {
+                return false;
+            }
+            if (!m_ref_stack || idx >= (uint64_t) m_ref_count) {
+                LERR("LoadValue: invalid table ref %llu", (unsigned long long) idx);
+                return false;
+            }
+            lua_rawgeti(L, m_ref_stack, (lua_Integer) idx + 1);
+            return true;
+        }
+        case Type::table_copy: {
+            uint64_t idx = 0;
+            if (!LoadHead(type, idx)) {
+                return false;
+            }
+            if (!m_ref_stack || idx >= (uint64_t) m_ref_count) {
+                LERR("LoadValue: invalid table copy %llu", (unsigned long long) idx);
+                return false;
+            }
+            size_t source = m_loaded_table_pos[idx];
+            if (m_share_dedup_tables) {
+                lua_rawgeti(L, m_ref_stack, (lua_Integer) idx + 1);
+            } else {
+                // decode the source bytes again, a copy inside a copy of itself runs into MAX_TABLE_DEPTH
+                size_t pos = m_pos;
+                m_pos = source;
+                m_rebuild_depth++;
+                bool ok = LoadValue(L, false);
+                m_rebuild_depth--;
+                m_pos = pos;
+                if (!ok) {
                     return false;
                 }
-                lua_rawset(L, -3);
             }
+            AddLoadedTable(L, source);
+            return true;
+        }
+        case Type::dict_string: {
+            uint64_t idx = 0;
+            if (!LoadHead(type, idx)) {
+                return false;
+            }
+            if (idx >= m_dict_count) {
+                LERR("LoadValue: invalid dict string idx %llu", (unsigned long long) idx);
+                return false;
+            }
+            if (m_dict_stack) {
+                lua_rawgeti(L, m_dict_stack, (lua_Integer) idx + 1);
+            } else {
+                lua_pushlstring(L, m_dict_string[idx].data(), m_dict_string[idx].size());
+            }
+            return true;
+        }
+        default: {
+            LERR("LoadValue: unknown type %d", (int) type);
+            return false;
+        }
+    }
+}
+
+template<typename T>
+static inline void PackValues(lua_State *L, int idx, int count, char *out) {
+    for (int i = 1; i <= count; i++) {
+        lua_rawgeti(L, idx, i);
+        T v = (T) lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        memcpy(out, &v, sizeof(T));
+        out += sizeof(T);
+    }
+}
+
+template<typename T>
+static inline void UnpackValues(lua_State *L, int count, const char *in) {
+    for (int i = 1; i <= count; i++) {
+        T v;
+        memcpy(&v, in, sizeof(T));
+        in += sizeof(T);
+        lua_pushinteger(L, v);
+        lua_rawseti(L, -2, i);
+    }
+}
+
+// a sequence of only integers or only floats is the type byte and count, a PackedType byte, then fixed width values.
+// packed is false if the values are mixed, the table is then saved as usual
+bool QuickArchiver::SavePacked(lua_State *L, int idx, int count, bool &packed) {
+    bool is_int = true;
+    int64_t min = 0;
+    int64_t max = 0;
+    for (int i = 1; i <= count; i++) {
+        lua_rawgeti(L, idx, i);
+        bool ok = lua_type(L, -1) == LUA_TNUMBER;
+        if (ok) {
+            bool v_is_int = lua_isinteger(L, -1);
+            if (i == 1) {
+                is_int = v_is_int;
+            }
+            ok = v_is_int == is_int;
+            if (ok && is_int) {
+                int64_t v = lua_tointeger(L, -1);
+                min = i == 1 || v < min ? v : min;
+                max = i == 1 || v > max ? v : max;
+            }
+        }
+        lua_pop(L, 1);
+        if (!ok) {
+            packed = false;
             return true;
         }
-        case Type::table_array: {
-            int kv_count = 0;
-            memcpy(&kv_count, &m_buffer[m_pos], sizeof(int));
-            m_pos += sizeof(int);
-            lua_createtable(L, kv_count, 0);
-            for (int i = 0; i < kv_count; i++) {
+    }
+
+    PackedType packed_type = PackedType::number;
+    size_t width = sizeof(double);
+    if (is_int) {
+        if (min >= INT8_MIN && max <= INT8_MAX) {
+            packed_type = PackedType::int8;
+            width = sizeof(int8_t);
+        } else if (min >= INT16_MIN && max <= INT16_MAX) {
+            packed_type = PackedType::int16;
+            width = sizeof(int16_t);
+        } else if (min >= INT32_MIN && max <= INT32_MAX) {
+            packed_type = PackedType::int32;
+            width = sizeof(int32_t);
+        } else {
+            packed_type = PackedType::int64;
+            width = sizeof(int64_t);
+        }
+    }
+
+    if (!Ensure(HEAD_SIZE_MAX + sizeof(char) + width * count)) {
+        LERR("SavePacked: out of memory");
+        return false;
+    }
+    SaveHead(Type::table_packed, count);
+    m_buffer[m_pos] = (char) packed_type;
+    m_pos += sizeof(char);
+    char *out = &m_buffer[m_pos];
+    switch (packed_type) {
+        case PackedType::int8:
+            PackValues<int8_t>(L, idx, count, out);
+            break;
+        case PackedType::int16:
+            PackValues<int16_t>(L, idx, count, out);
+            break;
+        case PackedType::int32:
+            PackValues<int32_t>(L, idx, count, out);
+            break;
+        case PackedType::int64:
+            PackValues<int64_t>(L, idx, count, out);
+            break;
+        case PackedType::number:
+            for (int i = 1; i <= count; i++) {
+                lua_rawgeti(L, idx, i);
+                double v = lua_tonumber(L, -1);
+                lua_pop(L, 1);
+                memcpy(out, &v, sizeof(double));
+                out += sizeof(double);
+            }
+            break;
+    }
+    m_pos += width * count;
+    packed = true;
+    return true;
+}
+
+bool QuickArchiver::LoadPacked(lua_State *L, char type, size_t start) {
+    uint64_t count = 0;
+    if (!LoadHead(type, count)) {
+        return false;
+    }
+    if (m_pos >= m_data_size) {
+        LERR("LoadPacked: buffer overflow");
+        return false;
+    }
+    PackedType packed_type = (PackedType) m_data[m_pos];
+    m_pos += sizeof(char);
+    size_t width = 0;
+    switch (packed_type) {
+        case PackedType::int8:
+            width = sizeof(int8_t);
+            break;
+        case PackedType::int16:
+            width = sizeof(int16_t);
+            break;
+        case PackedType::int32:
+            width = sizeof(int32_t);
+            break;
+        case PackedType::int64:
+            width = sizeof(int64_t);
+            break;
+        case PackedType::number:
+            width = sizeof(double);
+            break;
+        default:
+            LERR("LoadPacked: unknown packed type %d", (int) packed_type);
+            return false;
+    }
+    if (count > (m_data_size - m_pos) / width || count > INT32_MAX) {
+        LERR("LoadPacked: invalid count %llu", (unsigned long long) count);
+        return false;
+    }
+
+    const char *in = &m_data[m_pos];
+    lua_createtable(L, (int) count, 0);
+    AddLoadedTable(L, start);
+    switch (packed_type) {
+        case PackedType::int8:
+            UnpackValues<int8_t>(L, (int) count, in);
+            break;
+        case PackedType::int16:
+            UnpackValues<int16_t>(L, (int) count, in);
+            break;
+        case PackedType::int32:
+            UnpackValues<int32_t>(L, (int) count, in);
+            break;
+        case PackedType::int64:
+            UnpackValues<int64_t>(L, (int) count, in);
+            break;
+        case PackedType::number:
+            for (int i = 1; i <= (int) count; i++) {
+                double v;
+                memcpy(&v, in, sizeof(double));
+                in += sizeof(double);
+                lua_pushnumber(L, v);
+                lua_rawseti(L, -2, i);
+            }
+            break;
+    }
+    m_pos += width * count;
+    return true;
+}
+
+// an indexed table is decoded in place, or pushed as a view when opened. a string is read from where it is
+bool QuickArchiver::LoadIndexed(lua_State *L, char type) {
+    size_t start = m_pos - sizeof(char);
+    switch ((IndexType) ((uint8_t) type >> 4)) {
+        case IndexType::string: {
+            uint64_t str_pos = 0;
+            if (!LoadVarint(str_pos)) {
+                return false;
+            }
+            if (str_pos >= start || (Type) (m_data[str_pos] & 0x0F) != Type::string) {
+                LERR("LoadIndexed: invalid string pos %llu", (unsigned long long) str_pos);
+                return false;
+            }
+            size_t pos = m_pos;
+            m_pos = str_pos + sizeof(char);
+            uint64_t size = 0;
+            if (!LoadHead(m_data[str_pos], size)) {
+                return false;
+            }
+            if (size > m_data_size - m_pos) {
+                LERR("LoadIndexed: buffer overflow");
+                return false;
+            }
+            lua_pushlstring(L, &m_data[m_pos], size);
+            m_pos = pos;
+            return true;
+        }
+        case IndexType::table: {
+            uint32_t size = 0;
+            if (sizeof(size) > m_data_size - m_pos) {
+                LERR("LoadIndexed: buffer overflow");
+                return false;
+            }
+            memcpy(&size, &m_data[m_pos], sizeof(size));
+            m_pos += sizeof(size);
+            if (!size || size > m_data_size - m_pos) {
+                LERR("LoadIndexed: invalid table size %u", size);
+                return false;
+            }
+            size_t end = m_pos + size;
+            Type table_type = (Type) (m_data[m_pos] & 0x0F);
+            if (table_type != Type::table_hash && table_type != Type::table_array && table_type != Type::table_packed) {
+                LERR("LoadIndexed: invalid table type %d", (int) table_type);
+                return false;
+            }
+            if (!m_view_stack) {
                 if (!LoadValue(L, false)) {
                     return false;
                 }
-                if (!LoadValue(L, true)) {
+                if (m_pos > end) {
+                    LERR("LoadIndexed: invalid table size %u", size);
+                    return false;
+                }
+                m_pos = end;
+                return true;
+            }
+
+            // arrays and hash tables keep the count and where the offsets are, so a value is decoded alone
+            size_t pos = m_pos;
+            uint64_t count = 0;
+            size_t offset_pos = end;
+            if (table_type != Type::table_packed) {
+                char head = m_data[m_pos];
+                m_pos += sizeof(char);
+                if (!LoadHead(head, count)) {
+                    return false;
+                }
+                if (m_pos > end || count > (end - m_pos) / sizeof(uint32_t) || count > INT32_MAX) {
+                    LERR("LoadIndexed: invalid count %llu", (unsigned long long) count);
                     return false;
                 }
-                lua_rawset(L, -3);
+                offset_pos = end - count * sizeof(uint32_t);
+            }
+            if (!lua_checkstack(L, 4)) {
+                LERR("LoadIndexed: lua_checkstack failed");
+                return false;
+            }
+            PushView(L, m_view_stack, pos, offset_pos, count, table_type);
+            m_pos = end;
+            return true;
+        }
+        default:
+            LERR("LoadIndexed: unknown index type %d", (int) ((uint8_t) type >> 4));
+            return false;
+    }
+}
+
+// every value takes at least a byte, so the count is checked against what is left before anything is allocated
+bool QuickArchiver::LoadTable(lua_State *L, char type, size_t start) {
+    bool is_array = (Type) (type & 0x0F) == Type::table_array;
+    uint64_t count = 0;
+    if (!LoadHead(type, count)) {
+        return false;
+    }
+    if (count > (m_data_size - m_pos) / (is_array ? 1 : 2) || count > INT32_MAX) {
+        LERR("LoadTable: invalid count %llu", (unsigned long long) count);
+        return false;
+    }
+
+    m_table_depth++;
+    if (m_table_depth > MAX_TABLE_DEPTH) {
+        LERR("LoadTable: table depth overflow");
+        return false;
+    }
+
+    if (is_array) {
+        lua_createtable(L, (int) count, 0);
+        AddLoadedTable(L, start);
+        for (int i = 1; i <= (int) count; i++) {
+            if (!LoadValue(L, true)) {
+                return false;
+            }
+            lua_rawseti(L, -2, i);
+        }
+    } else {
+        lua_createtable(L, 0, (int) count);
+        AddLoadedTable(L, start);
+        for (int i = 0; i < (int) count; i++) {
+            if (!LoadValue(L, false)) {
+                return false;
+            }
+            if (!LoadValue(L, true)) {
+                return false;
+            }
+            lua_rawset(L, -3);
+        }
+    }
+
+    m_table_depth--;
+    return true;
+}
+
+// the v1 encoding, the type byte has the width of a following int in its high 4 bits, tables have a 4 bytes count
+bool QuickArchiver::LoadValueV1(lua_State *L, bool can_be_nil) {
+    if (!lua_checkstack(L, 1)) {
+        LERR("LoadValue: lua_checkstack failed");
+        return false;
+    }
+
+    if (m_pos >= m_data_size) {
+        LERR("LoadValue: buffer overflow");
+        return false;
+    }
+
+    char type = m_data[m_pos];
+    m_pos += sizeof(char);
+
+    Type low_type = (Type) (type & 0x0F);
+
+    switch (low_type) {
+        case Type::nil:
+            if (!can_be_nil) {
+                LERR("LoadValue: nil not allowed");
+                return false;
+            }
+            lua_pushnil(L);
+            return true;
+        case Type::number: {
+            if (m_pos + sizeof(double) > m_data_size) {
+                LERR("LoadValue: buffer overflow");
+                return false;
+            }
+            double v = 0;
+            memcpy(&v, &m_data[m_pos], sizeof(double));
+            m_pos += sizeof(double);
+            lua_pushnumber(L, v);
+            return true;
+        }
+        case Type::integer: {
+            int len = (type >> 4) & 0x0F;
+            int64_t v = 0;
+            LOAD_INT(v, len);
+            lua_pushinteger(L, v);
+            return true;
+        }
+        case Type::bool_true:
+            lua_pushboolean(L, 1);
+            return true;
+        case Type::bool_false:
+            lua_pushboolean(L, 0);
+            return true;
+        case Type::string_idx: {
+            int len = (type >> 4) & 0x0F;
+            int64_t idx = 0;
+            LOAD_INT(idx, len);
+            if (idx < 0 || idx >= (int) m_loaded_string.size()) {
+                LERR("LoadValue: invalid string idx %d", idx);
+                return false;
+            }
+            lua_pushlstring(L, m_loaded_string[idx].first, m_loaded_string[idx].second);
+            return true;
+        }
+        case Type::string: {
+            int len = (type >> 4) & 0x0F;
+            int64_t size = 0;
+            LOAD_INT(size, len);
+            if (size < 0 || (uint64_t) size > m_data_size - m_pos) {
+                LERR("LoadValue: buffer overflow");
+                return false;
             }
+            m_loaded_string.push_back(std::make_pair(&m_data[m_pos], size));
+            lua_pushlstring(L, &m_data[m_pos], size);
+            m_pos += size;
             return true;
         }
+        case Type::table_hash:
+        case Type::table_array:
+            return LoadTableV1(L, low_type == Type::table_array);
         default: {
             LERR("LoadValue: unknown type %d", (int) type);
             return false;
@@ -291,12 +1713,52 @@ bool QuickArchiver::LoadValue(lua_State *L, bool can_be_nil) {
     }
 }
 
-bool QuickArchiver::SaveValue(lua_State *L, int idx, int64_t &int_value) {
+// the count comes from the data, so it is checked against what is left before anything is allocated,
+// every entry takes at least a key and a value byte
+bool QuickArchiver::LoadTableV1(lua_State *L, bool is_array) {
+    int kv_count = 0;
+    if (m_pos + sizeof(int) > m_data_size) {
+        LERR("LoadTable: buffer overflow");
+        return false;
+    }
+    memcpy(&kv_count, &m_data[m_pos], sizeof(int));
+    m_pos += sizeof(int);
+    if (kv_count < 0 || (uint64_t) kv_count * 2 > m_data_size - m_pos) {
+        LERR("LoadTable: invalid kv count %d", kv_count);
+        return false;
+    }
+
+    m_table_depth++;
+    if (m_table_depth > MAX_TABLE_DEPTH) {
+        LERR("LoadTable: table depth overflow");
+        return false;
+    }
+
+    if (is_array) {
+        lua_createtable(L, kv_count, 0);
+    } else {
+        lua_createtable(L, 0, kv_count);
+    }
+    for (int i = 0; i < kv_count; i++) {
+        if (!LoadValueV1(L, false)) {
+            return false;
+        }
+        if (!LoadValueV1(L, true)) {
+            return false;
+        }
+        lua_rawset(L, -3);
+    }
+
+    m_table_depth--;
+    return true;
+}
+
+bool QuickArchiver::SaveValue(lua_State *L, int idx) {
     int type = lua_type(L, idx);
     switch (type) {
         case LUA_TNIL: {
-            if (m_pos + sizeof(char) > m_buffer_size) {
-                LERR("SaveNil: buffer overflow");
+            if (!Ensure(sizeof(char))) {
+                LERR("SaveNil: out of memory");
                 return false;
             }
             m_buffer[m_pos] = (char) Type::nil;
@@ -305,21 +1767,16 @@ bool QuickArchiver::SaveValue(lua_State *L, int idx, int64_t &int_value) {
         }
         case LUA_TNUMBER:
             if (lua_isinteger(L, idx)) {
-                int64_t v = lua_tointeger(L, idx);
-                int_value = v;
-                int len = FIND_INT_LEN(v);
-                if (m_pos + sizeof(char) + len > m_buffer_size) {
-                    LERR("SaveInteger: buffer overflow");
+                if (!Ensure(HEAD_SIZE_MAX)) {
+                    LERR("SaveInteger: out of memory");
                     return false;
                 }
-                m_buffer[m_pos] = ((char) Type::integer) | ((char) len << 4);
-                m_pos += sizeof(char);
-                SAVE_INT(v, len);
+                SaveHead(Type::integer, ZigZag(lua_tointeger(L, idx)));
                 return true;
             } else {
                 double v = lua_tonumber(L, idx);
-                if (m_pos + sizeof(char) + sizeof(double) > m_buffer_size) {
-                    LERR("SaveNumber: buffer overflow");
+                if (!Ensure(sizeof(char) + sizeof(double))) {
+                    LERR("SaveNumber: out of memory");
                     return false;
                 }
                 m_buffer[m_pos] = (char) Type::number;
@@ -327,97 +1784,299 @@ bool QuickArchiver::SaveValue(lua_State *L, int idx, int64_t &int_value) {
                 m_pos += sizeof(char) + sizeof(double);
                 return true;
             }
-        case LUA_TBOOLEAN: {
-            bool v = lua_toboolean(L, idx);
-            if (m_pos + sizeof(char) > m_buffer_size) {
-                LERR("SaveBool: buffer overflow");
+        case LUA_TBOOLEAN: {
+            if (!Ensure(sizeof(char))) {
+                LERR("SaveBool: out of memory");
+                return false;
+            }
+            m_buffer[m_pos] = lua_toboolean(L, idx) ? (char) Type::bool_true : (char) Type::bool_false;
+            m_pos += sizeof(char);
+            return true;
+        }
+        case LUA_TSTRING: {
+            size_t size = 0;
+            const char *str = lua_tolstring(L, idx, &size);
+            if (m_dict_id && size <= m_dict_max_length) {
+                auto dict_it = m_dict_index.find(StringKey{str, size});
+                if (dict_it != m_dict_index.end()) {
+                    if (!Ensure(HEAD_SIZE_MAX)) {
+                        LERR("SaveDictString: out of memory");
+                        return false;
+                    }
+                    SaveHead(Type::dict_string, dict_it->second);
+                    return true;
+                }
+            }
+            // the same lua string first, then equal long ones made separately
+            bool found = false;
+            size_t str_idx = 0;
+            bool is_long = m_string_dedup_min_length && size >= m_string_dedup_min_length;
+            auto it = m_saved_string.find(str);
+            if (it != m_saved_string.end()) {
+                found = true;
+                str_idx = it->second;
+            } else if (is_long) {
+                auto long_it = m_saved_long_string.find(StringKey{str, size});
+                if (long_it != m_saved_long_string.end()) {
+                    found = true;
+                    str_idx = long_it->second;
+                    m_stat.dedup_bytes += size;
+                }
+            }
+            if (found) {
+                if (!Ensure(HEAD_SIZE_MAX)) {
+                    LERR("SaveSharedString: out of memory");
+                    return false;
+                }
+                if (Indexed()) {
+                    m_buffer[m_pos] = (char) ((int) Type::index | ((int) IndexType::string << 4));
+                    m_pos += sizeof(char);
+                    m_pos += EncodeVarint(&m_buffer[m_pos], str_idx);
+                } else {
+                    SaveHead(Type::string_idx, str_idx);
+                }
+                return true;
+            } else {
+                if (!Ensure(HEAD_SIZE_MAX + size)) {
+                    LERR("SaveString: out of memory");
+                    return false;
+                }
+                str_idx = Indexed() ? m_pos - m_data_start : m_saved_string.size();
+                SaveHead(Type::string, size);
+                memcpy(&m_buffer[m_pos], str, size);
+                m_pos += size;
+                m_saved_string[str] = str_idx;
+                if (is_long) {
+                    m_saved_long_string[StringKey{str, size}] = str_idx;
+                }
+                return true;
+            }
+        }
+        case LUA_TTABLE:
+            return SaveTable(L, idx);
+        default:
+            LERR("SaveValue: unknown type %d", type);
+            return false;
+    }
+}
+
+bool QuickArchiver::SaveTable(lua_State *L, int idx) {
+    // a table seen before, or still being saved when it is a cycle, is a ref to its number
+    bool indexed = Indexed();
+    int number = m_table_count;
+    if (m_track_refs && !indexed) {
+        auto ptr = lua_topointer(L, idx);
+        auto ret = m_saved_table.insert(std::make_pair(ptr, number));
+        if (!ret.second) {
+            if (!Ensure(HEAD_SIZE_MAX)) {
+                LERR("SaveTableRef: out of memory");
+                return false;
+            }
+            SaveHead(Type::table_ref, ret.first->second);
+            m_saved_ref_count++;
+            return true;
+        }
+    }
+    if ((m_track_refs || m_table_dedup) && !indexed) {
+        m_table_count++;
+    }
+    size_t start = m_pos;
+    size_t ref_count = m_saved_ref_count;
+    size_t string_count = m_saved_string.size();
+    size_t entry_count = m_table_entry.size();
+    size_t child_count = m_table_child.size();
+
+    m_table_depth++;
+    if (m_table_depth > MAX_TABLE_DEPTH) {
+        LERR("SaveTable: table depth overflow");
+        return false;
+    }
+
+    // every level holds a key and a value on the stack
+    if (!lua_checkstack(L, 3)) {
+        LERR("SaveTable: lua_checkstack failed");
+        return false;
+    }
+
+    int top = lua_gettop(L);
+    if (idx < 0 && -idx <= top) {
+        idx = idx + top + 1;
+    }
+
+    // count first, so the header is written before the entries and a full chunk can go out any time.
+    // keys are distinct, so n positive integer keys whose max is n are exactly the sequence 1..n
+    int kv_count = 0;
+    int seq_count = 0;
+    int64_t max_int_key = 0;
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        kv_count++;
+        if (lua_isinteger(L, -2)) {
+            int64_t key_int = lua_tointeger(L, -2);
+            if (key_int >= 1) {
+                seq_count++;
+                if (key_int > max_int_key) {
+                    max_int_key = key_int;
+                }
+            }
+        }
+        lua_pop(L, 1);
+    }
+    bool is_array = kv_count > 0 && seq_count == kv_count && max_int_key == kv_count;
+
+    // the size of an indexed table is filled in at the end
+    bool index = indexed && kv_count >= INDEX_MIN_COUNT;
+    size_t size_pos = 0;
+    if (index) {
+        if (!Ensure(sizeof(char) + sizeof(uint32_t))) {
+            LERR("SaveTable: out of memory");
+            return false;
+        }
+        m_buffer[m_pos] = (char) ((int) Type::index | ((int) IndexType::table << 4));
+        size_pos = m_pos + sizeof(char);
+        m_pos = size_pos + sizeof(uint32_t);
+    }
+    size_t table_pos = m_pos;
+    size_t offset_count = m_index_offset.size();
+
+    bool packed = false;
+    if (is_array && kv_count >= PACKED_MIN_COUNT && !SavePacked(L, idx, kv_count, packed)) {
+        return false;
+    }
+
+    if (packed) {
+    } else if (is_array) {
+        if (!Ensure(HEAD_SIZE_MAX)) {
+            LERR("SaveTable: out of memory");
+            return false;
+        }
+        SaveHead(Type::table_array, kv_count);
+        for (int i = 1; i <= kv_count; i++) {
+            if (index) {
+                m_index_offset.push_back((uint32_t) (m_pos - table_pos));
+            }
+            lua_rawgeti(L, idx, i);
+            if (!SaveValue(L, -1)) {
                 return false;
             }
-            m_buffer[m_pos] = v ? (char) Type::bool_true : (char) Type::bool_false;
-            m_pos += sizeof(char);
-            return true;
+            lua_pop(L, 1);
         }
-        case LUA_TSTRING: {
-            size_t size = 0;
-            const char *str = lua_tolstring(L, idx, &size);
-            auto it = m_saved_string.find(str);
-            if (it != m_saved_string.end()) {
-                int idx = it->second;
-                int idx_len = FIND_INT_LEN(idx);
-                if (m_pos + sizeof(char) + idx_len > m_buffer_size) {
-                    LERR("SaveSharedString: buffer overflow");
-                    return false;
-                }
-                m_buffer[m_pos] = (char) Type::string_idx | ((char) idx_len << 4);
-                m_pos += sizeof(char);
-                SAVE_INT(idx, idx_len);
-                return true;
-            } else {
-                int size_len = FIND_INT_LEN(size);
-                if (m_pos + sizeof(char) + size_len + size > m_buffer_size) {
-                    LERR("SaveString: buffer overflow");
-                    return false;
-                }
-                m_buffer[m_pos] = (char) Type::string | ((char) size_len << 4);
-                m_pos += sizeof(char);
-                SAVE_INT(size, size_len);
-                memcpy(&m_buffer[m_pos], str, size);
-                m_pos += size;
-                int str_idx = m_saved_string.size();
-                m_saved_string[str] = str_idx;
-                return true;
-            }
+    } else {
+        if (!Ensure(HEAD_SIZE_MAX)) {
+            LERR("SaveTable: out of memory");
+            return false;
         }
-        case LUA_TTABLE: {
-            m_table_depth++;
-            if (m_table_depth > MAX_TABLE_DEPTH) {
-                LERR("SaveTable: table depth overflow");
+        SaveHead(Type::table_hash, kv_count);
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            if (index) {
+                m_index_offset.push_back((uint32_t) (m_pos - table_pos));
+            }
+            if (!SaveValue(L, -2)) {
                 return false;
             }
-
-            int top = lua_gettop(L);
-            if (idx < 0 && -idx <= top) {
-                idx = idx + top + 1;
+            if (!SaveValue(L, -1)) {
+                return false;
             }
+            lua_pop(L, 1);
+        }
+    }
 
-            if (m_pos + sizeof(char) + sizeof(int) > m_buffer_size) {
-                LERR("SaveTable: buffer overflow");
+    if (index) {
+        size_t offset_size = (m_index_offset.size() - offset_count) * sizeof(uint32_t);
+        if (offset_size) {
+            if (!Ensure(offset_size)) {
+                LERR("SaveTable: out of memory");
                 return false;
             }
-            int table_begin = m_pos;
-            m_pos += sizeof(char) + sizeof(int);
-
-            int kv_count = 0;
-            int64_t max_int_key = 0;
+            memcpy(&m_buffer[m_pos], &m_index_offset[offset_count], offset_size);
+            m_pos += offset_size;
+            m_index_offset.resize(offset_count);
+        }
+        size_t size = m_pos - table_pos;
+        if (size > UINT32_MAX) {
+            LERR("SaveTable: indexed table too big, size %llu", (unsigned long long) size);
+            return false;
+        }
+        uint32_t size32 = (uint32_t) size;
+        memcpy(&m_buffer[size_pos], &size32, sizeof(size32));
+    }
 
-            lua_pushnil(L);
-            while (lua_next(L, idx) != 0) {
-                int64_t key_int = 0;
-                if (!SaveValue(L, -2, key_int)) {
-                    return false;
-                }
-                if (key_int > max_int_key) {
-                    max_int_key = key_int;
-                }
-                int64_t value_int = 0;
-                if (!SaveValue(L, -1, value_int)) {
-                    return false;
-                }
-                lua_pop(L, 1);
-                kv_count++;
-            }
+    m_table_depth--;
 
-            m_buffer[table_begin] = max_int_key == kv_count ? (char) Type::table_array : (char) Type::table_hash;
-            memcpy(&m_buffer[table_begin + sizeof(char)], &kv_count, sizeof(int));
+    // chunks already written to a file can not be compared or taken back. a table with refs or new strings inside
+    // does not decode the same from another place, so it is neither a copy nor a source of copies
+    if (m_table_dedup && !indexed && !m_writer && m_saved_ref_count == ref_count &&
+        m_saved_string.size() == string_count) {
+        DedupTable(number, start, entry_count, child_count);
+    } else if (m_table_dedup) {
+        m_table_child.resize(child_count);
+    }
+    return true;
+}
 
-            m_table_depth--;
+// a table whose key is the same as an earlier one's is replaced by a table_copy of that one's number, tables inside
+// it are taken back, the copy keeps the number of the table it replaces. tables inside are compared by entry in the
+// key, so a table holding copies still matches one holding the tables they copy. with track_refs a later ref may
+// point at a table inside, so a table that numbered any is kept
+void QuickArchiver::DedupTable(int number, size_t start, size_t entry_count, size_t child_count) {
+    size_t size = m_pos - start;
+    if (size < TABLE_DEDUP_MIN_SIZE) {
+        m_table_child.resize(child_count);
+        return;
+    }
+    size_t key_pos = m_table_key.size();
+    size_t pos = start;
+    char head[HEAD_SIZE_MAX];
+    for (size_t i = child_count; i < m_table_child.size(); i++) {
+        auto &child = m_table_child[i];
+        m_table_key.append(&m_buffer[pos], child.start - pos);
+        m_table_key.append(head, EncodeHead(head, (int) Type::table_copy, child.entry));
+        pos = child.end;
+    }
+    m_table_key.append(&m_buffer[pos], m_pos - pos);
+    m_table_child.resize(child_count);
+    size_t key_size = m_table_key.size() - key_pos;
+    size_t hash = StringKeyHash()(StringKey{&m_table_key[key_pos], key_size});
 
-            return true;
+    auto range = m_table_hash.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        auto &entry = m_table_entry[it->second];
+        if (it->second >= entry_count || entry.size != key_size ||
+            memcmp(&m_table_key[entry.pos], &m_table_key[key_pos], key_size) != 0) {
+            continue;
         }
-        default:
-            LERR("SaveValue: unknown type %d", type);
-            return false;
+        size_t source = it->second;
+        // a copy no shorter than the table is not written, the table still stands for its entry in the keys above
+        if ((m_track_refs && m_table_count > number + 1) ||
+            EncodeHead(head, (int) Type::table_copy, entry.number) >= size) {
+            m_table_key.resize(key_pos);
+            m_table_child.push_back(TableChild{start, m_pos, source});
+            return;
+        }
+        while (m_table_entry.size() > entry_count) {
+            auto &inner = m_table_entry.back();
+            auto inner_range = m_table_hash.equal_range(inner.hash);
+            for (auto inner_it = inner_range.first; inner_it != inner_range.second; ++inner_it) {
+                if (inner_it->second == m_table_entry.size() - 1) {
+                    m_table_hash.erase(inner_it);
+                    break;
+                }
+            }
+            key_pos = inner.pos;
+            m_table_entry.pop_back();
+        }
+        m_table_key.resize(key_pos);
+        m_table_count = number + 1;
+        m_pos = start;
+        SaveHead(Type::table_copy, m_table_entry[source].number);
+        m_stat.table_dedup_bytes += size - (m_pos - start);
+        m_table_child.push_back(TableChild{start, m_pos, source});
+        return;
     }
+    m_table_hash.insert(std::make_pair(hash, m_table_entry.size()));
+    m_table_entry.push_back(TableEntry{key_pos, key_size, hash, number});
+    m_table_child.push_back(TableChild{start, m_pos, m_table_entry.size() - 1});
 }
 
 static int quick_archiver_save(lua_State *L) {
@@ -430,6 +2089,16 @@ static int quick_archiver_load(lua_State *L) {
     return gQuickArchiver->Load(L);
 }
 
+static int quick_archiver_save_file(lua_State *L) {
+    CheckQuickArchiver();
+    return gQuickArchiver->SaveFile(L);
+}
+
+static int quick_archiver_load_file(lua_State *L) {
+    CheckQuickArchiver();
+    return gQuickArchiver->LoadFile(L);
+}
+
 static int quick_archiver_set_lz_threshold(lua_State *L) {
     CheckQuickArchiver();
     size_t size = lua_tointeger(L, 1);
@@ -451,14 +2120,571 @@ static int quick_archiver_set_lz_acceleration(lua_State *L) {
     return 0;
 }
 
+static int quick_archiver_set_lz_level(lua_State *L) {
+    CheckQuickArchiver();
+    gQuickArchiver->SetLzLevel(lua_tointeger(L, 1));
+    return 0;
+}
+
+static int quick_archiver_set_string_dedup_min_length(lua_State *L) {
+    CheckQuickArchiver();
+    size_t size = lua_tointeger(L, 1);
+    gQuickArchiver->SetStringDedupMinLength(size);
+    return 0;
+}
+
+static int quick_archiver_set_dict(lua_State *L) {
+    CheckQuickArchiver();
+    return gQuickArchiver->SetDict(L);
+}
+
+static int quick_archiver_set_lz_dict(lua_State *L) {
+    CheckQuickArchiver();
+    return gQuickArchiver->SetLzDict(L);
+}
+
+static int quick_archiver_make_lz_dict(lua_State *L) {
+    CheckQuickArchiver();
+    return gQuickArchiver->MakeLzDict(L);
+}
+
+static int quick_archiver_set_track_refs(lua_State *L) {
+    CheckQuickArchiver();
+    gQuickArchiver->SetTrackRefs(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int quick_archiver_set_table_dedup(lua_State *L) {
+    CheckQuickArchiver();
+    gQuickArchiver->SetTableDedup(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int quick_archiver_set_share_dedup_tables(lua_State *L) {
+    CheckQuickArchiver();
+    gQuickArchiver->SetShareDedupTables(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int quick_archiver_set_indexed(lua_State *L) {
+    CheckQuickArchiver();
+    gQuickArchiver->SetIndexed(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int quick_archiver_open(lua_State *L) {
+    CheckQuickArchiver();
+    lua_settop(L, 1);
+    return gQuickArchiver->Open(L);
+}
+
+static void PushStat(lua_State *L, QuickArchiver *archiver) {
+    auto &stat = archiver->GetStat();
+    lua_newtable(L);
+    lua_pushinteger(L, archiver->MemorySize());
+    lua_setfield(L, -2, "memory");
+    lua_pushinteger(L, stat.peak_buffer_size);
+    lua_setfield(L, -2, "peak_buffer_size");
+    lua_pushinteger(L, stat.save_count);
+    lua_setfield(L, -2, "save_count");
+    lua_pushinteger(L, stat.save_bytes);
+    lua_setfield(L, -2, "save_bytes");
+    lua_pushinteger(L, stat.load_count);
+    lua_setfield(L, -2, "load_count");
+    lua_pushinteger(L, stat.load_bytes);
+    lua_setfield(L, -2, "load_bytes");
+    lua_pushinteger(L, stat.dedup_bytes);
+    lua_setfield(L, -2, "dedup_bytes");
+    lua_pushinteger(L, stat.table_dedup_bytes);
+    lua_setfield(L, -2, "table_dedup_bytes");
+}
+
+static int quick_archiver_save_async(lua_State *L) {
+    CheckQuickArchiver();
+    return gQuickArchiver->SaveAsync(L);
+}
+
+static int quick_archiver_stat(lua_State *L) {
+    CheckQuickArchiver();
+    PushStat(L, gQuickArchiver);
+    return 1;
+}
+
+// archiver objects, each has its own buffers, settings and stat, independent of the global one
+static const char *QUICK_ARCHIVER_META = "quick_archiver.QuickArchiver";
+
+// self is removed, so the methods see the same arguments as the global functions
+static QuickArchiver *CheckObj(lua_State *L) {
+    auto p = (QuickArchiver **) luaL_checkudata(L, 1, QUICK_ARCHIVER_META);
+    if (!*p) {
+        luaL_error(L, "quick_archiver: archiver already released");
+        return 0;
+    }
+    lua_remove(L, 1);
+    return *p;
+}
+
+static int quick_archiver_obj_save(lua_State *L) {
+    return CheckObj(L)->Save(L);
+}
+
+static int quick_archiver_obj_load(lua_State *L) {
+    return CheckObj(L)->Load(L);
+}
+
+static int quick_archiver_obj_save_file(lua_State *L) {
+    return CheckObj(L)->SaveFile(L);
+}
+
+static int quick_archiver_obj_load_file(lua_State *L) {
+    return CheckObj(L)->LoadFile(L);
+}
+
+// the job keeps the archiver alive, its wait() adds to the archiver stat
+static int quick_archiver_obj_save_async(lua_State *L) {
+    lua_settop(L, 3);
+    lua_pushvalue(L, 1);
+    if (!CheckObj(L)->SaveAsync(L)) {
+        return 0;
+    }
+    lua_pushvalue(L, -2);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+static int quick_archiver_obj_open(lua_State *L) {
+    lua_settop(L, 2);
+    lua_pushvalue(L, 1);
+    return CheckObj(L)->Open(L);
+}
+
+static int quick_archiver_obj_set_lz_threshold(lua_State *L) {
+    CheckObj(L)->SetLzThreshold(lua_tointeger(L, 1));
+    return 0;
+}
+
+static int quick_archiver_obj_set_lz_acceleration(lua_State *L) {
+    CheckObj(L)->SetLzAcceleration(lua_tointeger(L, 1));
+    return 0;
+}
+
+static int quick_archiver_obj_set_lz_level(lua_State *L) {
+    CheckObj(L)->SetLzLevel(lua_tointeger(L, 1));
+    return 0;
+}
+
+static int quick_archiver_obj_set_max_buffer_size(lua_State *L) {
+    CheckObj(L)->SetMaxBufferSize(lua_tointeger(L, 1));
+    return 0;
+}
+
+static int quick_archiver_obj_set_string_dedup_min_length(lua_State *L) {
+    CheckObj(L)->SetStringDedupMinLength(lua_tointeger(L, 1));
+    return 0;
+}
+
+static int quick_archiver_obj_set_dict(lua_State *L) {
+    return CheckObj(L)->SetDict(L);
+}
+
+static int quick_archiver_obj_set_lz_dict(lua_State *L) {
+    return CheckObj(L)->SetLzDict(L);
+}
+
+static int quick_archiver_obj_make_lz_dict(lua_State *L) {
+    return CheckObj(L)->MakeLzDict(L);
+}
+
+static int quick_archiver_obj_set_track_refs(lua_State *L) {
+    CheckObj(L)->SetTrackRefs(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int quick_archiver_obj_set_table_dedup(lua_State *L) {
+    CheckObj(L)->SetTableDedup(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int quick_archiver_obj_set_share_dedup_tables(lua_State *L) {
+    CheckObj(L)->SetShareDedupTables(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int quick_archiver_obj_set_indexed(lua_State *L) {
+    CheckObj(L)->SetIndexed(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int quick_archiver_obj_stat(lua_State *L) {
+    PushStat(L, CheckObj(L));
+    return 1;
+}
+
+static int quick_archiver_obj_gc(lua_State *L) {
+    auto p = (QuickArchiver **) luaL_checkudata(L, 1, QUICK_ARCHIVER_META);
+    delete *p;
+    *p = 0;
+    return 0;
+}
+
+static const luaL_Reg gQuickArchiverMethods[] = {
+        {"save",                        quick_archiver_obj_save},
+        {"load",                        quick_archiver_obj_load},
+        {"save_file",                   quick_archiver_obj_save_file},
+        {"load_file",                   quick_archiver_obj_load_file},
+        {"save_async",                  quick_archiver_obj_save_async},
+        {"open",                        quick_archiver_obj_open},
+        {"set_lz_threshold",            quick_archiver_obj_set_lz_threshold},
+        {"set_lz_acceleration",         quick_archiver_obj_set_lz_acceleration},
+        {"set_lz_level",                quick_archiver_obj_set_lz_level},
+        {"set_max_buffer_size",         quick_archiver_obj_set_max_buffer_size},
+        {"set_string_dedup_min_length", quick_archiver_obj_set_string_dedup_min_length},
+        {"set_dict",                    quick_archiver_obj_set_dict},
+        {"set_lz_dict",                 quick_archiver_obj_set_lz_dict},
+        {"make_lz_dict",                quick_archiver_obj_make_lz_dict},
+        {"set_track_refs",              quick_archiver_obj_set_track_refs},
+        {"set_table_dedup",             quick_archiver_obj_set_table_dedup},
+        {"set_share_dedup_tables",      quick_archiver_obj_set_share_dedup_tables},
+        {"set_indexed",                 quick_archiver_obj_set_indexed},
+        {"stat",                        quick_archiver_obj_stat},
+        {NULL, NULL},
+};
+
+// handle of a save_async, done() polls, wait() blocks and returns bytes written and checksum, or nil on failure
+static const char *SAVE_JOB_META = "quick_archiver.SaveJob";
+
+static SaveJob *CheckSaveJob(lua_State *L) {
+    auto p = (SaveJob **) luaL_checkudata(L, 1, SAVE_JOB_META);
+    return *p;
+}
+
+static int quick_archiver_job_done(lua_State *L) {
+    lua_pushboolean(L, CheckSaveJob(L)->IsDone());
+    return 1;
+}
+
+static int quick_archiver_job_wait(lua_State *L) {
+    auto job = CheckSaveJob(L);
+    job->Wait();
+    if (!job->IsOk()) {
+        return 0;
+    }
+    job->CountBytes();
+    lua_pushinteger(L, job->Written());
+    lua_pushinteger(L, job->Checksum());
+    return 2;
+}
+
+// a job dropped without wait() keeps running, see SaveJob::Release
+static int quick_archiver_job_gc(lua_State *L) {
+    auto p = (SaveJob **) luaL_checkudata(L, 1, SAVE_JOB_META);
+    if (*p) {
+        SaveJob::Release(*p);
+        *p = 0;
+    }
+    return 0;
+}
+
+static const luaL_Reg gSaveJobMethods[] = {
+        {"done", quick_archiver_job_done},
+        {"wait", quick_archiver_job_wait},
+        {NULL, NULL},
+};
+
+static void PushSaveJob(lua_State *L, SaveJob *job) {
+    auto p = (SaveJob **) lua_newuserdata(L, sizeof(SaveJob *));
+    *p = job;
+    if (luaL_newmetatable(L, SAVE_JOB_META)) {
+        lua_newtable(L);
+        luaL_setfuncs(L, gSaveJobMethods, 0);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, quick_archiver_job_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+}
+
+// a table of an opened save. its user value is the { data, dict, skip, archiver } source until the first access, then
+// the cache
+// of what is decoded, with the source as the cache's metatable. array elements are decoded one by one, a hash table
+// gets all keys with a light userdata of where each value is, packed arrays are decoded whole
+struct View {
+    size_t pos;
+    size_t offset_pos;
+    uint64_t count;
+    QuickArchiver::Type type;
+    bool expanded;
+};
+
+static const char *VIEW_META = "quick_archiver.View";
+
+static View *CheckView(lua_State *L) {
+    return (View *) luaL_checkudata(L, 1, VIEW_META);
+}
+
+static void CheckViewLoaded(lua_State *L, bool ok) {
+    if (!ok) {
+        luaL_error(L, "quick_archiver: invalid view data");
+    }
+}
+
+// views are decoded by the archiver that opened them, the dict they need is in the source
+static QuickArchiver *ViewArchiver(lua_State *L, int source) {
+    if (lua_rawgeti(L, source, 4) != LUA_TUSERDATA) {
+        lua_pop(L, 1);
+        CheckQuickArchiver();
+        return gQuickArchiver;
+    }
+    auto archiver = *(QuickArchiver **) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (!archiver) {
+        luaL_error(L, "quick_archiver: archiver already released");
+    }
+    return archiver;
+}
+
+static int PushViewCache(lua_State *L, View *view) {
+    lua_getuservalue(L, 1);
+    if (lua_getmetatable(L, -1)) {
+        lua_pop(L, 1);
+        return lua_gettop(L);
+    }
+    int source = lua_gettop(L);
+    auto archiver = ViewArchiver(L, source);
+    if (view->type == QuickArchiver::Type::table_hash) {
+        lua_createtable(L, 0, (int) view->count);
+        CheckViewLoaded(L, archiver->LoadViewKeys(L, source, lua_gettop(L), view->pos, view->offset_pos,
+                                                  view->count));
+    } else if (view->type == QuickArchiver::Type::table_array) {
+        // not sized, a few elements may be all that is read
+        lua_newtable(L);
+    } else {
+        CheckViewLoaded(L, archiver->LoadViewValue(L, source, view->pos));
+        view->expanded = true;
+    }
+    lua_pushvalue(L, source);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setuservalue(L, 1);
+    lua_remove(L, source);
+    return lua_gettop(L);
+}
+
+// decodes the value at pos into the cache and pushes it, key is a stack index
+static void LoadViewField(lua_State *L, int cache, int key, size_t pos) {
+    lua_getmetatable(L, cache);
+    int source = lua_gettop(L);
+    CheckViewLoaded(L, ViewArchiver(L, source)->LoadViewValue(L, source, pos));
+    lua_pushvalue(L, key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, cache);
+    lua_remove(L, source);
+}
+
+static void LoadViewElement(lua_State *L, View *view, int cache, lua_Integer i) {
+    lua_getmetatable(L, cache);
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 3);
+    const char *data = lua_tostring(L, -2) + lua_tointeger(L, -1);
+    uint32_t offset = 0;
+    memcpy(&offset, data + view->offset_pos + (i - 1) * sizeof(uint32_t), sizeof(offset));
+    lua_pop(L, 3);
+    lua_pushinteger(L, i);
+    LoadViewField(L, cache, lua_gettop(L), view->pos + offset);
+    lua_remove(L, -2);
+}
+
+static int ExpandView(lua_State *L, View *view) {
+    int cache = PushViewCache(L, view);
+    if (view->expanded) {
+        return cache;
+    }
+    if (view->type == QuickArchiver::Type::table_array) {
+        for (lua_Integer i = 1; i <= (lua_Integer) view->count; i++) {
+            if (lua_rawgeti(L, cache, i) == LUA_TNIL) {
+                LoadViewElement(L, view, cache, i);
+            }
+            lua_pop(L, 1);
+        }
+    } else {
+        // setting fields that exist is allowed while traversing
+        lua_pushnil(L);
+        while (lua_next(L, cache)) {
+            if (lua_type(L, -1) == LUA_TLIGHTUSERDATA) {
+                size_t pos = (size_t) lua_touserdata(L, -1);
+                LoadViewField(L, cache, lua_gettop(L) - 1, pos);
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+        }
+    }
+    view->expanded = true;
+    return cache;
+}
+
+static int quick_archiver_view_index(lua_State *L) {
+    auto view = CheckView(L);
+    int cache = PushViewCache(L, view);
+    lua_pushvalue(L, 2);
+    int type = lua_rawget(L, cache);
+    // a light userdata is where a value not decoded yet is, once expanded it is one that was set
+    if (type == LUA_TLIGHTUSERDATA && !view->expanded) {
+        LoadViewField(L, cache, 2, (size_t) lua_touserdata(L, -1));
+        return 1;
+    }
+    if (type != LUA_TNIL || view->expanded || view->type != QuickArchiver::Type::table_array ||
+        lua_type(L, 2) != LUA_TNUMBER) {
+        return 1;
+    }
+    int is_int = 0;
+    lua_Integer i = lua_tointegerx(L, 2, &is_int);
+    if (!is_int || i < 1 || i > (lua_Integer) view->count) {
+        return 1;
+    }
+    lua_pop(L, 1);
+    LoadViewElement(L, view, cache, i);
+    return 1;
+}
+
+// writes go to the cache, decoded whole first so pairs sees them
+static int quick_archiver_view_newindex(lua_State *L) {
+    int cache = ExpandView(L, CheckView(L));
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_rawset(L, cache);
+    return 0;
+}
+
+static int quick_archiver_view_len(lua_State *L) {
+    auto view = CheckView(L);
+    int cache = PushViewCache(L, view);
+    bool lazy_array = view->type == QuickArchiver::Type::table_array && !view->expanded;
+    lua_pushinteger(L, lazy_array ? (lua_Integer) view->count : (lua_Integer) lua_rawlen(L, cache));
+    return 1;
+}
+
+static int quick_archiver_view_next(lua_State *L) {
+    lua_settop(L, 2);
+    if (lua_next(L, 1)) {
+        return 2;
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+static int quick_archiver_view_pairs(lua_State *L) {
+    int cache = ExpandView(L, CheckView(L));
+    lua_pushcfunction(L, quick_archiver_view_next);
+    lua_pushvalue(L, cache);
+    lua_pushnil(L);
+    return 3;
+}
+
+static const luaL_Reg gViewMethods[] = {
+        {"__index",    quick_archiver_view_index},
+        {"__newindex", quick_archiver_view_newindex},
+        {"__len",      quick_archiver_view_len},
+        {"__pairs",    quick_archiver_view_pairs},
+        {NULL, NULL},
+};
+
+static void PushView(lua_State *L, int source, size_t pos, size_t offset_pos, uint64_t count,
+                     QuickArchiver::Type type) {
+    auto view = (View *) lua_newuserdata(L, sizeof(View));
+    view->pos = pos;
+    view->offset_pos = offset_pos;
+    view->count = count;
+    view->type = type;
+    view->expanded = false;
+    if (luaL_newmetatable(L, VIEW_META)) {
+        luaL_setfuncs(L, gViewMethods, 0);
+    }
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, source);
+    lua_setuservalue(L, -2);
+}
+
+// new archiver with settings { lz_threshold = , lz_acceleration = , lz_level = , max_buffer_size = ,
+// string_dedup_min_length = , track_refs = , table_dedup = , share_dedup_tables = , indexed = }, all optional
+static int quick_archiver_new(lua_State *L) {
+    auto p = (QuickArchiver **) lua_newuserdata(L, sizeof(QuickArchiver *));
+    *p = 0;
+    if (luaL_newmetatable(L, QUICK_ARCHIVER_META)) {
+        lua_newtable(L);
+        luaL_setfuncs(L, gQuickArchiverMethods, 0);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, quick_archiver_obj_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    auto archiver = new QuickArchiver();
+    *p = archiver;
+    if (lua_istable(L, 1)) {
+        lua_getfield(L, 1, "lz_threshold");
+        if (!lua_isnil(L, -1)) {
+            archiver->SetLzThreshold(lua_tointeger(L, -1));
+        }
+        lua_getfield(L, 1, "lz_acceleration");
+        if (!lua_isnil(L, -1)) {
+            archiver->SetLzAcceleration(lua_tointeger(L, -1));
+        }
+        lua_getfield(L, 1, "lz_level");
+        if (!lua_isnil(L, -1)) {
+            archiver->SetLzLevel(lua_tointeger(L, -1));
+        }
+        lua_getfield(L, 1, "max_buffer_size");
+        if (!lua_isnil(L, -1)) {
+            archiver->SetMaxBufferSize(lua_tointeger(L, -1));
+        }
+        lua_getfield(L, 1, "string_dedup_min_length");
+        if (!lua_isnil(L, -1)) {
+            archiver->SetStringDedupMinLength(lua_tointeger(L, -1));
+        }
+        lua_getfield(L, 1, "track_refs");
+        if (!lua_isnil(L, -1)) {
+            archiver->SetTrackRefs(lua_toboolean(L, -1));
+        }
+        lua_getfield(L, 1, "table_dedup");
+        if (!lua_isnil(L, -1)) {
+            archiver->SetTableDedup(lua_toboolean(L, -1));
+        }
+        lua_getfield(L, 1, "share_dedup_tables");
+        if (!lua_isnil(L, -1)) {
+            archiver->SetShareDedupTables(lua_toboolean(L, -1));
+        }
+        lua_getfield(L, 1, "indexed");
+        if (!lua_isnil(L, -1)) {
+            archiver->SetIndexed(lua_toboolean(L, -1));
+        }
+        lua_pop(L, 9);
+    }
+    return 1;
+}
+
 }
 
 std::vector<luaL_Reg> GetQuickArchiverFuncs() {
     return {
-            {"quick_archiver_save",                quick_archiver::quick_archiver_save},
-            {"quick_archiver_load",                quick_archiver::quick_archiver_load},
-            {"quick_archiver_set_lz_threshold",    quick_archiver::quick_archiver_set_lz_threshold},
-            {"quick_archiver_set_max_buffer_size", quick_archiver::quick_archiver_set_max_buffer_size},
-            {"quick_archiver_set_lz_acceleration", quick_archiver::quick_archiver_set_lz_acceleration},
+            {"quick_archiver_save",                        quick_archiver::quick_archiver_save},
+            {"quick_archiver_load",                        quick_archiver::quick_archiver_load},
+            {"quick_archiver_save_file",                   quick_archiver::quick_archiver_save_file},
+            {"quick_archiver_load_file",                   quick_archiver::quick_archiver_load_file},
+            {"quick_archiver_save_async",                  quick_archiver::quick_archiver_save_async},
+            {"quick_archiver_open",                        quick_archiver::quick_archiver_open},
+            {"quick_archiver_set_lz_threshold",            quick_archiver::quick_archiver_set_lz_threshold},
+            {"quick_archiver_set_max_buffer_size",         quick_archiver::quick_archiver_set_max_buffer_size},
+            {"quick_archiver_set_lz_acceleration",         quick_archiver::quick_archiver_set_lz_acceleration},
+            {"quick_archiver_set_lz_level",                quick_archiver::quick_archiver_set_lz_level},
+            {"quick_archiver_set_string_dedup_min_length", quick_archiver::quick_archiver_set_string_dedup_min_length},
+            {"quick_archiver_set_dict",                    quick_archiver::quick_archiver_set_dict},
+            {"quick_archiver_set_lz_dict",                 quick_archiver::quick_archiver_set_lz_dict},
+            {"quick_archiver_make_lz_dict",                quick_archiver::quick_archiver_make_lz_dict},
+            {"quick_archiver_set_track_refs",              quick_archiver::quick_archiver_set_track_refs},
+            {"quick_archiver_set_table_dedup",             quick_archiver::quick_archiver_set_table_dedup},
+            {"quick_archiver_set_share_dedup_tables",      quick_archiver::quick_archiver_set_share_dedup_tables},
+            {"quick_archiver_set_indexed",                 quick_archiver::quick_archiver_set_indexed},
+            {"quick_archiver_stat",                        quick_archiver::quick_archiver_stat},
+            {"quick_archiver_new",                         quick_archiver::quick_archiver_new},
     };
 }
@@ -1,10 +1,18 @@
 #pragma once
 
 #include "core.h"
+// for LZ4_attach_dictionary
+#define LZ4_STATIC_LINKING_ONLY
 #include "lz4.h"
+#include "lz4hc.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 namespace quick_archiver {
 
+class FileWriter;
+
 class QuickArchiver {
 public:
     QuickArchiver();
@@ -15,14 +23,93 @@ public:
 
     int Load(lua_State *L);
 
+    int SaveFile(lua_State *L);
+
+    int LoadFile(lua_State *L);
+
+    int SaveAsync(lua_State *L);
+
+    // like Load, but tables saved indexed come back as views that decode on access, the data is kept by the views.
+    // the archiver userdata at 2 is kept too and decodes them, nil for the global archiver
+    int Open(lua_State *L);
+
+    // the value at pos of an opened save, source is the stack index of its { data, dict, skip, archiver } table
+    bool LoadViewValue(lua_State *L, int source, size_t pos);
+
+    // the keys of the hash table at pos, offset_pos is where the offsets of its count entries are
+    bool LoadViewKeys(lua_State *L, int source, int keys, size_t pos, size_t offset_pos, uint64_t count);
+
+    // id and array of strings, saves refer to these strings by index and record the id, loads need the same id.
+    // no id or 0 removes the dictionary
+    int SetDict(lua_State *L);
+
+    // id and bytes of a preset lz dictionary, lz data made with it records the id and needs the same one to load.
+    // no id or 0 removes it
+    int SetLzDict(lua_State *L);
+
+    // lz dictionary from an array of sample values, their encoded bytes, the last ones kept if too long
+    int MakeLzDict(lua_State *L);
+
     void SetLzThreshold(size_t size) { m_lz_threshold = size; }
 
     void SetLzAcceleration(int acceleration) { m_lz_acceleration = acceleration; }
 
-    void SetMaxBufferSize(size_t size);
+    // 0 is the fast lz4, 1 to LZ_LEVEL_MAX are the lz4hc levels, slower to save for a better ratio, loads are as fast
+    void SetLzLevel(int level) { m_lz_level = level < 0 ? 0 : (level > LZ_LEVEL_MAX ? LZ_LEVEL_MAX : level); }
+
+    // buffers bigger than this are freed after a save or load, they grow on demand without limit
+    void SetMaxBufferSize(size_t size) { m_max_buffer_size = size; }
+
+    // strings this long or longer are deduplicated by content, 0 turns it off.
+    // shorter ones only when they are the same lua string, lua interns strings of up to 40 bytes
+    void SetStringDedupMinLength(size_t size) { m_string_dedup_min_length = size; }
+
+    // a table saved again, from another place or through a cycle, is saved as a ref and loaded as the same table
+    void SetTrackRefs(bool track_refs) { m_track_refs = track_refs; }
+
+    // a table encoded to the same bytes as an earlier one is saved as a copy of it, not with save_file
+    void SetTableDedup(bool table_dedup) { m_table_dedup = table_dedup; }
+
+    // a copy loads as the very table it copies, or as a new table with the same content
+    void SetShareDedupTables(bool share) { m_share_dedup_tables = share; }
+
+    // bigger tables record their size and arrays the offsets of their elements, strings are referred to by where
+    // they are, so Open can decode any part alone. refs and table dedup are off then, not with save_file
+    void SetIndexed(bool indexed) { m_indexed = indexed; }
+
+    struct Stat {
+        uint64_t save_count = 0;
+        uint64_t load_count = 0;
+        uint64_t save_bytes = 0; // output size of all saves
+        uint64_t load_bytes = 0; // input size of all loads
+        size_t peak_buffer_size = 0; // biggest buffers used by one save or load
+        uint64_t dedup_bytes = 0; // string bytes saved as references by the content dedup
+        uint64_t table_dedup_bytes = 0; // table bytes saved as copies by the table dedup
+    };
+
+    const Stat &GetStat() const { return m_stat; }
+
+    // bytes of a save_async, added when its job is waited for
+    void AddSaveBytes(uint64_t bytes) { m_stat.save_bytes += bytes; }
+
+    // bytes held right now, buffers kept for the next save or load included
+    size_t MemorySize() const;
 
     static const int MAX_TABLE_DEPTH = 32;
 
+    static const size_t INIT_BUFFER_SIZE = 64 * 1024;
+
+    static const int LZ_CHUNK_SIZE = 64 * 1024;
+
+    // lz4 looks back at most 64KB
+    static const int LZ_DICT_MAX_SIZE = 64 * 1024;
+
+    static const int LZ_LEVEL_MAX = LZ4HC_CLEVEL_MAX;
+
+    // 'h', the level byte and the dict id make the longest header
+    static const int LZ_HEADER_MAX_SIZE = sizeof(char) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint8_t) +
+                                          sizeof(uint64_t);
+
     enum class Type {
         nil,
         number,
@@ -33,23 +120,277 @@ public:
         bool_false,
         table_hash,
         table_array,
+        table_packed,
+        dict_string,
+        dict,
+        table_ref,
+        table_refs,
+        table_copy,
+        // the high 4 bits are an IndexType
+        index,
     };
+
+    // values of an indexed save. a table is [uint32 size] then the table, arrays and hash tables then have
+    // [uint32 offset] of every element or key from the table start. a string is a varint of where the string value is
+    enum class IndexType {
+        table,
+        string,
+    };
+
+    // element of a table_packed, a sequence of only integers or only floats
+    enum class PackedType {
+        int8,
+        int16,
+        int32,
+        int64,
+        number,
+    };
+
+    static const int PACKED_MIN_COUNT = 8;
+
+    // smaller tables are decoded with the one holding them
+    static const int INDEX_MIN_COUNT = 32;
 private:
-    bool SaveValue(lua_State *L, int idx, int64_t &int_value);
+    void ResetSave();
+
+    bool SaveHeader();
+
+    bool SaveValue(lua_State *L, int idx);
+
+    bool SaveTable(lua_State *L, int idx);
+
+    void DedupTable(int number, size_t start, size_t entry_count, size_t child_count);
+
+    void SaveHead(Type type, uint64_t v);
+
+    bool LoadHead(char type, uint64_t &v);
+
+    bool LoadVarint(uint64_t &v);
 
     bool LoadValue(lua_State *L, bool can_be_nil);
 
+    bool LoadTable(lua_State *L, char type, size_t start);
+
+    bool LoadHeader(lua_State *L);
+
+    void AddLoadedTable(lua_State *L, size_t start);
+
+    bool SavePacked(lua_State *L, int idx, int count, bool &packed);
+
+    bool LoadPacked(lua_State *L, char type, size_t start);
+
+    bool LoadIndexed(lua_State *L, char type);
+
+    bool Indexed() const { return m_indexed && !m_writer; }
+
+    bool LoadValueV1(lua_State *L, bool can_be_nil);
+
+    bool LoadTableV1(lua_State *L, bool is_array);
+
+    bool Reserve(size_t size);
+
+    bool Ensure(size_t size);
+
+    bool ResetLzStream();
+
+    bool ResetLzHcStream();
+
+    bool Flush(bool final);
+
+    bool LoadData(lua_State *L, const char *data, size_t size);
+
+    void ResetLoad(const char *data, size_t size, int view_stack);
+
+    bool LoadPayload(lua_State *L, const char *data, size_t size, bool v1, int view_stack);
+
+    bool BeginView(lua_State *L, int source);
+
+    void EndView(lua_State *L, bool ok);
+
+    bool Compress(size_t &lz_size);
+
+    // type is the tag, 'c', 'd', 'h' or the v1 'C', data is what follows it
+    bool Decompress(const char *data, size_t size, size_t &raw_size, char type);
+
+    bool DecompressLegacy(const char *data, size_t size, size_t &raw_size);
+
+    void ShrinkBuffer();
+
 private:
     char *m_buffer = 0;
     char *m_lz_buffer = 0;
-    std::unordered_map<const char *, int> m_saved_string;
+    struct StringKey {
+        const char *str;
+        size_t size;
+
+        bool operator==(const StringKey &other) const {
+            return size == other.size && memcmp(str, other.str, size) == 0;
+        }
+    };
+
+    struct StringKeyHash {
+        size_t operator()(const StringKey &key) const;
+    };
+
+    // string numbers, or where the strings are when indexed
+    std::unordered_map<const char *, size_t> m_saved_string;
+    std::unordered_map<StringKey, size_t, StringKeyHash> m_saved_long_string;
     std::vector<std::pair<const char *, size_t>> m_loaded_string;
+    // registered dictionary, kept in c++ only, the archiver may be used by more than one lua state.
+    // a load pushes the strings from m_dict_string, a view from the dict table of its source
+    uint64_t m_dict_id = 0;
+    std::vector<std::string> m_dict_string;
+    std::unordered_map<StringKey, int, StringKeyHash> m_dict_index;
+    size_t m_dict_max_length = 0;
+    int m_dict_stack = 0;
+    size_t m_dict_count = 0;
+    // table numbers, by lua_topointer on save and a table on the stack on load
+    bool m_track_refs = false;
+    std::unordered_map<const void *, int> m_saved_table;
+    size_t m_saved_ref_count = 0;
+    int m_table_count = 0;
+    int m_ref_stack = 0;
+    int m_ref_count = 0;
+    // keys of saved tables by hash for the table dedup, and where loaded tables start for rebuilding copies.
+    // a key is the encoded table with every table inside written as a copy of its entry
+    struct TableEntry {
+        size_t pos;
+        size_t size;
+        size_t hash;
+        int number;
+    };
+    struct TableChild {
+        size_t start;
+        size_t end;
+        size_t entry;
+    };
+    bool m_table_dedup = false;
+    bool m_share_dedup_tables = false;
+    std::unordered_multimap<size_t, size_t> m_table_hash;
+    std::vector<TableEntry> m_table_entry;
+    std::string m_table_key;
+    std::vector<TableChild> m_table_child;
+    std::vector<size_t> m_loaded_table_pos;
+    int m_rebuild_depth = 0;
+    // element offsets of the indexed arrays being saved, and the { data, dict, skip } table on the stack of an open,
+    // skip is the bytes before the data in its string
+    bool m_indexed = false;
+    size_t m_data_start = 0;
+    std::vector<uint32_t> m_index_offset;
+    int m_view_stack = 0;
     size_t m_buffer_size = 0;
     size_t m_lz_buffer_size = 0;
     size_t m_pos = 0;
     size_t m_table_depth = 0;
     size_t m_lz_threshold = 0;
     int m_lz_acceleration = 1;
+    int m_lz_level = 0;
+    LZ4_streamHC_t *m_lz_hc_stream = 0;
+    std::string m_lz_dict;
+    uint64_t m_lz_dict_id = 0;
+    // m_lz_dict loaded once, attached to m_lz_stream by every compress
+    LZ4_stream_t *m_lz_dict_stream = 0;
+    size_t m_max_buffer_size = 1024 * 1024;
+    size_t m_string_dedup_min_length = 41;
+    LZ4_stream_t *m_lz_stream = 0;
+    // set while saving to a file
+    FileWriter *m_writer = 0;
+    // data being loaded, points into the input when it is not compressed
+    const char *m_data = 0;
+    size_t m_data_size = 0;
+    Stat m_stat;
+};
+
+// writes a save to a file chunk by chunk, 'n' then the data, or an lz header then lz chunks as in QuickArchiver::Compress
+// the checksum is fnv-1a 64 of everything after the header
+class FileWriter {
+public:
+    ~FileWriter();
+
+    // lz_dict must stay valid until Close
+    bool Open(const char *path, bool lz, int acceleration, int level, const std::string &lz_dict, uint64_t lz_dict_id);
+
+    // one chunk, at most LZ_CHUNK_SIZE bytes, chunks are linked when compressed
+    bool Write(const char *data, size_t size);
+
+    // copy the lz history aside, call before the data of written chunks is overwritten
+    bool KeepDict();
+
+    // the temp file replaces path if ok and closing it succeeds, else it is removed and path is left as it was.
+    // does nothing but return false if Open did not create the temp file
+    bool Close(bool ok);
+
+    uint64_t Written() const { return m_written; }
+
+    uint64_t Checksum() const { return m_checksum; }
+
+private:
+    bool WriteAll(const char *data, size_t size);
+
+private:
+    std::string m_path;
+    std::string m_tmp_path;
+    int m_fd = -1;
+    bool m_lz = false;
+    int m_acceleration = 1;
+    int m_level = 0;
+    LZ4_streamHC_t *m_hc_stream = 0;
+    uint64_t m_raw_size = 0;
+    uint64_t m_written = 0;
+    uint64_t m_checksum = 0;
+    LZ4_stream_t *m_stream = 0;
+    char *m_lz_buffer = 0;
+    char *m_dict = 0;
+};
+
+// a save whose compression, checksum and file write run on a worker thread, it owns the encoded data
+class SaveJob {
+public:
+    SaveJob(QuickArchiver *owner, const char *path, char *data, size_t size, bool lz, int acceleration, int level,
+            const std::string &lz_dict, uint64_t lz_dict_id);
+
+    ~SaveJob();
+
+    bool Start();
+
+    bool IsDone() const { return m_done.load(std::memory_order_acquire); }
+
+    void Wait();
+
+    bool IsOk() const { return m_ok; }
+
+    uint64_t Written() const { return m_writer.Written(); }
+
+    uint64_t Checksum() const { return m_writer.Checksum(); }
+
+    // add the written bytes to the owner stat, once, call on the lua thread after Wait
+    void CountBytes();
+
+    // the lua handle of job is gone, it is freed now if done, else by a later FreeReleased once it is,
+    // so the gc step never waits for a save
+    static void Release(SaveJob *job);
+
+    // free the released jobs that are done
+    static void FreeReleased();
+
+private:
+    void Run();
+
+private:
+    QuickArchiver *m_owner;
+    bool m_counted = false;
+    std::string m_path;
+    char *m_data;
+    size_t m_size;
+    bool m_lz;
+    int m_acceleration;
+    int m_level;
+    std::string m_lz_dict;
+    uint64_t m_lz_dict_id;
+    FileWriter m_writer;
+    bool m_ok = false;
+    std::atomic<bool> m_done{false};
+    std::thread m_thread;
 };
 
 }
@@ -0,0 +1,231 @@
+#include "cpp_table.h"
+#include <chrono>
+#include <random>
+
+// micro benchmark of the map types used by cpp_table::Map
+// usage: hashmap_bench [max_size], e.g. 10000000 to compare the backends from 1K to 10M entries
+
+using namespace cpp_table;
+
+static int64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template<typename K>
+struct KeyGen {
+};
+
+template<>
+struct KeyGen<int32_t> {
+    static int32_t Make(std::mt19937_64 &rng) {
+        return (int32_t) rng();
+    }
+
+    static int32_t Dense(int i) {
+        return 101 + i;
+    }
+};
+
+template<>
+struct KeyGen<int64_t> {
+    static int64_t Make(std::mt19937_64 &rng) {
+        return (int64_t) rng();
+    }
+
+    static int64_t Dense(int i) {
+        return 100000000001ll + i;
+    }
+};
+
+template<>
+struct KeyGen<StringPtr> {
+    static StringPtr Make(std::mt19937_64 &rng) {
+        auto str = "key_" + std::to_string(rng());
+        return MakeSharedBySize<String>(sizeof(String) + str.size() + 1, str.data(), str.size());
+    }
+
+    static StringPtr Dense(int i) {
+        auto str = "key_" + std::to_string(i);
+        return MakeSharedBySize<String>(sizeof(String) + str.size() + 1, str.data(), str.size());
+    }
+};
+
+// a cpp_table map filled in bulk plans its array part once, as cpp_table does at sink time
+template<typename M>
+void PlanAfterFill(M &map) {
+}
+
+template<typename K, typename V, typename H, typename E>
+void PlanAfterFill(SwitchableHashMap<K, V, H, E> &map) {
+    map.PlanArray();
+}
+
+// dense keys are consecutive ids, inserted in random order
+template<typename M, typename K, typename V>
+void BenchMap(const char *name, int size, bool dense = false) {
+    std::mt19937_64 rng(size);
+    std::vector<K> keys;
+    std::vector<K> miss_keys;
+    keys.reserve(size);
+    miss_keys.reserve(size);
+    for (int i = 0; i < size; ++i) {
+        keys.push_back(dense ? KeyGen<K>::Dense(i) : KeyGen<K>::Make(rng));
+        miss_keys.push_back(dense ? KeyGen<K>::Dense(size + i) : KeyGen<K>::Make(rng));
+    }
+    if (dense) {
+        std::shuffle(keys.begin(), keys.end(), rng);
+    }
+
+    M map;
+    V value;
+    auto begin = NowNs();
+    for (int i = 0; i < size; ++i) {
+        map.Insert(keys[i], value);
+    }
+    PlanAfterFill(map);
+    auto insert_ns = NowNs() - begin;
+
+    int found = 0;
+    begin = NowNs();
+    for (int i = 0; i < size; ++i) {
+        found += map.Find(keys[i], value);
+    }
+    auto hit_ns = NowNs() - begin;
+
+    begin = NowNs();
+    for (int i = 0; i < size; ++i) {
+        found += map.Find(miss_keys[i], value);
+    }
+    auto miss_ns = NowNs() - begin;
+
+    double bytes_per_entry = (double) map.MemorySize() / map.Size();
+
+    begin = NowNs();
+    for (int i = 0; i < size; ++i) {
+        map.Erase(keys[i]);
+    }
+    auto erase_ns = NowNs() - begin;
+
+    printf("%-16s %9d  insert %7.1f  hit %7.1f  miss %7.1f  erase %7.1f ns/op  %6.1f bytes/entry  (%d)\n",
+           name, size, (double) insert_ns / size, (double) hit_ns / size, (double) miss_ns / size,
+           (double) erase_ns / size, bytes_per_entry, found);
+}
+
+// many tiny maps, the usual shape of friends/params style fields
+template<typename M>
+void BenchTinyMaps(const char *name, int entries) {
+    const int map_count = 100000;
+    std::vector<M *> maps(map_count);
+    auto begin = NowNs();
+    for (auto &map: maps) {
+        map = new M();
+        for (int k = 0; k < entries; ++k) {
+            map->Insert(k * 7 + 1, Map::MapValue64());
+        }
+    }
+    auto insert_ns = NowNs() - begin;
+
+    int found = 0;
+    Map::MapValue64 value;
+    begin = NowNs();
+    for (auto &map: maps) {
+        for (int k = 0; k < entries * 2; ++k) {
+            found += map->Find(k * 7 + 1, value);
+        }
+    }
+    auto find_ns = NowNs() - begin;
+
+    size_t bytes = 0;
+    for (auto &map: maps) {
+        bytes += map->MemorySize();
+        delete map;
+    }
+    printf("%-16s %2d entries  insert %7.1f  find(half miss) %7.1f ns/op  %7.1f bytes/map  (%d)\n",
+           name, entries, (double) insert_ns / map_count / entries, (double) find_ns / map_count / entries / 2,
+           (double) bytes / map_count, found);
+}
+
+// per insert latency, rehash of a big table or a rebuild of the array part shows up in the tail
+template<typename M>
+void BenchInsertLatency(const char *name, M &map, const std::vector<int32_t> &keys) {
+    int size = (int) keys.size();
+    std::vector<int64_t> cost(size);
+    Map::MapValue32 value;
+    for (int i = 0; i < size; ++i) {
+        auto begin = NowNs();
+        map.Insert(keys[i], value);
+        cost[i] = NowNs() - begin;
+    }
+    std::sort(cost.begin(), cost.end());
+    printf("%-16s %9d  insert p50 %7lld  p99 %7lld  p999 %7lld  max %9lld ns\n", name, size,
+           (long long) cost[size / 2], (long long) cost[size * 99LL / 100], (long long) cost[size * 999LL / 1000],
+           (long long) cost[size - 1]);
+}
+
+int main(int argc, char *argv[]) {
+    int max_size = argc > 1 ? atoi(argv[1]) : 1000000;
+    for (int size = 1000; size <= max_size; size *= 10) {
+        BenchMap<Map::MapPointer::Map32by32, int32_t, Map::MapValue32>("Map32by32", size);
+        BenchMap<Map::MapPointer::Map64by64, int64_t, Map::MapValue64>("Map64by64", size);
+        BenchMap<Map::MapPointer::Map64byString, StringPtr, Map::MapValue64>("Map64byString", size);
+        BenchMap<Map::MapPointer::Map32by32, int32_t, Map::MapValue32>("Dense32by32", size, true);
+        BenchMap<Map::MapPointer::Map64by64, int64_t, Map::MapValue64>("Dense64by64", size, true);
+        BenchMap<coalesced_hashmap::CompactCoalescedHashMap<int32_t, Map::MapValue32>, int32_t, Map::MapValue32>(
+                "HashDense32by32", size, true);
+        // the doubly linked layout cpp_table::Map used before, kept for comparison
+        BenchMap<coalesced_hashmap::CoalescedHashMap<int32_t, Map::MapValue32>, int32_t, Map::MapValue32>(
+                "Linked32by32", size);
+        BenchMap<coalesced_hashmap::CoalescedHashMap<int64_t, Map::MapValue64>, int64_t, Map::MapValue64>(
+                "Linked64by64", size);
+        // the swiss table backend, see cpp_table_set_map_backend
+        BenchMap<swiss_hashmap::SwissHashMap<int32_t, Map::MapValue32>, int32_t, Map::MapValue32>("Swiss32by32", size);
+        BenchMap<swiss_hashmap::SwissHashMap<int64_t, Map::MapValue64>, int64_t, Map::MapValue64>("Swiss64by64", size);
+        BenchMap<swiss_hashmap::SwissHashMap<StringPtr, Map::MapValue64, StringPtrHash, StringPtrEqual>, StringPtr,
+                Map::MapValue64>("Swiss64byString", size);
+        BenchMap<swiss_hashmap::SwissHashMap<int32_t, Map::MapValue32>, int32_t, Map::MapValue32>(
+                "SwissDense32by32", size, true);
+    }
+    for (int size = 100000; size <= max_size; size *= 10) {
+        std::mt19937_64 rng(size);
+        std::vector<int32_t> random_keys(size);
+        std::vector<int32_t> dense_keys(size);
+        std::vector<int32_t> stride_keys(size);
+        for (int i = 0; i < size; ++i) {
+            random_keys[i] = KeyGen<int32_t>::Make(rng);
+            dense_keys[i] = KeyGen<int32_t>::Dense(i);
+            stride_keys[i] = 3 * i + 1;
+        }
+        std::shuffle(dense_keys.begin(), dense_keys.end(), rng);
+        {
+            coalesced_hashmap::CompactCoalescedHashMap<int32_t, Map::MapValue32> map;
+            BenchInsertLatency("Incremental", map, random_keys);
+        }
+        {
+            coalesced_hashmap::CompactCoalescedHashMap<int32_t, Map::MapValue32> map;
+            map.SetIncrementalRehash(false);
+            BenchInsertLatency("StopTheWorld", map, random_keys);
+        }
+        // the map type cpp_table uses, its array part is planned as it grows only while it is small
+        {
+            Map::MapPointer::Map32by32 map;
+            BenchInsertLatency("Dense32by32", map, dense_keys);
+        }
+        {
+            Map::MapPointer::Map32by32 map;
+            BenchInsertLatency("Stride32by32", map, stride_keys);
+        }
+        {
+            coalesced_hashmap::CompactCoalescedHashMap<int32_t, Map::MapValue32> map;
+            BenchInsertLatency("HashStride32", map, stride_keys);
+        }
+    }
+    for (int entries = 1; entries <= 16; entries *= 2) {
+        BenchTinyMaps<Map::MapPointer::Map64by32>("Map64by32", entries);
+        BenchTinyMaps<coalesced_hashmap::CompactCoalescedHashMap<int32_t, Map::MapValue64>>("Compact64by32",
+                                                                                            entries);
+        BenchTinyMaps<coalesced_hashmap::CoalescedHashMap<int32_t, Map::MapValue64>>("Linked64by32", entries);
+        BenchTinyMaps<swiss_hashmap::SwissHashMap<int32_t, Map::MapValue64>>("Swiss64by32", entries);
+    }
+    return 0;
+}
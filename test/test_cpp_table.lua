@@ -46,6 +46,7 @@ local function test_get_set()
     }
 
     _G.cpp_table_load_proto(_G.CPP_TABLE_PROTO)
+    _G.cpp_table_set_field_stat(true, true)
 
     local cpptable = _G.cpp_table_sink("Player", player)
     print("name " .. cpptable.name)
@@ -104,6 +105,58 @@ local function test_get_set()
     cpptable.params[101] = 101
     print("params101 " .. cpptable.params[101])
 
+    for i = 1000, 2000 do
+        cpptable.params[i] = i
+    end
+    print("params deep_size dense", _G.cpp_table_deep_size(cpptable.params))
+    for i = 1000, 1990 do
+        cpptable.params[i] = nil
+    end
+    print("params deep_size after erase", _G.cpp_table_deep_size(cpptable.params))
+    print("params compact", _G.cpp_table_map_compact(cpptable.params))
+    print("params deep_size after compact", _G.cpp_table_deep_size(cpptable.params), cpptable.params[1995])
+
+    -- maps of messages are sunk key by key, dense keys still end up in the array part
+    local dense_cnts, sparse_cnts = { cnts = {} }, { cnts = {} }
+    for i = 1, 1000 do
+        dense_cnts.cnts[100000000000 + i] = { permanent = i, timing = 1, all = 2 }
+        sparse_cnts.cnts[100000000000 + i * 1000] = { permanent = i, timing = 1, all = 2 }
+    end
+    dense_cnts = _G.cpp_table_sink("Res2Cnt", dense_cnts)
+    sparse_cnts = _G.cpp_table_sink("Res2Cnt", sparse_cnts)
+    print("cnts deep_size dense sparse", _G.cpp_table_deep_size(dense_cnts.cnts), _G.cpp_table_deep_size(sparse_cnts.cnts),
+            dense_cnts.cnts[100000000500].permanent)
+    print("string heap compact", _G.cpp_table_string_heap_compact())
+
+    local many = _G.cpp_table_map_get_many(cpptable.params, { 101, 1995, 1000, 2000 })
+    print("params get_many", many[1], many[2], many[3], many[4])
+    _G.cpp_table_map_get_many(cpptable.params, { 1000, 1996 }, many)
+    print("params get_many out", many[1], many[2], #many)
+    many = _G.cpp_table_map_get_many(cpptable.params, { "101", 101.5, true, 101 })
+    print("params get_many wrong type", many[1], many[2], many[3], many[4])
+    many = _G.cpp_table_map_get_many(cpptable.friends, { "tom", "nobody" })
+    print("friends get_many", many[1].name, many[2])
+
+    _G.cpp_table_set_map_backend("swiss")
+    _G.cpp_table_set_map_backend("swiss", "Player", "friends")
+    local swiss = _G.cpp_table_sink("Player", player)
+    swiss.params[104] = 400
+    swiss.params[101] = nil
+    print("swiss params", swiss.params[101], swiss.params[102], swiss.params[104])
+    print("swiss friends", swiss.friends.tom.name, swiss.friends.nobody)
+    for i = 1000, 2000 do
+        swiss.params[i] = i
+    end
+    for i = 1000, 1990 do
+        swiss.params[i] = nil
+    end
+    print("swiss params compact", _G.cpp_table_map_compact(swiss.params), swiss.params[1995], swiss.params[1990])
+    many = _G.cpp_table_map_get_many(swiss.params, { 102, 1995, 1000 })
+    print("swiss params get_many", many[1], many[2], many[3])
+    print("swiss deep_size", _G.cpp_table_deep_size(swiss))
+    _G.cpp_table_set_map_backend("coalesced")
+    _G.cpp_table_set_map_backend("default", "Player", "friends")
+
     for k, v in pairs(cpptable) do
         print(k, "=", v)
     end
@@ -111,6 +164,11 @@ local function test_get_set()
         print(k, "=", v)
     end
 
+    print("field_stat:" .. serpent.block(_G.cpp_table_dump_statistic().field_stat))
+    print("deep_size:", _G.cpp_table_deep_size(cpptable))
+    print("memory:" .. serpent.block(_G.cpp_table_dump_statistic().memory))
+    _G.cpp_table_set_field_stat(false)
+
     ------------------------------------------
     cpptable = nil
     gc()
@@ -140,7 +198,7 @@ local function test_benchmark_cpp_simple()
     end
 
     gc()
-    print("dump_statistic:" .. serpent.block(_G.cpp_table_dump_statistic()))
+    print("dump_statistic:" .. serpent.block(_G.cpp_table_dump_statistic(true)))
     print("cpp memory " .. collectgarbage("count") / 1024 .. "MB")
     pause()
 end
@@ -168,7 +226,7 @@ local function test_benchmark_cpp_map()
     end
     player = _G.cpp_table_sink("Player", player)
     gc()
-    print("dump_statistic:" .. serpent.block(_G.cpp_table_dump_statistic()))
+    print("dump_statistic:" .. serpent.block(_G.cpp_table_dump_statistic(true)))
     print("cpp memory " .. collectgarbage("count") / 1024 .. "MB")
     pause()
 end
@@ -196,7 +254,7 @@ local function test_benchmark_cpp_array()
     end
     player = _G.cpp_table_sink("Player", player)
     gc()
-    print("dump_statistic:" .. serpent.block(_G.cpp_table_dump_statistic()))
+    print("dump_statistic:" .. serpent.block(_G.cpp_table_dump_statistic(true)))
     print("cpp memory " .. collectgarbage("count") / 1024 .. "MB")
     pause()
 end
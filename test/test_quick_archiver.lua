@@ -49,6 +49,296 @@ end
 
 print("is equal: " .. tostring(_G.equal(_G.old_data, _G.new_data)))
 
+-- single lz block written by older versions
+local legacy = _G.quick_archiver_load("Z\xdf\x07\x02\x00\x00\x00\x13\x01\x73\x23\xb0\x04\x61\x62\x02\x00\xff\xff\xff\xff\x9f\x50\x13\x01\x6e\x12\x07")
+print("load legacy lz: " .. tostring(legacy.n == 7 and legacy.s == string.rep("ab", 600)))
+local legacy_raw = _G.quick_archiver_load("N\x07\x01\x00\x00\x00\x13\x01a\x12\x05")
+print("load legacy raw: " .. tostring(legacy_raw.a == 5))
+
+-- sequences of only integers or only floats are packed
+local packed = { i8 = {}, i16 = {}, i32 = {}, i64 = {}, f = {}, mixed = {} }
+for i = 1, 100 do
+    packed.i8[i] = i - 50
+    packed.i16[i] = i * 300 - 15000
+    packed.i32[i] = i * 100000 - 5000000
+    packed.i64[i] = i * 10000000000 - math.maxinteger // 2
+    packed.f[i] = i + 0.5
+    packed.mixed[i] = i % 2 == 0 and i or i + 0.5
+end
+local packed_loaded = _G.quick_archiver_load(_G.quick_archiver_save(packed))
+local packed_ok = _G.equal(packed, packed_loaded)
+for i = 1, 100 do
+    packed_ok = packed_ok and math.type(packed_loaded.i64[i]) == "integer" and math.type(packed_loaded.f[i]) == "float"
+            and math.type(packed_loaded.mixed[i]) == math.type(packed.mixed[i])
+end
+print("packed arrays is equal: " .. tostring(packed_ok))
+
+-- equal long strings made separately are saved once
+local long_strings = {}
+for i = 1, 20 do
+    long_strings[i] = { desc = string.rep("long description ", 5) .. (i % 2), json = '{"k":' .. string.rep("1", 60) .. '}' }
+end
+local dedup_archiver = _G.quick_archiver.new()
+local dedup_bin = dedup_archiver:save(long_strings)
+local dedup_loaded = dedup_archiver:load(dedup_bin)
+dedup_archiver:set_string_dedup_min_length(0)
+local no_dedup_bin = dedup_archiver:save(long_strings)
+print("string dedup len: ", #dedup_bin, #no_dedup_bin, "saved: " .. dedup_archiver:stat().dedup_bytes,
+        "is equal: " .. tostring(_G.equal(long_strings, dedup_loaded)))
+dedup_archiver = nil
+
+-- common strings come from a registered dictionary, blobs made with another one fail to load
+local dict_archiver = _G.quick_archiver.new()
+local player = { name = "p1", level = 10, items = { { id = 1, count = 2 }, { id = 3, count = 4 } } }
+local plain_bin = dict_archiver:save(player)
+dict_archiver:set_dict(1, { "name", "level", "items", "id", "count" })
+local dict_bin = dict_archiver:save(player)
+print("dict len: ", #dict_bin, #plain_bin, "is equal: " .. tostring(_G.equal(player, dict_archiver:load(dict_bin))),
+        "plain is equal: " .. tostring(_G.equal(player, dict_archiver:load(plain_bin))))
+dict_archiver:set_dict(2, { "level", "name" })
+local dict_mismatch = dict_archiver:load(dict_bin)
+dict_archiver:set_dict(nil)
+print("dict mismatch: " .. tostring(dict_mismatch == nil and dict_archiver:load(dict_bin) == nil))
+dict_archiver = nil
+
+-- small blobs compress against a preset lz dictionary made from samples
+local function make_player(i)
+    local items = {}
+    for j = 1, 10 do
+        items[j] = { id = 1000 + j, count = (i * j) % 99, bind = j % 2 == 0, desc = "a sturdy piece of equipment" }
+    end
+    return { name = "player" .. i, level = i % 60, guild = "guild of the northern mines", items = items }
+end
+local samples = {}
+for i = 1, 20 do
+    samples[i] = make_player(i)
+end
+local lz_archiver = _G.quick_archiver.new({ lz_threshold = 64 })
+local lz_plain_bin = lz_archiver:save(make_player(100))
+lz_archiver:set_lz_dict(7, lz_archiver:make_lz_dict(samples))
+local lz_dict_bin = lz_archiver:save(make_player(100))
+print("lz dict len: ", #lz_dict_bin, #lz_plain_bin, "tag: " .. lz_dict_bin:sub(1, 1),
+        "is equal: " .. tostring(_G.equal(make_player(100), lz_archiver:load(lz_dict_bin))))
+local lz_path = os.tmpname()
+lz_archiver:save_file(lz_path, make_player(101))
+print("lz dict file is equal: " .. tostring(_G.equal(make_player(101), lz_archiver:load_file(lz_path))))
+os.remove(lz_path)
+lz_archiver:set_lz_dict(8, "other")
+print("lz dict mismatch: " .. tostring(lz_archiver:load(lz_dict_bin) == nil))
+lz_archiver = nil
+
+-- a lz level searches harder for a smaller save, with and without the lz dictionary
+local hc_archiver = _G.quick_archiver.new({ lz_threshold = 64, lz_level = 9 })
+local hc_bin = hc_archiver:save(samples)
+local hc_fast_bin = _G.quick_archiver.new({ lz_threshold = 64 }):save(samples)
+print("lz level len: ", #hc_bin, #hc_fast_bin, "tag: " .. hc_bin:sub(1, 1),
+        "is equal: " .. tostring(#hc_bin <= #hc_fast_bin and _G.equal(samples, hc_archiver:load(hc_bin))))
+hc_archiver:set_lz_dict(7, hc_archiver:make_lz_dict(samples))
+local hc_dict_bin = hc_archiver:save(make_player(100))
+print("lz level dict is equal: " .. tostring(_G.equal(make_player(100), hc_archiver:load(hc_dict_bin))))
+local hc_path = os.tmpname()
+hc_archiver:save_file(hc_path, samples)
+print("lz level file is equal: " .. tostring(_G.equal(samples, hc_archiver:load_file(hc_path))))
+os.remove(hc_path)
+hc_archiver = nil
+
+-- shared and cyclic tables keep their shape with track_refs
+local shared = { name = "shared", list = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 } }
+local graph = { a = shared, b = shared, list = { shared, shared }, [shared] = true }
+graph.self = graph
+shared.parent = graph
+local ref_archiver = _G.quick_archiver.new({ track_refs = true })
+local ref_bin = ref_archiver:save(graph)
+local ref_loaded = ref_archiver:load(ref_bin)
+print("track refs len: ", #ref_bin, "shared: " .. tostring(ref_loaded.a == ref_loaded.b and ref_loaded.list[1] == ref_loaded.a
+        and ref_loaded[ref_loaded.a] == true and ref_loaded.self == ref_loaded and ref_loaded.a.parent == ref_loaded
+        and ref_loaded.a.list[10] == 10 and ref_loaded.a.name == "shared"))
+ref_archiver:set_track_refs(false)
+print("no track refs cycle: " .. tostring(ref_archiver:save(graph) == nil))
+ref_archiver = nil
+
+-- equal subtables are saved once with table_dedup, and loaded shared or rebuilt
+local rewards = {}
+for i = 1, 100 do
+    rewards[i] = { item = "sword", count = 1, bonus = { exp = 100, gold = 50, title = "hero", buff = { 1001, 1002 } }, chances = { 1, 2, 3, 4, 5, 6, 7, 8 } }
+end
+rewards[101] = { item = "shield", count = 2, bonus = { exp = 100, gold = 50, title = "hero", buff = { 1001, 1002 } } }
+local dedup_tables_archiver = _G.quick_archiver.new({ table_dedup = true })
+local dedup_tables_bin = dedup_tables_archiver:save(rewards)
+local rebuilt = dedup_tables_archiver:load(dedup_tables_bin)
+dedup_tables_archiver:set_share_dedup_tables(true)
+local shared_rewards = dedup_tables_archiver:load(dedup_tables_bin)
+dedup_tables_archiver:set_table_dedup(false)
+local plain_rewards_bin = dedup_tables_archiver:save(rewards)
+print("table dedup len: ", #dedup_tables_bin, #plain_rewards_bin,
+        "is equal: " .. tostring(_G.equal(rewards, rebuilt) and _G.equal(rewards, shared_rewards)),
+        "rebuilt: " .. tostring(rebuilt[2] ~= rebuilt[3] and rebuilt[2].bonus ~= rebuilt[3].bonus),
+        "shared: " .. tostring(shared_rewards[2] == shared_rewards[3] and shared_rewards[101].bonus == shared_rewards[3].bonus))
+dedup_tables_archiver = _G.quick_archiver.new({ table_dedup = true, track_refs = true })
+local ref_rewards = { a = rewards[1], b = rewards[2], c = rewards[2], d = { rewards[3] } }
+local ref_rewards_loaded = dedup_tables_archiver:load(dedup_tables_archiver:save(ref_rewards))
+-- a table holding one that is referenced again later is not replaced by a copy
+local inner, inner2 = { 1001, 1002, 1003, 1004 }, { 1001, 1002, 1003, 1004 }
+local ref_root = { { inner, 1, 2, 3 }, { inner2, 1, 2, 3 }, inner2 }
+local ref_root_loaded = dedup_tables_archiver:load(dedup_tables_archiver:save(ref_root))
+print("table dedup with refs is equal: " .. tostring(_G.equal(ref_rewards, ref_rewards_loaded)
+        and ref_rewards_loaded.b == ref_rewards_loaded.c and ref_rewards_loaded.a ~= ref_rewards_loaded.b
+        and _G.equal(ref_root, ref_root_loaded) and ref_root_loaded[3] == ref_root_loaded[2][1]))
+dedup_tables_archiver = nil
+
+-- indexed saves open as views that decode what is read, and still load whole
+local function view_to_table(v)
+    if type(v) ~= "table" and type(v) ~= "userdata" then
+        return v
+    end
+    local t = {}
+    for k, x in pairs(v) do
+        t[k] = view_to_table(x)
+    end
+    return t
+end
+local player = { name = "player", level = 10, bag = {}, quests = {}, exp = {} }
+for i = 1, 200 do
+    player.bag[i] = { id = i, name = "item" .. (i % 7), count = i * 3, bind = i % 2 == 0,
+                      attr = { str = i, agi = 2 * i, int = 3, luk = 4, hp = 5, mp = 6, def = 7, atk = 8.5 } }
+    player.quests["q" .. i] = { state = "done", step = i }
+    player.exp[i] = i * 1000
+end
+local indexed_archiver = _G.quick_archiver.new({ indexed = true, lz_threshold = 0 })
+local indexed_bin = indexed_archiver:save(player)
+local view = indexed_archiver:open(indexed_bin)
+print("indexed len: ", #indexed_bin, "is view: " .. tostring(type(view.bag) == "userdata"),
+        "read: " .. tostring(view.bag[57].attr.atk == 8.5 and view.quests.q33.step == 33 and view.exp[5] == 5000
+        and #view.bag == 200 and view.bag[200].name == "item4"),
+        "is equal: " .. tostring(_G.equal(view_to_table(view), player) and _G.equal(indexed_archiver:load(indexed_bin), player)))
+view.bag[3] = "changed"
+local ipairs_count = 0
+for _ in ipairs(view.bag) do
+    ipairs_count = ipairs_count + 1
+end
+print("indexed view write: " .. tostring(view.bag[3] == "changed" and ipairs_count == 200))
+indexed_archiver:set_lz_threshold(64)
+indexed_archiver:set_dict(1, { "name", "count", "attr", "item1" })
+indexed_bin = indexed_archiver:save(player)
+view = indexed_archiver:open(indexed_bin)
+-- views keep the dict they were opened with
+indexed_archiver:set_dict(2, { "other" })
+print("indexed lz dict: ", indexed_bin:sub(1, 1), "is equal: " .. tostring(_G.equal(view_to_table(view), player)),
+        "plain save opens: " .. tostring(_G.equal(_G.quick_archiver_open(_G.quick_archiver_save(player)), player)))
+local bad_views = 0
+indexed_archiver:set_lz_threshold(0)
+indexed_bin = indexed_archiver:save(player)
+for len = 1, #indexed_bin - 1, 113 do
+    local ok, opened = pcall(function()
+        return view_to_table(indexed_archiver:open(indexed_bin:sub(1, len)))
+    end)
+    if ok and opened ~= nil then
+        bad_views = bad_views + 1
+    end
+end
+print("open bad data: " .. tostring(bad_views == 0))
+indexed_archiver = nil
+-- views decode with the archiver that opened them, which they keep
+local owner = _G.quick_archiver.new()
+owner:set_dict(2, { "other" })
+local owned_view = owner:open(indexed_bin)
+owner = nil
+collectgarbage()
+print("indexed view owner: " .. tostring(owned_view.bag[57].attr.atk == 8.5 and owned_view.quests.q33.step == 33))
+view = nil
+
+-- cut or damaged blobs fail instead of reading past the data
+_G.quick_archiver_set_lz_threshold(0)
+local raw = _G.quick_archiver_save(_G.old_data)
+_G.quick_archiver_set_lz_threshold(1024)
+local lz = _G.quick_archiver_save({ s = string.rep("ab", 600), n = 7 })
+local bad_loaded = 0
+for _, blob in ipairs({ raw, lz }) do
+    for len = 1, #blob - 1, 9 do
+        if _G.quick_archiver_load(blob:sub(1, len)) ~= nil then
+            bad_loaded = bad_loaded + 1
+        end
+    end
+end
+bad_loaded = bad_loaded + (_G.quick_archiver_load(raw .. "\0") ~= nil and 1 or 0)
+bad_loaded = bad_loaded + (_G.quick_archiver_load("N\x08\xff\xff\xff\x7f") ~= nil and 1 or 0)
+bad_loaded = bad_loaded + (_G.quick_archiver_load("N" .. string.rep("\x08\x01\x00\x00\x00\x12\x01", 40) .. "\x00") ~= nil and 1 or 0)
+bad_loaded = bad_loaded + (_G.quick_archiver_load("n\xf8\xff\xff\xff\xff\x0f") ~= nil and 1 or 0)
+bad_loaded = bad_loaded + (_G.quick_archiver_load("n" .. string.rep("\x18", 40) .. "\x00") ~= nil and 1 or 0)
+print("load bad data: " .. tostring(bad_loaded == 0))
+
+-- bigger than the old fixed 16MB buffer
+local big = {}
+for i = 1, 200000 do
+    big[i] = string.rep("a", 80) .. i
+end
+local big_bin = _G.quick_archiver_save(big)
+print("save big data len: ", #big_bin, "is equal: " .. tostring(_G.equal(big, _G.quick_archiver_load(big_bin))))
+local path = os.tmpname()
+print("save big file len: ", _G.quick_archiver_save_file(path, big),
+        "is equal: " .. tostring(_G.equal(big, _G.quick_archiver_load_file(path))))
+_G.quick_archiver_set_lz_threshold(0)
+print("save big raw file len: ", _G.quick_archiver_save_file(path, big),
+        "is equal: " .. tostring(_G.equal(big, _G.quick_archiver_load_file(path))))
+_G.quick_archiver_set_lz_threshold(1024)
+local save_bytes = _G.quick_archiver_stat().save_bytes
+local job = _G.quick_archiver_save_async(path, big)
+big[1] = "changed after save_async"
+local written, checksum = job:wait()
+big[1] = string.rep("a", 80) .. 1
+print("save async file len: ", written, "done: " .. tostring(job:done()), "has checksum: " .. tostring(checksum ~= nil),
+        "is equal: " .. tostring(_G.equal(big, _G.quick_archiver_load_file(path))))
+job:wait()
+print("save async stat bytes: " .. tostring(_G.quick_archiver_stat().save_bytes == save_bytes + written))
+job = _G.quick_archiver_save_async(path .. "_no_dir/x", big)
+print("save async bad path: " .. tostring(job:wait() == nil and _G.quick_archiver_load_file(path) ~= nil))
+job = nil
+-- a job dropped while it runs is not waited for by the gc, its file still lands
+local dropped_path = path .. "_dropped"
+_G.quick_archiver_save_async(dropped_path, big)
+collectgarbage()
+local dropped_file
+for _ = 1, 500 do
+    dropped_file = io.open(dropped_path)
+    if dropped_file or package.config:sub(1, 1) ~= "/" then
+        break
+    end
+    os.execute("sleep 0.01")
+end
+if dropped_file then
+    dropped_file:close()
+end
+print("save async dropped job lands: " .. tostring(_G.equal(big, _G.quick_archiver_load_file(dropped_path))))
+os.remove(dropped_path)
+-- a failed save leaves the last good file
+_G.quick_archiver_save_file(path, { a = 1 })
+print("failed save keeps file: " .. tostring(_G.quick_archiver_save_file(path, { f = function() end }) == nil and
+        _G.equal({ a = 1 }, _G.quick_archiver_load_file(path))))
+-- a save keeps the mode of the file it replaces, a new file gets the umask
+if package.config:sub(1, 1) == "/" then
+    os.execute("chmod 600 " .. path)
+    _G.quick_archiver_save_file(path, { a = 2 })
+    local kept = os.execute("test $(stat -c %a " .. path .. ") = 600")
+    os.remove(path)
+    _G.quick_archiver_save_file(path, { a = 3 })
+    local new = os.execute("test $(stat -c %a " .. path .. ") = $(printf %o $((0666 & ~$(umask))))")
+    print("save file mode: " .. tostring(kept == true and new == true))
+end
+os.remove(path)
+
+-- an archiver of its own does not see the global settings
+local archiver = _G.quick_archiver.new({ lz_threshold = 0, max_buffer_size = 4096 })
+local raw_bin = archiver:save(big)
+print("archiver save len: ", #raw_bin, "is equal: " .. tostring(_G.equal(big, archiver:load(raw_bin))))
+local stat = archiver:stat()
+print("archiver stat", stat.save_count, stat.load_count, stat.save_bytes == #raw_bin, stat.memory < 65536,
+        stat.peak_buffer_size >= #raw_bin)
+print("global stat", _G.quick_archiver_stat().save_count)
+raw_bin = nil
+archiver = nil
+big = nil
+big_bin = nil
+
 
 _G.old_data = nil
 _G.new_data = nil
@@ -37,6 +37,12 @@
 #include <queue>
 #include <iostream>
 #include <type_traits>
+#include <cstdlib>
+#include <new>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
 
 namespace coalesced_hashmap {
 
@@ -69,6 +75,24 @@ private:
     int m_size;
 };
 
+// map hash to [0, size) without division, fibonacci hashing first, so identity hash of int keys spreads well
+// then take the high 32 bits of (h * size), see https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+static inline int FastRange(size_t hash, int size) {
+    uint32_t h = (uint32_t) (((uint64_t) hash * 0x9E3779B97F4A7C15ull) >> 32);
+    return (int) (((uint64_t) h * (uint32_t) size) >> 32);
+}
+
+// ask the cpu to start loading the cache line of addr, lookups of a batch of keys overlap their misses this way
+static inline void PrefetchLine(const void *addr) {
+#if defined(__GNUC__)
+    __builtin_prefetch(addr);
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+    _mm_prefetch((const char *) addr, _MM_HINT_T0);
+#else
+    (void) addr;
+#endif
+}
+
 static const int primes[] = {2, 5, 7, 11, 17, 23, 37, 53, 79, 113, 167, 251, 373, 557, 839, 1259, 1889,
                              2833, 4243, 6361, 9533, 14249, 21373, 32059, 48089, 72131, 108197, 162293,
                              243439, 365159, 547739, 821609, 1232413, 1848619, 2772929, 4159393, 6239089,
@@ -98,7 +122,8 @@ public:
     ** put new key in its main position; otherwise (colliding node is in its main
     ** position), new key goes to an empty position.
     */
-    void Insert(const Key &key) {
+    // return true if key is new, false if key exist and replaced
+    bool Insert(const Key &key) {
         auto mp = MainPosition(key);
         if (Valid(mp)) { /* main position is taken? */
             // try to find key first
@@ -106,7 +131,7 @@ public:
             while (cur != -1) {
                 if (Equal()(m_nodes[cur].key, key)) {
                     m_nodes[cur].key = key;
-                    return;
+                    return false;
                 }
                 cur = m_nodes[cur].next;
             }
@@ -115,7 +140,7 @@ public:
             if (f < 0) { /* cannot find a free place? */
                 auto b = Rehash();  /* grow table */
                 if (b < 0) {
-                    return;  /* grow failed */
+                    return false;  /* grow failed */
                 }
                 return Insert(key);  /* insert key into grown table */
             }
@@ -160,6 +185,8 @@ public:
         }
         m_nodes[mp].key = key;
         m_bitmap->Set(mp);
+        m_count++;
+        return true;
     }
 
     template<typename OtherKey>
@@ -178,6 +205,14 @@ public:
         return false;
     }
 
+    // prefetch the main position of a key that is about to be found
+    template<typename OtherKey>
+    void Prefetch(const OtherKey &other_key) const {
+        if (m_size) {
+            PrefetchLine(&m_nodes[MainPosition(other_key)]);
+        }
+    }
+
     bool Contains(const Key &key) {
         auto mp = MainPosition(key);
         if (!Valid(mp)) {
@@ -233,6 +268,8 @@ public:
                     m_nodes[m_free].pre = clear_pos;
                 }
                 m_free = clear_pos;
+                m_count--;
+                ShrinkIfSparse();
                 return true;
             }
             cur = m_nodes[cur].next;
@@ -244,14 +281,31 @@ public:
         return m_size;
     }
 
+    // bytes of this object, nodes and bitmap
+    size_t MemorySize() const {
+        return sizeof(*this) + m_size * sizeof(Node) + sizeof(BitMap) + (m_size + 7) / 8;
+    }
+
     int Size() const {
-        int ret = 0;
-        for (int i = 0; i < m_size; i++) {
-            if (Valid(i)) {
-                ret++;
-            }
+        return m_count;
+    }
+
+    // make room for n keys, no rehash until Size() > n
+    void Reserve(int n) {
+        if (n <= m_size) {
+            return;
         }
-        return ret;
+        Rehash(FindNextCapacity(n));
+    }
+
+    // rebuild into the smallest capacity holding all keys, return true if the table shrank
+    bool Compact() {
+        auto size = FindNextCapacity(m_count > 1 ? m_count : 1);
+        if (size == -1 || size >= m_size) {
+            return false;
+        }
+        Rehash(size);
+        return true;
     }
 
     int MainPositionSize() const {
@@ -285,6 +339,8 @@ public:
 
     class Iterator {
     public:
+        Iterator() : m_map(0), m_index(0) {}
+
         Iterator(CoalescedHashSet *map) : m_map(map) {
             m_index = 0;
             while (m_index < m_map->m_size && !m_map->Valid(m_index)) {
@@ -338,7 +394,7 @@ private:
 
     template<typename OtherKey>
     int MainPosition(const OtherKey &other_key) const {
-        return Hash()(other_key) % m_size;
+        return FastRange(Hash()(other_key), m_size);
     }
 
     bool Valid(int index) const {
@@ -386,8 +442,22 @@ private:
         m_free = 0;
     }
 
+    // grow at least double, a table full of n keys rehash log(n) times, not once per prime
     int Rehash() {
-        auto size = FindNextCapacity(Capacity() + 1);
+        return Rehash(FindNextCapacity(Capacity() * 2));
+    }
+
+    // shrink when load drops under 1/8, down to about half load, so the table is far from both the grow
+    // and the shrink point afterwards and insert/erase around one size does not rehash back and forth
+    void ShrinkIfSparse() {
+        if (m_size <= SHRINK_MIN_SIZE || m_count * 8 >= m_size) {
+            return;
+        }
+        auto size = m_count * 2;
+        Rehash(FindNextCapacity(size > SHRINK_MIN_SIZE ? size : SHRINK_MIN_SIZE));
+    }
+
+    int Rehash(int size) {
         if (size == -1) {
             return -1;
         }
@@ -396,10 +466,13 @@ private:
         auto oldbitmap = m_bitmap;
         m_nodes = new Node[size];
         m_size = size;
+        m_count = 0;
         InitFreeList();
         m_bitmap = new BitMap(size);
         for (int i = 0; i < oldsize; i++) {
-            Insert(oldnodes[i].key);
+            if (oldbitmap->Test(i)) {
+                Insert(oldnodes[i].key);
+            }
         }
         delete oldbitmap;
         delete[] oldnodes;
@@ -407,14 +480,516 @@ private:
     }
 
 private:
+    static const int SHRINK_MIN_SIZE = 64;
+
     int m_free = 0; // free list head
     int m_size = 0;
+    int m_count = 0; // valid key count
     Node *m_nodes;
     BitMap *m_bitmap;
 };
 
-template<typename Key, typename Value, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>>
-class CoalescedHashMap {
+// compact variant of CoalescedHashSet for maps that are rarely erased, lua table style
+// chains are singly linked by uint32_t index, keys, links and bitmap live in one allocation,
+// a free slot is found by scanning down from m_last_free, the table grows only when the scan reaches 0
+// big tables grow incrementally: the old table is kept and migrated a few slots per insert/erase,
+// lookups consult both until it is empty
+template<typename Key, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>>
+class CompactCoalescedHashSet {
+public:
+    CompactCoalescedHashSet(int size = 1) {
+        Alloc(size);
+    }
+
+    ~CompactCoalescedHashSet() {
+        Free(m_keys, m_size);
+        if (m_old) {
+            Free(m_old->keys, m_old->size);
+            delete m_old;
+        }
+    }
+
+    CompactCoalescedHashSet(const CompactCoalescedHashSet &) = delete;
+
+    CompactCoalescedHashSet &operator=(const CompactCoalescedHashSet &) = delete;
+
+    // return true if key is new, false if key exist and replaced
+    bool Insert(const Key &key) {
+        if (m_old) {
+            MigrateStep();
+            if (m_old) {
+                auto pos = FindOld(key);
+                if (pos != NIL) {
+                    m_old->keys[pos] = key;
+                    return false;
+                }
+            }
+        }
+        return InsertNew(key);
+    }
+
+    template<typename OtherKey>
+    bool Find(OtherKey other_key, Key &key) {
+        auto mp = MainPosition(other_key);
+        if (Valid(mp)) {
+            while (mp != NIL) {
+                if (Equal()(m_keys[mp], other_key)) {
+                    key = m_keys[mp];
+                    return true;
+                }
+                mp = Next(mp);
+            }
+        }
+        if (m_old) {
+            auto pos = FindOld(other_key);
+            if (pos != NIL) {
+                key = m_old->keys[pos];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // prefetch the main position of a key that is about to be found, the old table of a rehash is left alone
+    template<typename OtherKey>
+    void Prefetch(const OtherKey &other_key) const {
+        if (m_size) {
+            auto mp = MainPosition(other_key);
+            PrefetchLine(&m_bitmap[mp / 8]);
+            PrefetchLine(&m_keys[mp]);
+        }
+    }
+
+    bool Contains(const Key &key) {
+        auto mp = MainPosition(key);
+        if (Valid(mp)) {
+            while (mp != NIL) {
+                if (Equal()(m_keys[mp], key)) {
+                    return true;
+                }
+                mp = Next(mp);
+            }
+        }
+        return m_old && FindOld(key) != NIL;
+    }
+
+    // a chain only holds keys of the same main position, so the previous node is found by walking from its head
+    template<typename OtherKey>
+    bool Erase(const OtherKey &other_key) {
+        if (m_old) {
+            MigrateStep();
+            if (m_old) {
+                auto pos = FindOld(other_key);
+                if (pos != NIL) {
+                    // chains of the old table stay linked, only the bit goes
+                    m_old->ClearValid(pos);
+                    m_old->keys[pos] = Key();
+                    m_old->count--;
+                    return true;
+                }
+            }
+        }
+        auto mp = MainPosition(other_key);
+        if (!Valid(mp)) {
+            return false;
+        }
+        auto pre = NIL;
+        auto cur = mp;
+        while (cur != NIL) {
+            if (Equal()(m_keys[cur], other_key)) {
+                auto clear_pos = cur;
+                auto next = Next(cur);
+                if (pre != NIL) {
+                    SetNext(pre, next);
+                } else if (next != NIL) {
+                    // is head, move next to main position
+                    m_keys[cur] = m_keys[next];
+                    SetNext(cur, Next(next));
+                    clear_pos = next;
+                }
+                ClearValid(clear_pos);
+                m_keys[clear_pos] = Key();
+                SetNext(clear_pos, NIL);
+                // let the free scan see this slot again
+                if (clear_pos >= m_last_free) {
+                    m_last_free = clear_pos + 1;
+                }
+                m_count--;
+                ShrinkIfSparse();
+                return true;
+            }
+            pre = cur;
+            cur = Next(cur);
+        }
+        return false;
+    }
+
+    int Capacity() const {
+        return m_size;
+    }
+
+    // bytes of this object and its single allocation, and the old table while migrating
+    size_t MemorySize() const {
+        return sizeof(*this) + AllocSize(m_size) + (m_old ? sizeof(OldTable) + AllocSize(m_old->size) : 0);
+    }
+
+    int Size() const {
+        return m_count + (m_old ? m_old->count : 0);
+    }
+
+    // make room for n keys, no rehash until Size() > n
+    void Reserve(int n) {
+        if (n <= m_size) {
+            return;
+        }
+        Rehash(FindNextCapacity(n));
+    }
+
+    // rebuild into the smallest capacity holding all keys, return true if the table shrank
+    bool Compact() {
+        auto size = FindNextCapacity(Size() > 1 ? Size() : 1);
+        if (size == -1 || (size >= m_size && !m_old)) {
+            return false;
+        }
+        // a pending migration is finished even if the table keeps its capacity
+        auto old_size = m_size;
+        Rehash(size);
+        return size < old_size;
+    }
+
+    // grow big tables a few slots per insert/erase instead of all at once, so no single insert stalls
+    void SetIncrementalRehash(bool enable) {
+        m_incremental = enable;
+    }
+
+    bool IsRehashing() const {
+        return m_old != 0;
+    }
+
+    // the new table first, then the old one while migrating
+    class Iterator {
+    public:
+        Iterator() : m_map(0), m_index(0) {}
+
+        Iterator(CompactCoalescedHashSet *map) : m_map(map) {
+            m_index = 0;
+            while (m_index < m_map->IterEnd() && !m_map->IterValid(m_index)) {
+                m_index++;
+            }
+        }
+
+        Iterator(CompactCoalescedHashSet *map, int index) : m_map(map), m_index(index) {}
+
+        const Key &GetKey() const {
+            return m_map->IterKey(m_index);
+        }
+
+        Iterator &operator++() {
+            m_index++;
+            while (m_index < m_map->IterEnd() && !m_map->IterValid(m_index)) {
+                m_index++;
+            }
+            return *this;
+        }
+
+        bool operator!=(const Iterator &other) {
+            return m_index != other.m_index;
+        }
+
+    private:
+        CompactCoalescedHashSet *m_map;
+        int m_index;
+    };
+
+    Iterator Begin() {
+        return Iterator(this);
+    }
+
+    Iterator End() {
+        return Iterator(this, IterEnd());
+    }
+
+private:
+    static const uint32_t NIL = 0xFFFFFFFF;
+    static const int SHRINK_MIN_SIZE = 64;
+    static const int INCREMENTAL_MIN_SIZE = 1 << 12; // smaller tables rehash at once in tens of microseconds
+    static const int MIGRATE_STEP = 4; // slots of the old table moved per insert/erase
+
+    // table being migrated, read only but for erase, which just clears the bit so its chains stay walkable
+    struct OldTable {
+        Key *keys;
+        uint32_t *next;
+        uint8_t *bitmap;
+        int size;
+        int count;
+        int pos; // slots below are migrated
+
+        uint32_t Next(uint32_t index) const {
+            return ~next[index];
+        }
+
+        bool Valid(uint32_t index) const {
+            return bitmap[index / 8] & (1 << (index % 8));
+        }
+
+        void ClearValid(uint32_t index) {
+            bitmap[index / 8] &= ~(1 << (index % 8));
+        }
+    };
+
+    // [keys][next links][bitmap], keys first so they keep their alignment
+    static size_t KeysSize(int size) {
+        return (size * sizeof(Key) + sizeof(uint32_t) - 1) / sizeof(uint32_t) * sizeof(uint32_t);
+    }
+
+    static size_t AllocSize(int size) {
+        return KeysSize(size) + size * sizeof(uint32_t) + (size + 7) / 8;
+    }
+
+    // zeroed memory is a valid empty table: links are stored inverted so 0 is NIL, and keys of empty slots
+    // are never read. so big tables come from calloc, whose pages the os maps lazily, and growing does not
+    // touch the whole new table at once. keys with a destructor still need constructing
+    void Alloc(int size) {
+        auto data = (char *) calloc(AllocSize(size), 1);
+        if (!data) {
+            throw std::bad_alloc();
+        }
+        m_keys = (Key *) data;
+        if (!std::is_trivially_copyable<Key>::value) {
+            for (int i = 0; i < size; i++) {
+                new(&m_keys[i]) Key();
+            }
+        }
+        m_next = (uint32_t *) (data + KeysSize(size));
+        m_bitmap = (uint8_t *) (m_next + size);
+        m_size = size;
+        m_last_free = size;
+        m_count = 0;
+    }
+
+    static void Free(Key *keys, int size) {
+        if (!std::is_trivially_copyable<Key>::value) {
+            for (int i = 0; i < size; i++) {
+                keys[i].~Key();
+            }
+        }
+        free(keys);
+    }
+
+    template<typename OtherKey>
+    uint32_t MainPosition(const OtherKey &other_key) const {
+        return FastRange(Hash()(other_key), m_size);
+    }
+
+    bool Valid(uint32_t index) const {
+        return m_bitmap[index / 8] & (1 << (index % 8));
+    }
+
+    void SetValid(uint32_t index) {
+        m_bitmap[index / 8] |= (1 << (index % 8));
+    }
+
+    void ClearValid(uint32_t index) {
+        m_bitmap[index / 8] &= ~(1 << (index % 8));
+    }
+
+    uint32_t Next(uint32_t index) const {
+        return ~m_next[index];
+    }
+
+    void SetNext(uint32_t index, uint32_t next) {
+        m_next[index] = ~next;
+    }
+
+    // near full load the scan may cross millions of taken slots, so skip 64 of them per full bitmap word
+    uint32_t GetFreePosition() {
+        while (m_last_free > 0) {
+            m_last_free--;
+            if ((m_last_free & 63) == 63) {
+                uint64_t word;
+                memcpy(&word, m_bitmap + m_last_free / 8 - 7, sizeof(word));
+                if (word == ~0ull) {
+                    m_last_free -= 63;
+                    continue;
+                }
+            }
+            if (!Valid(m_last_free)) {
+                return m_last_free;
+            }
+        }
+        return NIL; /* could not find a free place */
+    }
+
+    int FindNextCapacity(int n) {
+        auto it = std::lower_bound(std::begin(primes), std::end(primes), n);
+        return it != std::end(primes) ? *it : -1;
+    }
+
+    /*
+    ** inserts a new key into the new table, lua style; the key must not be in the old table
+    */
+    bool InsertNew(const Key &key) {
+        auto mp = MainPosition(key);
+        if (Valid(mp)) { /* main position is taken? */
+            // try to find key first
+            auto cur = mp;
+            while (cur != NIL) {
+                if (Equal()(m_keys[cur], key)) {
+                    m_keys[cur] = key;
+                    return false;
+                }
+                cur = Next(cur);
+            }
+
+            auto f = GetFreePosition(); /* get a free place */
+            if (f == NIL) { /* cannot find a free place? */
+                auto b = Rehash();  /* grow table */
+                if (b < 0) {
+                    return false;  /* grow failed */
+                }
+                return InsertNew(key);  /* insert key into grown table */
+            }
+            auto othern = MainPosition(m_keys[mp]); /* other node's main position */
+            if (othern != mp) {  /* is colliding node out of its main position? */
+                /* yes; move colliding node into free position */
+                while (Next(othern) != mp) { /* find previous */
+                    othern = Next(othern);
+                }
+                SetNext(othern, f); /* rechain to point to 'f' */
+                m_keys[f] = m_keys[mp]; /* copy colliding node into free pos. */
+                SetNext(f, Next(mp));
+                SetValid(f);
+                SetNext(mp, NIL); /* now 'mp' is free */
+            } else { /* colliding node is in its own main position */
+                /* new node will go into free position */
+                SetNext(f, Next(mp)); /* chain new position */
+                SetNext(mp, f);
+                mp = f;
+            }
+        } else {
+            SetNext(mp, NIL);
+        }
+        m_keys[mp] = key;
+        SetValid(mp);
+        m_count++;
+        return true;
+    }
+
+    // chains of the old table are intact, migrated or erased slots are skipped by their bit
+    template<typename OtherKey>
+    uint32_t FindOld(const OtherKey &other_key) const {
+        auto cur = (uint32_t) FastRange(Hash()(other_key), m_old->size);
+        while (cur != NIL) {
+            if (m_old->Valid(cur) && Equal()(m_old->keys[cur], other_key)) {
+                return cur;
+            }
+            cur = m_old->Next(cur);
+        }
+        return NIL;
+    }
+
+    void MigrateStep() {
+        auto end = std::min(m_old->pos + MIGRATE_STEP, m_old->size);
+        for (; m_old->pos < end; m_old->pos++) {
+            auto pos = m_old->pos;
+            if (m_old->Valid(pos)) {
+                m_old->ClearValid(pos);
+                m_old->count--;
+                // the new table was sized for all old keys, so this never grows it, but be safe if it did,
+                // a grow frees the old keys, so insert a copy
+                Key key = m_old->keys[pos];
+                InsertNew(key);
+                if (!m_old) {
+                    return;
+                }
+            }
+        }
+        if (m_old->pos == m_old->size) {
+            Free(m_old->keys, m_old->size);
+            delete m_old;
+            m_old = 0;
+        }
+    }
+
+    // grow at least double, a table full of n keys rehash log(n) times, not once per prime
+    int Rehash() {
+        auto size = FindNextCapacity(Capacity() * 2);
+        if (size == -1) {
+            return -1;
+        }
+        if (m_incremental && !m_old && m_size >= INCREMENTAL_MIN_SIZE) {
+            m_old = new OldTable{m_keys, m_next, m_bitmap, m_size, m_count, 0};
+            Alloc(size);
+            return 0;
+        }
+        return Rehash(size);
+    }
+
+    // shrink when load drops under 1/8, down to about half load, so the table is far from both the grow
+    // and the shrink point afterwards and insert/erase around one size does not rehash back and forth
+    void ShrinkIfSparse() {
+        if (m_old || m_size <= SHRINK_MIN_SIZE || m_count * 8 >= m_size) {
+            return;
+        }
+        auto size = m_count * 2;
+        Rehash(FindNextCapacity(size > SHRINK_MIN_SIZE ? size : SHRINK_MIN_SIZE));
+    }
+
+    // rehash at once, also finishes a migration
+    int Rehash(int size) {
+        if (size == -1) {
+            return -1;
+        }
+        auto oldkeys = m_keys;
+        auto oldbitmap = m_bitmap;
+        auto oldsize = m_size;
+        auto old = m_old;
+        m_old = 0;
+        Alloc(size);
+        for (int i = 0; i < oldsize; i++) {
+            if (oldbitmap[i / 8] & (1 << (i % 8))) {
+                InsertNew(oldkeys[i]);
+            }
+        }
+        Free(oldkeys, oldsize);
+        if (old) {
+            for (int i = old->pos; i < old->size; i++) {
+                if (old->Valid(i)) {
+                    InsertNew(old->keys[i]);
+                }
+            }
+            Free(old->keys, old->size);
+            delete old;
+        }
+        return 0;
+    }
+
+    int IterEnd() const {
+        return m_size + (m_old ? m_old->size : 0);
+    }
+
+    bool IterValid(int index) const {
+        return index < m_size ? Valid(index) : m_old->Valid(index - m_size);
+    }
+
+    const Key &IterKey(int index) const {
+        return index < m_size ? m_keys[index] : m_old->keys[index - m_size];
+    }
+
+private:
+    int m_size = 0;
+    int m_count = 0; // valid key count
+    uint32_t m_last_free = 0; // all slots at or above are taken
+    bool m_incremental = true;
+    Key *m_keys;
+    uint32_t *m_next;
+    uint8_t *m_bitmap;
+    OldTable *m_old = 0; // table being migrated by incremental rehash
+};
+
+// map on top of a coalesced set type, see CoalescedHashMap and CompactCoalescedHashMap below
+template<typename Key, typename Value, typename Hash, typename Equal, template<typename, typename, typename> class Set>
+class BasicCoalescedHashMap {
 private:
     struct KeyValue {
         Key key;
@@ -441,18 +1016,18 @@ private:
         }
     };
 
-    typedef CoalescedHashSet<KeyValue, KeyValueHash, KeyValueEqual> CoalescedHashSetType;
+    typedef Set<KeyValue, KeyValueHash, KeyValueEqual> CoalescedHashSetType;
     CoalescedHashSetType m_set;
 
 public:
-    CoalescedHashMap(int size = 1) : m_set(size) {
+    BasicCoalescedHashMap(int size = 1) : m_set(size) {
     }
 
-    ~CoalescedHashMap() {
+    ~BasicCoalescedHashMap() {
     }
 
-    void Insert(const Key &key, const Value &value) {
-        m_set.Insert({key, value});
+    bool Insert(const Key &key, const Value &value) {
+        return m_set.Insert({key, value});
     }
 
     bool Find(const Key &key, Value &value) {
@@ -464,6 +1039,10 @@ public:
         return false;
     }
 
+    void Prefetch(const Key &key) const {
+        m_set.Prefetch(key);
+    }
+
     bool Erase(const Key &key) {
         return m_set.Erase(key);
     }
@@ -472,10 +1051,30 @@ public:
         return m_set.Capacity();
     }
 
+    size_t MemorySize() const {
+        return sizeof(*this) - sizeof(m_set) + m_set.MemorySize();
+    }
+
     int Size() const {
         return m_set.Size();
     }
 
+    void Reserve(int n) {
+        m_set.Reserve(n);
+    }
+
+    bool Compact() {
+        return m_set.Compact();
+    }
+
+    void SetIncrementalRehash(bool enable) {
+        m_set.SetIncrementalRehash(enable);
+    }
+
+    bool IsRehashing() const {
+        return m_set.IsRehashing();
+    }
+
     int MainPositionSize() const {
         return m_set.MainPositionSize();
     }
@@ -486,6 +1085,8 @@ public:
 
     class Iterator {
     public:
+        Iterator() {}
+
         Iterator(typename CoalescedHashSetType::Iterator it) : m_set_iter(it) {}
 
         const Key &GetKey() const {
@@ -519,4 +1120,638 @@ public:
 
 };
 
+template<typename Key, typename Value, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>>
+using CoalescedHashMap = BasicCoalescedHashMap<Key, Value, Hash, Equal, CoalescedHashSet>;
+
+template<typename Key, typename Value, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>>
+using CompactCoalescedHashMap = BasicCoalescedHashMap<Key, Value, Hash, Equal, CompactCoalescedHashSet>;
+
+// linear search of the first size keys of a flat key array, return index or -1
+template<typename Key, typename Equal>
+struct FlatSearch {
+    template<typename OtherKey>
+    static int Find(const Key *keys, int size, const OtherKey &key) {
+        for (int i = 0; i < size; i++) {
+            if (Equal()(keys[i], key)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+};
+
+// index of the lowest set bit, bits must not be 0
+static inline int LowestBit(uint64_t bits) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(bits);
+#else
+    int ret = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        ret++;
+    }
+    return ret;
+#endif
+}
+
+// bits needed to hold v, 0 for 0
+static inline int BitWidth(uint64_t v) {
+#if defined(__GNUC__)
+    return v ? 64 - __builtin_clzll(v) : 0;
+#else
+    int ret = 0;
+    while (v) {
+        v >>= 1;
+        ret++;
+    }
+    return ret;
+#endif
+}
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+
+// compare 4 int32 keys per instruction, every key gives 4 mask bits. the key array is sized to the entries,
+// so only whole groups of 4 are loaded and the rest is compared one by one
+template<>
+struct FlatSearch<int32_t, std::equal_to<int32_t>> {
+    static int Find(const int32_t *keys, int size, int32_t key) {
+        auto needle = _mm_set1_epi32(key);
+        int i = 0;
+        for (; i + 4 <= size; i += 4) {
+            auto cmp = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (keys + i)), needle);
+            int mask = _mm_movemask_epi8(cmp);
+            if (mask) {
+                return i + LowestBit(mask) / 4;
+            }
+        }
+        for (; i < size; i++) {
+            if (keys[i] == key) {
+                return i;
+            }
+        }
+        return -1;
+    }
+};
+
+// sse2 has no 64 bit compare, a key matches when both of its 32 bit halves do
+template<>
+struct FlatSearch<int64_t, std::equal_to<int64_t>> {
+    static int Find(const int64_t *keys, int size, int64_t key) {
+        auto needle = _mm_set1_epi64x(key);
+        int i = 0;
+        for (; i + 2 <= size; i += 2) {
+            auto cmp = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (keys + i)), needle);
+            int mask = _mm_movemask_epi8(cmp);
+            if ((mask & 0xFF) == 0xFF) {
+                return i;
+            }
+            if ((mask >> 8) == 0xFF) {
+                return i + 1;
+            }
+        }
+        return i < size && keys[i] == key ? i : -1;
+    }
+};
+
+#endif
+
+// integer keys can live in a direct indexed array, key = base + index, other key types never do
+template<typename Key>
+struct DenseIndex {
+    static const bool enable = false;
+
+    static bool Less(const Key &lhs, const Key &rhs) {
+        return false;
+    }
+
+    static uint64_t Offset(const Key &key, const Key &base) {
+        return ~0ull;
+    }
+
+    static Key FromIndex(const Key &base, int index) {
+        return base;
+    }
+};
+
+template<typename Key>
+struct IntDenseIndex {
+    static const bool enable = true;
+
+    static bool Less(Key lhs, Key rhs) {
+        return lhs < rhs;
+    }
+
+    // key below base wraps to a huge offset, so it is out of any array
+    static uint64_t Offset(Key key, Key base) {
+        return (uint64_t) key - (uint64_t) base;
+    }
+
+    static Key FromIndex(Key base, int index) {
+        return (Key) ((uint64_t) base + index);
+    }
+};
+
+template<>
+struct DenseIndex<int32_t> : public IntDenseIndex<int32_t> {
+};
+
+template<>
+struct DenseIndex<int64_t> : public IntDenseIndex<int64_t> {
+};
+
+// map keeping up to N entries in flat key/value arrays searched linearly, most maps are that small.
+// the arrays share one block sized to the entries, grown by doubling up to N, so an empty map allocates nothing
+// and a map of 1 or 2 entries pays for 1 or 2. past N it promotes to CompactCoalescedHashMap,
+// and demotes back when erased down to N / 2.
+// once promoted, integer keys in a dense range go to an array part like lua table, keys outside the range stay
+// in the hash part. the plan scans and rebuilds the whole map, so it runs as the hash part grows only while the
+// map is small, bigger maps are planned by the owner after a bulk fill (cpp_table does at sink time) and on Compact
+template<typename Key, typename Value, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>, int N = 8>
+class SmallCoalescedHashMap {
+private:
+    typedef CompactCoalescedHashMap<Key, Value, Hash, Equal> HashMapType;
+    typedef DenseIndex<Key> DenseIndexType;
+
+    // same bound as the incremental rehash of the hash part, a plan of fewer keys takes tens of microseconds
+    static const int PLAN_ON_GROW_MAX_SIZE = 1 << 12;
+
+    // state after promotion, kept out of line so small maps stay small
+    struct Large {
+        HashMapType hash;
+        Key base = Key();
+        int array_size = 0;
+        int array_count = 0;
+        Value *array = 0; // array_size values then the presence bitmap
+
+        ~Large() {
+            delete[] (char *) array;
+        }
+
+        void AllocArray(int size) {
+            array_size = size;
+            if (!size) {
+                return;
+            }
+            array = (Value *) new char[size * sizeof(Value) + (size + 7) / 8];
+            for (int i = 0; i < size; i++) {
+                new(&array[i]) Value();
+            }
+            memset(Bitmap(), 0, (size + 7) / 8);
+        }
+
+        uint8_t *Bitmap() const {
+            return (uint8_t *) (array + array_size);
+        }
+
+        bool Present(int index) const {
+            return Bitmap()[index / 8] & (1 << (index % 8));
+        }
+
+        bool ToIndex(const Key &key, int &index) const {
+            auto offset = DenseIndexType::Offset(key, base);
+            if (offset >= (uint64_t) array_size) {
+                return false;
+            }
+            index = (int) offset;
+            return true;
+        }
+
+        // return true if key is new
+        bool Insert(const Key &key, const Value &value) {
+            int index;
+            if (ToIndex(key, index)) {
+                array[index] = value;
+                if (Present(index)) {
+                    return false;
+                }
+                Bitmap()[index / 8] |= (1 << (index % 8));
+                array_count++;
+                return true;
+            }
+            return hash.Insert(key, value);
+        }
+
+        size_t MemorySize() const {
+            return sizeof(*this) - sizeof(hash) + hash.MemorySize() + array_size * sizeof(Value) +
+                   (array_size + 7) / 8;
+        }
+    };
+
+public:
+    SmallCoalescedHashMap() {
+    }
+
+    ~SmallCoalescedHashMap() {
+        FreeFlat();
+        delete m_large;
+    }
+
+    SmallCoalescedHashMap(const SmallCoalescedHashMap &) = delete;
+
+    SmallCoalescedHashMap &operator=(const SmallCoalescedHashMap &) = delete;
+
+    // return true if key is new, false if key exist and replaced
+    bool Insert(const Key &key, const Value &value) {
+        if (m_large) {
+            int index;
+            if (m_large->array_size && m_large->ToIndex(key, index)) {
+                return m_large->Insert(key, value);
+            }
+            auto capacity = m_large->hash.Capacity();
+            auto ret = m_large->hash.Insert(key, value);
+            if (m_large->hash.Capacity() > capacity && Size() < PLAN_ON_GROW_MAX_SIZE && MaybeDense()) {
+                PlanArray();
+            }
+            return ret;
+        }
+        auto i = FlatSearch<Key, Equal>::Find(m_keys, m_size, key);
+        if (i >= 0) {
+            m_values[i] = value;
+            return false;
+        }
+        if (m_size < N) {
+            if (m_size == m_capacity) {
+                ResizeFlat(std::min(m_capacity ? m_capacity * 2 : 1, N));
+            }
+            m_keys[m_size] = key;
+            m_values[m_size] = value;
+            m_size++;
+            return true;
+        }
+        Promote(N * 2);
+        m_large->hash.Insert(key, value);
+        PlanArray();
+        return true;
+    }
+
+    bool Find(const Key &key, Value &value) {
+        if (m_large) {
+            int index;
+            if (m_large->array_size && m_large->ToIndex(key, index)) {
+                if (!m_large->Present(index)) {
+                    return false;
+                }
+                value = m_large->array[index];
+                return true;
+            }
+            return m_large->hash.Find(key, value);
+        }
+        auto i = FlatSearch<Key, Equal>::Find(m_keys, m_size, key);
+        if (i < 0) {
+            return false;
+        }
+        value = m_values[i];
+        return true;
+    }
+
+    // small maps are already in cache with the map itself, only the large parts are worth a prefetch
+    void Prefetch(const Key &key) const {
+        if (m_large) {
+            int index;
+            if (m_large->array_size && m_large->ToIndex(key, index)) {
+                PrefetchLine(&m_large->array[index]);
+                return;
+            }
+            m_large->hash.Prefetch(key);
+        }
+    }
+
+    bool Erase(const Key &key) {
+        if (m_large) {
+            int index;
+            if (m_large->array_size && m_large->ToIndex(key, index)) {
+                if (!m_large->Present(index)) {
+                    return false;
+                }
+                m_large->Bitmap()[index / 8] &= ~(1 << (index % 8));
+                m_large->array[index] = Value();
+                m_large->array_count--;
+            } else if (!m_large->hash.Erase(key)) {
+                return false;
+            }
+            if (Size() <= N / 2) {
+                Demote();
+            } else if (m_large->array_count * 8 < m_large->array_size) {
+                // sparse array part, same threshold as the hash part shrinking
+                PlanArray();
+            }
+            return true;
+        }
+        auto i = FlatSearch<Key, Equal>::Find(m_keys, m_size, key);
+        if (i < 0) {
+            return false;
+        }
+        // move the last entry into the hole
+        m_size--;
+        m_keys[i] = m_keys[m_size];
+        m_values[i] = m_values[m_size];
+        m_keys[m_size] = Key();
+        m_values[m_size] = Value();
+        return true;
+    }
+
+    int Capacity() const {
+        return m_large ? m_large->array_size + m_large->hash.Capacity() : m_capacity;
+    }
+
+    size_t MemorySize() const {
+        return sizeof(*this) + (m_keys ? FlatBytes(m_capacity) : 0) + (m_large ? m_large->MemorySize() : 0);
+    }
+
+    int Size() const {
+        return m_large ? m_large->array_count + m_large->hash.Size() : m_size;
+    }
+
+    int ArraySize() const {
+        return m_large ? m_large->array_size : 0;
+    }
+
+    void Reserve(int n) {
+        if (m_large) {
+            m_large->hash.Reserve(n - m_large->array_count);
+        } else if (n > N) {
+            Promote(n);
+        } else if (n > m_capacity) {
+            ResizeFlat(FlatCapacity(n));
+        }
+    }
+
+    bool Compact() {
+        if (!m_large) {
+            if (FlatCapacity(m_size) >= m_capacity) {
+                return false;
+            }
+            ResizeFlat(FlatCapacity(m_size));
+            return true;
+        }
+        if (Size() <= N) {
+            Demote();
+            return true;
+        }
+        auto capacity = Capacity();
+        PlanArray();
+        m_large->hash.Compact();
+        return Capacity() < capacity;
+    }
+
+    // choose the array part for the current keys, the largest power of 2 size counted from base that is more
+    // than half used, same rule as lua computesizes(). base is tried at each of the few smallest keys,
+    // so some low outliers do not leave all other keys out
+    void PlanArray() {
+        if (!DenseIndexType::enable || !m_large || !Size()) {
+            return;
+        }
+        const int max_base = 4;
+        const int max_bits = 30;
+
+        // the smallest keys in ascending order
+        Key bases[max_base];
+        int base_count = 0;
+        for (auto it = Begin(), end = End(); it != end; ++it) {
+            auto key = it.GetKey();
+            int i = base_count;
+            while (i > 0 && DenseIndexType::Less(key, bases[i - 1])) {
+                i--;
+            }
+            if (i == max_base) {
+                continue;
+            }
+            for (int j = std::min(base_count, max_base - 1); j > i; j--) {
+                bases[j] = bases[j - 1];
+            }
+            bases[i] = key;
+            base_count = std::min(base_count + 1, max_base);
+        }
+
+        // nums[b][i] is the count of keys with offset to bases[b] in [2^(i-1), 2^i), the last slot takes
+        // offsets out of range, no branch since random keys would mispredict it every time
+        int nums[max_base][max_bits + 2] = {};
+        for (auto it = Begin(), end = End(); it != end; ++it) {
+            auto key = it.GetKey();
+            for (int b = 0; b < base_count; b++) {
+                auto width = BitWidth(DenseIndexType::Offset(key, bases[b]));
+                nums[b][width <= max_bits ? width : max_bits + 1]++;
+            }
+        }
+
+        Key base = bases[0];
+        int array_size = 0;
+        int array_count = 0;
+        for (int b = 0; b < base_count; b++) {
+            int count = 0;
+            for (int i = 0; i <= max_bits; i++) {
+                count += nums[b][i];
+                if (count > (1 << i) / 2 && count > array_count) {
+                    base = bases[b];
+                    array_size = 1 << i;
+                    array_count = count;
+                }
+            }
+        }
+        // not worth it for a few keys
+        if (array_count < N) {
+            array_size = 0;
+            array_count = 0;
+        }
+        bool same_base = !DenseIndexType::Less(base, m_large->base) && !DenseIndexType::Less(m_large->base, base);
+        if (array_size == m_large->array_size && (!array_size || same_base)) {
+            return;
+        }
+
+        auto large = new Large();
+        large->base = base;
+        large->AllocArray(array_size);
+        large->hash.Reserve(Size() - array_count);
+        for (auto it = Begin(); it != End(); ++it) {
+            large->Insert(it.GetKey(), it.GetValue());
+        }
+        delete m_large;
+        m_large = large;
+    }
+
+    class Iterator {
+    public:
+        Iterator(SmallCoalescedHashMap *map, int index) : m_map(map), m_index(index) {}
+
+        Iterator(SmallCoalescedHashMap *map, int index, typename HashMapType::Iterator it) : m_map(map),
+                                                                                            m_index(index),
+                                                                                            m_hash_iter(it) {
+            SkipEmpty();
+        }
+
+        // array part keys are not stored, so return by value
+        Key GetKey() const {
+            auto large = m_map->m_large;
+            if (!large) {
+                return m_map->m_keys[m_index];
+            }
+            if (m_index < large->array_size) {
+                return DenseIndexType::FromIndex(large->base, m_index);
+            }
+            return m_hash_iter.GetKey();
+        }
+
+        const Value &GetValue() const {
+            auto large = m_map->m_large;
+            if (!large) {
+                return m_map->m_values[m_index];
+            }
+            if (m_index < large->array_size) {
+                return large->array[m_index];
+            }
+            return m_hash_iter.GetValue();
+        }
+
+        Iterator &operator++() {
+            auto large = m_map->m_large;
+            if (large && m_index >= large->array_size) {
+                ++m_hash_iter;
+            } else {
+                m_index++;
+                SkipEmpty();
+            }
+            return *this;
+        }
+
+        bool operator!=(const Iterator &other) {
+            return m_index != other.m_index || (m_map->m_large && m_hash_iter != other.m_hash_iter);
+        }
+
+    private:
+        void SkipEmpty() {
+            auto large = m_map->m_large;
+            if (large) {
+                while (m_index < large->array_size && !large->Present(m_index)) {
+                    m_index++;
+                }
+            }
+        }
+
+    private:
+        SmallCoalescedHashMap *m_map;
+        int m_index;
+        typename HashMapType::Iterator m_hash_iter;
+    };
+
+    Iterator Begin() {
+        return m_large ? Iterator(this, 0, m_large->hash.Begin()) : Iterator(this, 0);
+    }
+
+    Iterator End() {
+        return m_large ? Iterator(this, m_large->array_size, m_large->hash.End()) : Iterator(this, m_size);
+    }
+
+private:
+    void Promote(int n) {
+        m_large = new Large();
+        m_large->hash.Reserve(n);
+        for (int i = 0; i < m_size; i++) {
+            m_large->hash.Insert(m_keys[i], m_values[i]);
+        }
+        FreeFlat();
+    }
+
+    // cheap guess before PlanArray, so maps of random keys do not pay a full scan at every growth.
+    // hash order is random, so the first keys of the hash part are a random sample of it, the hash part
+    // may be dense if a quarter of the sample lies in a window at most 4 times wider than the keys it stands for
+    bool MaybeDense() {
+        if (!DenseIndexType::enable) {
+            return false;
+        }
+        const int max_sample = 64;
+        Key sample[max_sample];
+        int n = 0;
+        for (auto it = m_large->hash.Begin(), end = m_large->hash.End(); it != end && n < max_sample; ++it) {
+            sample[n++] = it.GetKey();
+        }
+        if (!n) {
+            return false;
+        }
+        std::sort(sample, sample + n, DenseIndexType::Less);
+        double keys_per_sample = (double) m_large->hash.Size() / n;
+        int i = 0;
+        for (int j = 0; j < n; j++) {
+            while ((double) DenseIndexType::Offset(sample[j], sample[i]) + 1 > 4 * (j - i + 1) * keys_per_sample) {
+                i++;
+            }
+            if ((j - i + 1) * 4 >= n) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // flat arrays are unused while promoted, so fill them straight from the iterator
+    void Demote() {
+        ResizeFlat(FlatCapacity(Size()));
+        int size = 0;
+        for (auto it = Begin(); it != End(); ++it) {
+            m_keys[size] = it.GetKey();
+            m_values[size] = it.GetValue();
+            size++;
+        }
+        delete m_large;
+        m_large = 0;
+        m_size = size;
+    }
+
+    // smallest flat capacity in the doubling steps that holds n entries
+    static int FlatCapacity(int n) {
+        int capacity = n ? 1 : 0;
+        while (capacity < n) {
+            capacity *= 2;
+        }
+        return std::min(capacity, N);
+    }
+
+    // capacity keys then capacity values, the values aligned
+    static size_t FlatValueOffset(int capacity) {
+        return (capacity * sizeof(Key) + alignof(Value) - 1) / alignof(Value) * alignof(Value);
+    }
+
+    static size_t FlatBytes(int capacity) {
+        return FlatValueOffset(capacity) + capacity * sizeof(Value);
+    }
+
+    // move the first m_size entries to a new block of capacity entries, 0 frees the block
+    void ResizeFlat(int capacity) {
+        Key *keys = 0;
+        Value *values = 0;
+        if (capacity) {
+            auto block = new char[FlatBytes(capacity)];
+            keys = (Key *) block;
+            values = (Value *) (block + FlatValueOffset(capacity));
+            for (int i = 0; i < capacity; i++) {
+                new(&keys[i]) Key(i < m_size ? std::move(m_keys[i]) : Key());
+                new(&values[i]) Value(i < m_size ? m_values[i] : Value());
+            }
+        }
+        int size = std::min(m_size, capacity);
+        FreeFlat();
+        m_keys = keys;
+        m_values = values;
+        m_capacity = capacity;
+        m_size = size;
+    }
+
+    void FreeFlat() {
+        for (int i = 0; i < m_capacity; i++) {
+            m_keys[i].~Key();
+            m_values[i].~Value();
+        }
+        delete[] (char *) m_keys;
+        m_keys = 0;
+        m_values = 0;
+        m_capacity = 0;
+        m_size = 0;
+    }
+
+private:
+    Key *m_keys = 0;
+    Value *m_values = 0;
+    int m_size = 0;
+    int m_capacity = 0;
+    Large *m_large = 0;
+};
+
 }
@@ -0,0 +1,383 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define SWISS_HASHMAP_SSE2 1
+#else
+#define SWISS_HASHMAP_SSE2 0
+#endif
+
+namespace swiss_hashmap {
+
+// swiss table style open addressing, see https://abseil.io/about/design/swisstables
+// every slot has a control byte: empty, deleted, or the top 7 bits of the hash of its key.
+// a probe loads a group of 16 control bytes and compares them at once, only slots whose byte matches are read
+
+static const int GROUP_WIDTH = 16;
+static const int8_t CTRL_EMPTY = -128;
+static const int8_t CTRL_DELETED = -2;
+
+static inline int TrailingZeros(uint32_t bits) {
+#if defined(__GNUC__)
+    return __builtin_ctz(bits);
+#else
+    int ret = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        ret++;
+    }
+    return ret;
+#endif
+}
+
+static inline void PrefetchLine(const void *addr) {
+#if defined(__GNUC__)
+    __builtin_prefetch(addr);
+#elif SWISS_HASHMAP_SSE2
+    _mm_prefetch((const char *) addr, _MM_HINT_T0);
+#else
+    (void) addr;
+#endif
+}
+
+// bit i of a mask is control byte i of the group
+class Group {
+public:
+    explicit Group(const int8_t *ctrl) {
+#if SWISS_HASHMAP_SSE2
+        m_ctrl = _mm_loadu_si128((const __m128i *) ctrl);
+#else
+        memcpy(m_ctrl, ctrl, GROUP_WIDTH);
+#endif
+    }
+
+    uint32_t Match(int8_t h2) const {
+#if SWISS_HASHMAP_SSE2
+        return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), m_ctrl));
+#else
+        uint32_t mask = 0;
+        for (int i = 0; i < GROUP_WIDTH; i++) {
+            mask |= (uint32_t) (m_ctrl[i] == h2) << i;
+        }
+        return mask;
+#endif
+    }
+
+    uint32_t MatchEmpty() const {
+        return Match(CTRL_EMPTY);
+    }
+
+    // empty and deleted are the only negative control bytes
+    uint32_t MatchEmptyOrDeleted() const {
+#if SWISS_HASHMAP_SSE2
+        return (uint32_t) _mm_movemask_epi8(m_ctrl);
+#else
+        uint32_t mask = 0;
+        for (int i = 0; i < GROUP_WIDTH; i++) {
+            mask |= (uint32_t) (m_ctrl[i] < 0) << i;
+        }
+        return mask;
+#endif
+    }
+
+private:
+#if SWISS_HASHMAP_SSE2
+    __m128i m_ctrl;
+#else
+    int8_t m_ctrl[GROUP_WIDTH];
+#endif
+};
+
+template<typename Key, typename Value, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>>
+class SwissHashMap {
+private:
+    struct Slot {
+        Slot(const Key &k, const Value &v) : key(k), value(v) {}
+
+        Key key;
+        Value value;
+    };
+
+public:
+    SwissHashMap() {}
+
+    ~SwissHashMap() {
+        Free(m_ctrl, m_slots, m_capacity);
+    }
+
+    SwissHashMap(const SwissHashMap &) = delete;
+
+    SwissHashMap &operator=(const SwissHashMap &) = delete;
+
+    // return true if key is new, false if key exist and replaced
+    bool Insert(const Key &key, const Value &value) {
+        auto hash = HashOf(key);
+        auto index = FindIndex(key, hash);
+        if (index != NPOS) {
+            m_slots[index].value = value;
+            return false;
+        }
+        if (!m_growth_left) {
+            Grow();
+        }
+        index = FindInsertPosition(hash);
+        if (m_ctrl[index] == CTRL_EMPTY) {
+            m_growth_left--;
+        }
+        m_ctrl[index] = H2(hash);
+        new(&m_slots[index]) Slot(key, value);
+        m_size++;
+        return true;
+    }
+
+    bool Find(const Key &key, Value &value) const {
+        auto index = FindIndex(key, HashOf(key));
+        if (index == NPOS) {
+            return false;
+        }
+        value = m_slots[index].value;
+        return true;
+    }
+
+    // a slot whose group still has an empty byte never stopped a probe, so it goes back to empty,
+    // otherwise later keys may have probed past it and it becomes a tombstone
+    bool Erase(const Key &key) {
+        auto index = FindIndex(key, HashOf(key));
+        if (index == NPOS) {
+            return false;
+        }
+        m_slots[index].~Slot();
+        if (Group(m_ctrl + index / GROUP_WIDTH * GROUP_WIDTH).MatchEmpty()) {
+            m_ctrl[index] = CTRL_EMPTY;
+            m_growth_left++;
+        } else {
+            m_ctrl[index] = CTRL_DELETED;
+        }
+        m_size--;
+        ShrinkIfSparse();
+        return true;
+    }
+
+    void Prefetch(const Key &key) const {
+        if (m_capacity) {
+            auto group = ProbeStart(HashOf(key)) * GROUP_WIDTH;
+            PrefetchLine(m_ctrl + group);
+            PrefetchLine(&m_slots[group]);
+        }
+    }
+
+    int Capacity() const {
+        return (int) m_capacity;
+    }
+
+    size_t MemorySize() const {
+        return sizeof(*this) + m_capacity * (1 + sizeof(Slot));
+    }
+
+    int Size() const {
+        return (int) m_size;
+    }
+
+    void Reserve(int n) {
+        auto capacity = CapacityFor(n);
+        if (capacity > m_capacity) {
+            Resize(capacity);
+        }
+    }
+
+    // shrink to the smallest capacity holding all entries, drops tombstones too
+    bool Compact() {
+        auto capacity = m_size ? CapacityFor(m_size) : 0;
+        if (capacity >= m_capacity && m_growth_left == MaxLoad(m_capacity) - m_size) {
+            return false;
+        }
+        Resize(capacity);
+        return true;
+    }
+
+    class Iterator {
+    public:
+        Iterator() : m_map(0), m_index(0) {}
+
+        Iterator(const SwissHashMap *map, size_t index) : m_map(map), m_index(index) {
+            SkipEmpty();
+        }
+
+        const Key &GetKey() const {
+            return m_map->m_slots[m_index].key;
+        }
+
+        const Value &GetValue() const {
+            return m_map->m_slots[m_index].value;
+        }
+
+        Iterator &operator++() {
+            m_index++;
+            SkipEmpty();
+            return *this;
+        }
+
+        bool operator!=(const Iterator &other) const {
+            return m_index != other.m_index;
+        }
+
+        bool operator==(const Iterator &other) const {
+            return m_index == other.m_index;
+        }
+
+    private:
+        void SkipEmpty() {
+            while (m_index < m_map->m_capacity && m_map->m_ctrl[m_index] < 0) {
+                m_index++;
+            }
+        }
+
+    private:
+        const SwissHashMap *m_map;
+        size_t m_index;
+    };
+
+    Iterator Begin() const {
+        return Iterator(this, 0);
+    }
+
+    Iterator End() const {
+        return Iterator(this, m_capacity);
+    }
+
+private:
+    static const size_t NPOS = (size_t) -1;
+    static const size_t SHRINK_MIN_SIZE = 64;
+
+    // fibonacci hashing first, identity hash of int keys has no high bits
+    static uint64_t HashOf(const Key &key) {
+        return (uint64_t) Hash()(key) * 0x9E3779B97F4A7C15ull;
+    }
+
+    static int8_t H2(uint64_t hash) {
+        return (int8_t) (hash >> 57);
+    }
+
+    size_t ProbeStart(uint64_t hash) const {
+        return (size_t) (hash >> 32) & (m_capacity / GROUP_WIDTH - 1);
+    }
+
+    // at most 7/8 full, so every probe meets an empty byte
+    static size_t MaxLoad(size_t capacity) {
+        return capacity - capacity / 8;
+    }
+
+    static size_t CapacityFor(size_t n) {
+        size_t capacity = GROUP_WIDTH;
+        while (MaxLoad(capacity) < n) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    // groups are probed triangularly, which visits every group of a power of 2 table
+    size_t FindIndex(const Key &key, uint64_t hash) const {
+        if (!m_capacity) {
+            return NPOS;
+        }
+        auto mask = m_capacity / GROUP_WIDTH - 1;
+        auto group = ProbeStart(hash);
+        auto h2 = H2(hash);
+        for (size_t i = 1;; i++) {
+            Group g(m_ctrl + group * GROUP_WIDTH);
+            for (auto bits = g.Match(h2); bits; bits &= bits - 1) {
+                auto index = group * GROUP_WIDTH + TrailingZeros(bits);
+                if (Equal()(m_slots[index].key, key)) {
+                    return index;
+                }
+            }
+            if (g.MatchEmpty()) {
+                return NPOS;
+            }
+            group = (group + i) & mask;
+        }
+    }
+
+    size_t FindInsertPosition(uint64_t hash) const {
+        auto mask = m_capacity / GROUP_WIDTH - 1;
+        auto group = ProbeStart(hash);
+        for (size_t i = 1;; i++) {
+            auto bits = Group(m_ctrl + group * GROUP_WIDTH).MatchEmptyOrDeleted();
+            if (bits) {
+                return group * GROUP_WIDTH + TrailingZeros(bits);
+            }
+            group = (group + i) & mask;
+        }
+    }
+
+    // out of empty bytes: rehash in place when tombstones are most of the load, else double
+    void Grow() {
+        if (!m_capacity) {
+            Resize(GROUP_WIDTH);
+        } else if (m_size * 2 <= MaxLoad(m_capacity)) {
+            Resize(m_capacity);
+        } else {
+            Resize(m_capacity * 2);
+        }
+    }
+
+    void ShrinkIfSparse() {
+        if (m_capacity > SHRINK_MIN_SIZE && m_size * 8 < m_capacity) {
+            Resize(CapacityFor(m_size * 2));
+        }
+    }
+
+    // [control bytes][slots], the capacity is a multiple of 16 so the slots stay aligned
+    void Resize(size_t capacity) {
+        auto old_ctrl = m_ctrl;
+        auto old_slots = m_slots;
+        auto old_capacity = m_capacity;
+        m_ctrl = 0;
+        m_slots = 0;
+        m_capacity = capacity;
+        m_growth_left = MaxLoad(capacity);
+        if (capacity) {
+            auto data = (char *) malloc(capacity * (1 + sizeof(Slot)));
+            if (!data) {
+                throw std::bad_alloc();
+            }
+            m_ctrl = (int8_t *) data;
+            m_slots = (Slot *) (data + capacity);
+            memset(m_ctrl, CTRL_EMPTY, capacity);
+        }
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_ctrl[i] >= 0) {
+                auto hash = HashOf(old_slots[i].key);
+                auto index = FindInsertPosition(hash);
+                m_ctrl[index] = H2(hash);
+                new(&m_slots[index]) Slot(old_slots[i]);
+                m_growth_left--;
+            }
+        }
+        Free(old_ctrl, old_slots, old_capacity);
+    }
+
+    static void Free(int8_t *ctrl, Slot *slots, size_t capacity) {
+        for (size_t i = 0; i < capacity; i++) {
+            if (ctrl[i] >= 0) {
+                slots[i].~Slot();
+            }
+        }
+        free(ctrl);
+    }
+
+private:
+    int8_t *m_ctrl = 0;
+    Slot *m_slots = 0;
+    size_t m_capacity = 0;
+    size_t m_size = 0;
+    size_t m_growth_left = 0;
+};
+
+}